@@ -4,6 +4,82 @@
 
 #include "graphics.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/* Pixel kernels. The ESP32 writes a word per two pixels once the address is word aligned,
+ * the host 16 bytes at a time using SSE2. Colors are in the byte order of the buffer. */
+
+static inline uint16_t swap_pixel(uint16_t pixel)
+{
+    return pixel << 8 | pixel >> 8;
+}
+
+/* Set count pixels starting at p to color */
+static void fill_pixels(uint16_t *p, uint16_t color, size_t count)
+{
+    /* black, white and other colors with equal bytes are plain memory fills */
+    if ((color >> 8) == (color & 0xFF)) {
+        memset(p, color & 0xFF, count * sizeof(*p));
+        return;
+    }
+
+    if (((uintptr_t)p & 2) && count > 0) {
+        *p++ = color;
+        count--;
+    }
+#if defined(__SSE2__)
+    const __m128i v = _mm_set1_epi16(color);
+    for (; count >= 8; count -= 8, p += 8) {
+        _mm_storeu_si128((__m128i *)p, v);
+    }
+#endif
+    uint32_t *w = (uint32_t *)p;
+    const uint32_t pair = (uint32_t)color << 16 | color;
+    for (; count >= 8; count -= 8, w += 4) {
+        w[0] = pair;
+        w[1] = pair;
+        w[2] = pair;
+        w[3] = pair;
+    }
+    for (; count >= 2; count -= 2) {
+        *w++ = pair;
+    }
+    if (count > 0) {
+        *(uint16_t *)w = color;
+    }
+}
+
+/* Copy count pixels from src to dst, swapping the bytes of each */
+static void swap_pixels(uint16_t *dst, const uint16_t *src, size_t count)
+{
+#if defined(__SSE2__)
+    for (; count >= 8; count -= 8, dst += 8, src += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)src);
+        _mm_storeu_si128((__m128i *)dst, _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8)));
+    }
+#endif
+    if (((uintptr_t)dst & 2) && count > 0) {
+        *dst++ = swap_pixel(*src++);
+        count--;
+    }
+    /* words can only be loaded from src if it is aligned like dst */
+    if (((uintptr_t)src & 2) == 0) {
+        uint32_t *w = (uint32_t *)dst;
+        const uint32_t *r = (const uint32_t *)src;
+        for (; count >= 2; count -= 2) {
+            const uint32_t v = *r++;
+            *w++ = (v & 0x00FF00FF) << 8 | (v >> 8 & 0x00FF00FF);
+        }
+        dst = (uint16_t *)w;
+        src = (const uint16_t *)r;
+    }
+    for (; count > 0; count--) {
+        *dst++ = swap_pixel(*src++);
+    }
+}
+
 
 void blit(gbuf_t *dst, rect_t dst_rect, gbuf_t *src, rect_t src_rect)
 {
@@ -58,6 +134,13 @@ void blit(gbuf_t *dst, rect_t dst_rect, gbuf_t *src, rect_t src_rect)
         dst_rect.height -= (src_rect.y + dst_rect.height) - src->height;
     }
 
+    /* nothing left once clipped to either buffer */
+    if (dst_rect.width <= 0 || dst_rect.height <= 0) {
+        return;
+    }
+
+    gbuf_mark_dirty(dst, dst_rect);
+
     if (src->bytes_per_pixel == 2 && dst->bytes_per_pixel == 2) {
         if (src->endian == dst->endian) {
             for (short yoff = 0; yoff < dst_rect.height; yoff++) {
@@ -69,45 +152,119 @@ void blit(gbuf_t *dst, rect_t dst_rect, gbuf_t *src, rect_t src_rect)
             for (short yoff = 0; yoff < dst_rect.height; yoff++) {
                 uint16_t *dst_addr = ((uint16_t *)dst->data) + (dst_rect.y + yoff) * dst->width + dst_rect.x;
                 uint16_t *src_addr = ((uint16_t *)src->data) + (src_rect.y + yoff) * src->width + src_rect.x;
-                for (short xoff = 0; xoff < dst_rect.width; xoff++) {
-                    *(dst_addr + xoff) = *(src_addr + xoff) << 8 | *(src_addr + xoff) >> 8;
-                }
+                swap_pixels(dst_addr, src_addr, dst_rect.width);
             }
         }
     }
 }
 
-void draw_line(gbuf_t *g, point_t start, point_t end, draw_style_t style, uint16_t color)
+/* Draw the pixels of a row from x0 to x1, every other one counted from x when dotted */
+static void draw_hspan(gbuf_t *g, short y, short x0, short x1, short x, draw_style_t style, uint16_t color)
 {
-    short inc, dx, dy;
-
-    if (g->endian == BIG_ENDIAN) {
-        color = color << 8 | color >> 8;
+    if (y < 0 || y >= g->height) {
+        return;
     }
-
-    dx = abs(end.x - start.x);
-    dy = abs(end.y - start.y);
-    if (dx >= dy) {
-        inc = dx;
-    } else {
-        inc = dy;
+    if (x0 < 0) {
+        x0 = 0;
+    }
+    if (x1 >= g->width) {
+        x1 = g->width - 1;
+    }
+    if (style == DRAW_STYLE_DOTTED && (x0 - x) % 2 != 0) {
+        x0++;
+    }
+    if (x0 > x1) {
+        return;
     }
-    dx /= inc;
-    dy /= inc;
 
+    uint16_t *pixel = ((uint16_t *)g->data) + y * g->width + x0;
     if (style == DRAW_STYLE_DOTTED) {
-        for (int i = 0; i <= inc; i += 2) {
-            uint16_t *pixel = ((uint16_t *)g->data) + (start.y * g->width) + start.x;
+        for (short n = (x1 - x0) / 2 + 1; n > 0; n--, pixel += 2) {
             *pixel = color;
-            start.x += dx*2;
-            start.y += dy*2;
         }
     } else {
-        for (int i = 0; i <= inc; i++) {
-            uint16_t *pixel = ((uint16_t *)g->data) + (start.y * g->width) + start.x;
-            *pixel = color;
-            start.x += dx;
-            start.y += dy;
+        fill_pixels(pixel, color, x1 - x0 + 1);
+    }
+}
+
+/* Draw the pixels of a column from y0 to y1, every other one counted from y when dotted */
+static void draw_vspan(gbuf_t *g, short x, short y0, short y1, short y, draw_style_t style, uint16_t color)
+{
+    if (x < 0 || x >= g->width) {
+        return;
+    }
+    if (y0 < 0) {
+        y0 = 0;
+    }
+    if (y1 >= g->height) {
+        y1 = g->height - 1;
+    }
+    if (style == DRAW_STYLE_DOTTED && (y0 - y) % 2 != 0) {
+        y0++;
+    }
+    if (y0 > y1) {
+        return;
+    }
+
+    const int stride = style == DRAW_STYLE_DOTTED ? 2 * g->width : g->width;
+    uint16_t *pixel = ((uint16_t *)g->data) + y0 * g->width + x;
+    for (short n = style == DRAW_STYLE_DOTTED ? (y1 - y0) / 2 + 1 : y1 - y0 + 1; n > 0; n--, pixel += stride) {
+        *pixel = color;
+    }
+}
+
+void draw_line(gbuf_t *g, point_t start, point_t end, draw_style_t style, uint16_t color)
+{
+    if (g->endian == BIG_ENDIAN) {
+        color = swap_pixel(color);
+    }
+
+    const short dx = abs(end.x - start.x);
+    const short dy = abs(end.y - start.y);
+
+    rect_t bounds = {
+        .x = start.x < end.x ? start.x : end.x,
+        .y = start.y < end.y ? start.y : end.y,
+        .width = dx + 1,
+        .height = dy + 1,
+    };
+    if (bounds.x >= g->width || bounds.y >= g->height || bounds.x + bounds.width <= 0 || bounds.y + bounds.height <= 0) {
+        return;
+    }
+    gbuf_mark_dirty(g, bounds);
+
+    /* rows are contiguous in memory, columns a stride apart */
+    if (dy == 0) {
+        draw_hspan(g, start.y, bounds.x, bounds.x + dx, start.x, style, color);
+        return;
+    }
+    if (dx == 0) {
+        draw_vspan(g, start.x, bounds.y, bounds.y + dy, start.y, style, color);
+        return;
+    }
+
+    /* Bresenham, pixels outside the buffer are skipped if the line leaves it */
+    const bool inside = bounds.x >= 0 && bounds.y >= 0 &&
+                        bounds.x + bounds.width <= g->width && bounds.y + bounds.height <= g->height;
+    const short sx = start.x < end.x ? 1 : -1;
+    const short sy = start.y < end.y ? 1 : -1;
+    const short steps = dx > dy ? dx : dy;
+    int err = (dx > dy ? dx : -dy) / 2;
+    short x = start.x;
+    short y = start.y;
+    for (short i = 0; i <= steps; i++) {
+        if ((style != DRAW_STYLE_DOTTED || i % 2 == 0) &&
+            (inside || (x >= 0 && y >= 0 && x < g->width && y < g->height))) {
+            ((uint16_t *)g->data)[y * g->width + x] = color;
+        }
+        const int e = err;
+        if (e > -dx) {
+            err -= dy;
+            x += sx;
+        }
+        if (e < dy) {
+            err += dx;
+            y += sy;
         }
     }
 }
@@ -173,13 +330,253 @@ void draw_rectangle3d(gbuf_t *g, rect_t r, uint16_t color_nw, uint16_t color_se)
 void fill_rectangle(gbuf_t *g, rect_t rect, uint16_t color)
 {
     if (g->endian == BIG_ENDIAN) {
-        color = color << 8 | color >> 8;
+        color = swap_pixel(color);
     }
 
+    if (rect.x < 0) {
+        rect.width += rect.x;
+        rect.x = 0;
+    }
+    if (rect.y < 0) {
+        rect.height += rect.y;
+        rect.y = 0;
+    }
+    if (rect.x + rect.width > g->width) {
+        rect.width = g->width - rect.x;
+    }
+    if (rect.y + rect.height > g->height) {
+        rect.height = g->height - rect.y;
+    }
+    if (rect.width <= 0 || rect.height <= 0) {
+        return;
+    }
+
+    gbuf_mark_dirty(g, rect);
+
+    uint16_t *addr = ((uint16_t *)g->data) + rect.y * g->width + rect.x;
+    /* rows spanning the whole buffer are contiguous */
+    if (rect.width == g->width) {
+        fill_pixels(addr, color, (size_t)rect.width * rect.height);
+        return;
+    }
+    for (short yoff = 0; yoff < rect.height; yoff++, addr += g->width) {
+        fill_pixels(addr, color, rect.width);
+    }
+}
+
+#ifdef BENCH_GRAPHICS
+/* Check the pixel kernels against drawing pixel by pixel as before and time both:
+ * cc -O2 -DBENCH_GRAPHICS -I. -I../hardware/src graphics.c ../hardware/src/gbuf.c -o bench_graphics && ./bench_graphics
+ */
+
+#include <stdio.h>
+#include <time.h>
+
+/* Move the start of the offsets from 0 to n up and their end down to where at + offset is inside 0 to size */
+static void reference_span(int at, int size, short *from, short *to)
+{
+    if (*from < -at) {
+        *from = -at;
+    }
+    if (*to > size - at) {
+        *to = size - at;
+    }
+}
+
+static void reference_fill(gbuf_t *g, rect_t rect, uint16_t color)
+{
+    if (g->endian == BIG_ENDIAN) {
+        color = color << 8 | color >> 8;
+    }
     for (short yoff = 0; yoff < rect.height; yoff++) {
-        uint16_t *addr  = ((uint16_t *)g->data) + (rect.y + yoff) * g->width + rect.x;
+        uint16_t *addr = ((uint16_t *)g->data) + (rect.y + yoff) * g->width + rect.x;
         for (short xoff = 0; xoff < rect.width; xoff++) {
             *(addr + xoff) = color;
         }
     }
 }
+
+static void reference_swap_blit(gbuf_t *dst, rect_t dst_rect, gbuf_t *src, rect_t src_rect)
+{
+    for (short yoff = 0; yoff < dst_rect.height; yoff++) {
+        uint16_t *dst_addr = ((uint16_t *)dst->data) + (dst_rect.y + yoff) * dst->width + dst_rect.x;
+        uint16_t *src_addr = ((uint16_t *)src->data) + (src_rect.y + yoff) * src->width + src_rect.x;
+        for (short xoff = 0; xoff < dst_rect.width; xoff++) {
+            *(dst_addr + xoff) = *(src_addr + xoff) << 8 | *(src_addr + xoff) >> 8;
+        }
+    }
+}
+
+/* The references over the part of the rects inside the buffers */
+static void reference_fill_clipped(gbuf_t *g, rect_t rect, uint16_t color)
+{
+    short x0 = 0, x1 = rect.width, y0 = 0, y1 = rect.height;
+    reference_span(rect.x, g->width, &x0, &x1);
+    reference_span(rect.y, g->height, &y0, &y1);
+    rect = (rect_t){ rect.x + x0, rect.y + y0, x1 - x0, y1 - y0 };
+    reference_fill(g, rect, color);
+}
+
+static void reference_swap_blit_clipped(gbuf_t *dst, rect_t dst_rect, gbuf_t *src, rect_t src_rect)
+{
+    short x0 = 0, x1 = dst_rect.width, y0 = 0, y1 = dst_rect.height;
+    reference_span(dst_rect.x, dst->width, &x0, &x1);
+    reference_span(dst_rect.y, dst->height, &y0, &y1);
+    reference_span(src_rect.x, src->width, &x0, &x1);
+    reference_span(src_rect.y, src->height, &y0, &y1);
+    dst_rect = (rect_t){ dst_rect.x + x0, dst_rect.y + y0, x1 - x0, y1 - y0 };
+    src_rect = (rect_t){ src_rect.x + x0, src_rect.y + y0, x1 - x0, y1 - y0 };
+    reference_swap_blit(dst, dst_rect, src, src_rect);
+}
+
+/* Bresenham plotting every pixel that lands in the buffer */
+static void reference_line(gbuf_t *g, point_t start, point_t end, draw_style_t style, uint16_t color)
+{
+    if (g->endian == BIG_ENDIAN) {
+        color = color << 8 | color >> 8;
+    }
+    const int dx = abs(end.x - start.x);
+    const int dy = abs(end.y - start.y);
+    int err = (dx > dy ? dx : -dy) / 2;
+    int x = start.x;
+    int y = start.y;
+    for (int i = 0; i <= (dx > dy ? dx : dy); i++) {
+        if ((style != DRAW_STYLE_DOTTED || i % 2 == 0) && x >= 0 && y >= 0 && x < g->width && y < g->height) {
+            ((uint16_t *)g->data)[y * g->width + x] = color;
+        }
+        const int e = err;
+        if (e > -dx) {
+            err -= dy;
+            x += start.x < end.x ? 1 : -1;
+        }
+        if (e < dy) {
+            err += dx;
+            y += start.y < end.y ? 1 : -1;
+        }
+    }
+}
+
+static double seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void randomize(gbuf_t *g)
+{
+    static uint32_t x = 1;
+    for (size_t i = 0; i < (size_t)g->width * g->height * 2; i++) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        g->data[i] = x;
+    }
+}
+
+int main(void)
+{
+    const size_t size = 320 * 240 * 2;
+    gbuf_t *a = gbuf_new(320, 240, 2, BIG_ENDIAN);
+    gbuf_t *b = gbuf_new(320, 240, 2, BIG_ENDIAN);
+    gbuf_t *src = gbuf_new(320, 240, 2, LITTLE_ENDIAN);
+
+    /* rectangles at every alignment, with and without equal color bytes, the first
+     * half inside the buffer and the rest partly or wholly outside of it */
+    srand(1);
+    int failures = 0;
+    for (int i = 0; i < 2000 && failures < 10; i++) {
+        const bool inside = i < 1000;
+        rect_t r = { rand() % 320, rand() % 240, 0, 0 };
+        r.width = rand() % (320 - r.x + 1);
+        r.height = rand() % (240 - r.y + 1);
+        if (!inside) {
+            r = (rect_t){ rand() % 480 - 80, rand() % 400 - 80, rand() % 160, rand() % 160 };
+        }
+        uint16_t color = rand() % 2 ? 0x0101 * (rand() & 0xFF) : rand();
+        randomize(a);
+        memcpy(b->data, a->data, size);
+        fill_rectangle(a, r, color);
+        reference_fill_clipped(b, r, color);
+        if (memcmp(a->data, b->data, size) != 0) {
+            printf("fill %d,%d %dx%d with %04x differs\n", r.x, r.y, r.width, r.height, color);
+            failures++;
+        }
+
+        rect_t s = { rand() % 320, rand() % 240, 0, 0 };
+        if (inside) {
+            r.width = s.width = rand() % (320 - (r.x > s.x ? r.x : s.x) + 1);
+            r.height = s.height = rand() % (240 - (r.y > s.y ? r.y : s.y) + 1);
+        } else {
+            s = (rect_t){ rand() % 480 - 80, rand() % 400 - 80, r.width, r.height };
+        }
+        randomize(src);
+        blit(a, r, src, s);
+        reference_swap_blit_clipped(b, r, src, s);
+        if (memcmp(a->data, b->data, size) != 0) {
+            printf("blit %d,%d %dx%d from %d,%d differs\n", r.x, r.y, r.width, r.height, s.x, s.y);
+            failures++;
+        }
+
+        /* lines reaching past the buffer, a quarter of them horizontal and a quarter vertical */
+        point_t from = { rand() % 480 - 80, rand() % 400 - 80 };
+        point_t to = { rand() % 480 - 80, rand() % 400 - 80 };
+        if (i % 4 == 1) {
+            to.y = from.y;
+        } else if (i % 4 == 2) {
+            to.x = from.x;
+        }
+        draw_style_t style = rand() % 2 ? DRAW_STYLE_DOTTED : DRAW_STYLE_SOLID;
+        draw_line(a, from, to, style, color);
+        reference_line(b, from, to, style, color);
+        if (memcmp(a->data, b->data, size) != 0) {
+            printf("line %d,%d to %d,%d differs\n", from.x, from.y, to.x, to.y);
+            failures++;
+        }
+    }
+
+    const rect_t screen = { 0, 0, 320, 240 };
+    const rect_t line = { 1, 100, 318, 12 };
+    const int iterations = 2000;
+    struct {
+        const char *name;
+        double reference;
+        double optimized;
+    } results[4] = {
+        { .name = "fill screen black" },
+        { .name = "fill screen color" },
+        { .name = "fill text line" },
+        { .name = "swap blit screen" },
+    };
+    for (int i = 0; i < 4; i++) {
+        for (int optimized = 0; optimized < 2; optimized++) {
+            double start = seconds();
+            for (int n = 0; n < iterations; n++) {
+                switch (i) {
+                case 0: optimized ? fill_rectangle(a, screen, 0) : reference_fill(a, screen, 0); break;
+                case 1: optimized ? fill_rectangle(a, screen, 0x1234) : reference_fill(a, screen, 0x1234); break;
+                case 2: optimized ? fill_rectangle(a, line, 0x1234) : reference_fill(a, line, 0x1234); break;
+                case 3: optimized ? blit(a, screen, src, screen) : reference_swap_blit(a, screen, src, screen); break;
+                }
+            }
+            const double us = (seconds() - start) / iterations * 1e6;
+            if (optimized) {
+                results[i].optimized = us;
+            } else {
+                results[i].reference = us;
+            }
+        }
+    }
+
+    printf("%d mismatches\n", failures);
+    for (int i = 0; i < 4; i++) {
+        printf("%-18s pixel by pixel %8.2f us, kernels %8.2f us\n",
+               results[i].name, results[i].reference, results[i].optimized);
+    }
+    gbuf_free(a);
+    gbuf_free(b);
+    gbuf_free(src);
+    return failures != 0;
+}
+
+#endif
@@ -1,11 +1,13 @@
 #pragma once
 
-#include "freertos/FreeRTOS.h"
-#include "freertos/semphr.h"
-
+#include <assert.h>
 #include <stdbool.h>
 #include <stdint.h>
+#ifdef ESP_PLATFORM
 #include <machine/endian.h>
+#else
+#include <endian.h>
+#endif
 
 #include "gbuf.h"
 #include "point.h"
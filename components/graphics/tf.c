@@ -4,14 +4,105 @@
 
 #include "tf.h"
 
+/* fonts that can be used at the same time */
+#define TF_MAX_ATLASES 4
 
+/* a run of set pixels in a row of a glyph */
 typedef struct {
-    const char *s;
-    size_t len;
-    short width;
-    bool ellipsis;
-} tf_iterinfo_t;
+    uint8_t y;
+    uint8_t x;
+    uint8_t len;
+} tf_span_t;
 
+struct tf_atlas_t {
+    const tf_font_t *font;
+    /* 0 for characters that are not in the font */
+    uint8_t widths[256];
+    /* spans of character c are spans[first_span[c]] up to spans[first_span[c + 1]], by row */
+    uint16_t first_span[257];
+    tf_span_t spans[];
+};
+
+
+static tf_atlas_t *atlases[TF_MAX_ATLASES];
+
+static bool in_font(const tf_font_t *font, unsigned char c)
+{
+    return c >= (unsigned char)font->first && c <= (unsigned char)font->last;
+}
+
+static bool glyph_pixel(const tf_font_t *font, unsigned char c, int x, int y)
+{
+    const int stride = (font->width + 7) / 8;
+    const unsigned char *glyph = font->p + stride * font->height * (c - (unsigned char)font->first);
+    return glyph[y * stride + x / 8] & (1 << (x % 8));
+}
+
+/* Add the spans of a glyph to atlas->spans, or only count them if spans is NULL */
+static size_t atlas_add_glyph(const tf_font_t *font, unsigned char c, short width, tf_span_t *spans)
+{
+    size_t count = 0;
+    for (int y = 0; y < font->height; y++) {
+        for (int x = 0; x < width; x++) {
+            if (!glyph_pixel(font, c, x, y)) {
+                continue;
+            }
+            int len = 1;
+            while (x + len < width && glyph_pixel(font, c, x + len, y)) {
+                len++;
+            }
+            if (spans) {
+                spans[count] = (tf_span_t) { .y = y, .x = x, .len = len };
+            }
+            count++;
+            x += len;
+        }
+    }
+    return count;
+}
+
+/* Testing bits pixel by pixel is slow, so glyphs are drawn from runs of pixels decoded once */
+static tf_atlas_t *atlas_new(const tf_font_t *font)
+{
+    assert(font->width <= 255 && font->height <= 255);
+
+    uint8_t widths[256] = { 0 };
+    size_t count = 0;
+    for (int c = 0; c < 256; c++) {
+        if (in_font(font, c)) {
+            widths[c] = font->widths ? font->widths[c - (unsigned char)font->first] : font->width;
+            count += atlas_add_glyph(font, c, widths[c], NULL);
+        }
+    }
+    assert(count <= UINT16_MAX);
+
+    tf_atlas_t *atlas = calloc(1, sizeof(tf_atlas_t) + count * sizeof(tf_span_t));
+    assert(atlas != NULL);
+    atlas->font = font;
+    memcpy(atlas->widths, widths, sizeof(widths));
+    count = 0;
+    for (int c = 0; c < 256; c++) {
+        atlas->first_span[c] = count;
+        if (widths[c] > 0) {
+            count += atlas_add_glyph(font, c, widths[c], atlas->spans + count);
+        }
+    }
+    atlas->first_span[256] = count;
+    return atlas;
+}
+
+static const tf_atlas_t *atlas_get(const tf_font_t *font)
+{
+    int i;
+    for (i = 0; i < TF_MAX_ATLASES && atlases[i]; i++) {
+        if (atlases[i]->font == font) {
+            return atlases[i];
+        }
+    }
+    assert(i < TF_MAX_ATLASES);
+    atlases[i] = atlas_new(font);
+    return atlases[i];
+}
 
 tf_t *tf_new(const struct tf_font_t *font, uint16_t color, short width, uint32_t flags)
 {
@@ -19,6 +110,7 @@ tf_t *tf_new(const struct tf_font_t *font, uint16_t color, short width, uint32_t
     assert(tf != NULL);
 
     tf->font = font;
+    tf->atlas = atlas_get(font);
     tf->color = color;
     tf->width = width;
     tf->flags = flags;
@@ -30,45 +122,42 @@ void tf_free(tf_t *tf)
     free(tf);
 }
 
-static tf_iterinfo_t tf_iter_lines(tf_t *tf, const char *start)
+/* Break off the next line of the string at *cursor and move the cursor past it.
+ * Lines after the first one start at the next word. */
+static tf_line_t tf_iter_lines(const tf_t *tf, const char **cursor, bool first)
 {
-    static const char *s = NULL;
-    tf_iterinfo_t ii = { 0 };
+    const char *s = *cursor;
+    tf_line_t ii = { 0 };
     short width = 0;
     short ellipsis_width = 0;
 
-    if (start) {
-        s = start;
-    } else {    
-        if (!s) {
-            return ii;
-        }
+    if (!first) {
         while (*s == ' ') {
             s++;
         }
     }
 
-    if (tf->flags & TF_ELIDE && '.' >= tf->font->first && '.' <= tf->font->last) {
-        ellipsis_width = (tf->font->widths ? tf->font->widths['.' - tf->font->first] : tf->font->width) * 3;
+    const uint8_t *widths = tf->atlas->widths;
+    if (tf->flags & TF_ELIDE) {
+        ellipsis_width = widths['.'] * 3;
     }
 
     const char *p = s;
     while (*p) {
-        if (*p < tf->font->first || *p > tf->font->last) {
+        short char_width = widths[(unsigned char)*p];
+        if (char_width == 0) {
             p++;
             continue;
         }
 
-        short char_width = tf->font->widths ? tf->font->widths[*p - tf->font->first] : tf->font->width;
-
         if ((tf->flags & TF_WORDWRAP || tf->flags & TF_ELIDE) && tf->width > 0 && width + char_width > tf->width) {
             const char *q = p;
             short sub = 0;
             while (p--) {
-                if (*p < tf->font->first || *p > tf->font->last) {
+                if (widths[(unsigned char)*p] == 0) {
                     continue;
                 }
-                sub += tf->font->widths ? tf->font->widths[*p - tf->font->first] : tf->font->width;
+                sub += widths[(unsigned char)*p];
                 if (tf->flags & TF_ELIDE) {
                     if (width - sub + ellipsis_width <= tf->width) {
                         width = width - sub + ellipsis_width;
@@ -76,7 +165,7 @@ static tf_iterinfo_t tf_iter_lines(tf_t *tf, const char *start)
                         ii.len = p - s;
                         ii.width = width;
                         ii.ellipsis = true;
-                        s = "";
+                        *cursor = "";
                         return ii;
                     }
                 } else if (*p == ' ') {
@@ -98,7 +187,7 @@ static tf_iterinfo_t tf_iter_lines(tf_t *tf, const char *start)
     ii.s = s;
     ii.len = p - s;
     ii.width = width;
-    s = p;
+    *cursor = p;
 
     return ii;
 }
@@ -106,25 +195,98 @@ static tf_iterinfo_t tf_iter_lines(tf_t *tf, const char *start)
 tf_metrics_t tf_get_str_metrics(tf_t *tf, const char *s)
 {
     tf_metrics_t m = { 0 };
-    tf_iterinfo_t ii = tf_iter_lines(tf, s);
+    tf_line_t ii = tf_iter_lines(tf, &s, true);
 
     while (ii.len) {
         m.height += tf->font->height;
         /* get maximum line width */
         m.width = ii.width > m.width ? ii.width : m.width;
 
-        ii = tf_iter_lines(tf, NULL);
+        ii = tf_iter_lines(tf, &s, false);
     }
 
     return m;
 }
 
-short tf_draw_glyph(gbuf_t *g, tf_t *tf, char c, point_t p)
+/* End the last line of a full layout with an ellipsis, there was more text after it */
+static void layout_truncate(tf_layout_t *layout)
 {
-    assert(c >= tf->font->first);
-    assert(c <= tf->font->last);
+    const tf_t *tf = layout->tf;
+    const uint8_t *widths = tf->atlas->widths;
+    const short ellipsis_width = widths['.'] * 3;
+    tf_line_t *last = &layout->lines[layout->line_count - 1];
+
+    while (last->len > 0 && (last->s[last->len - 1] == ' ' ||
+                             (tf->width > 0 && last->width + ellipsis_width > tf->width))) {
+        last->len--;
+        last->width -= widths[(unsigned char)last->s[last->len]];
+    }
+    last->width += ellipsis_width;
+    last->ellipsis = true;
+    if (last->width > layout->metrics.width) {
+        layout->metrics.width = last->width;
+    }
+}
 
-    short width = tf->font->widths ? tf->font->widths[c - tf->font->first] : tf->font->width;
+void tf_layout(tf_layout_t *layout, const tf_t *tf, const char *s)
+{
+    layout->tf = tf;
+    layout->line_count = 0;
+    layout->metrics.width = 0;
+    layout->metrics.height = 0;
+
+    tf_line_t ii = tf_iter_lines(tf, &s, true);
+    while (ii.len && layout->line_count < TF_LAYOUT_MAX_LINES) {
+        layout->lines[layout->line_count++] = ii;
+        layout->metrics.height += tf->font->height;
+        layout->metrics.width = ii.width > layout->metrics.width ? ii.width : layout->metrics.width;
+
+        ii = tf_iter_lines(tf, &s, false);
+    }
+    if (ii.len) {
+        layout_truncate(layout);
+    }
+}
+
+static uint16_t pixel_color(const gbuf_t *g, uint16_t color)
+{
+    return g->endian == BIG_ENDIAN ? color << 8 | color >> 8 : color;
+}
+
+/* Set len pixels starting at p, two at a time once p is word aligned */
+static inline void fill_span(uint16_t *p, uint16_t color, short len)
+{
+    if (((uintptr_t)p & 2) && len > 0) {
+        *p++ = color;
+        len--;
+    }
+    uint32_t *w = (uint32_t *)p;
+    const uint32_t pair = (uint32_t)color << 16 | color;
+    for (; len >= 2; len -= 2) {
+        *w++ = pair;
+    }
+    if (len > 0) {
+        *(uint16_t *)w = color;
+    }
+}
+
+/* Draw c with its top left corner at row, when all of it is inside g and the clip */
+static inline short draw_glyph_unclipped(const tf_atlas_t *atlas, uint16_t *row, short stride, uint16_t color,
+                                         unsigned char c)
+{
+    const tf_span_t *span = &atlas->spans[atlas->first_span[c]];
+    const tf_span_t *end = &atlas->spans[atlas->first_span[c + 1]];
+    for (; span < end; span++) {
+        fill_span(row + span->y * stride + span->x, color, span->len);
+    }
+    return atlas->widths[c];
+}
+
+/* Draw c in color, which is in the byte order of g already */
+static short draw_glyph(gbuf_t *g, const tf_t *tf, uint16_t color, unsigned char c, point_t p)
+{
+    const tf_atlas_t *atlas = tf->atlas;
+    short width = atlas->widths[c];
 
     short xstart = p.x < 0 ? -p.x : 0;
     short xend = p.x + width > g->width ? g->width - p.x : width;
@@ -149,11 +311,176 @@ short tf_draw_glyph(gbuf_t *g, tf_t *tf, char c, point_t p)
         }
     }
 
-    uint16_t color = tf->color;
-    if (g->endian == BIG_ENDIAN) {
-        color = color << 8 | color >> 8;
+    if (xstart >= xend || ystart >= yend) {
+        return width;
+    }
+
+    const bool clipped = xstart > 0 || ystart > 0 || xend < width || yend < tf->font->height;
+    const tf_span_t *span = &atlas->spans[atlas->first_span[c]];
+    const tf_span_t *end = &atlas->spans[atlas->first_span[c + 1]];
+    for (; span < end; span++) {
+        short x = span->x;
+        short len = span->len;
+        if (clipped) {
+            if (span->y < ystart) {
+                continue;
+            }
+            if (span->y >= yend) {
+                break;
+            }
+            if (x < xstart) {
+                len -= xstart - x;
+                x = xstart;
+            }
+            if (x + len > xend) {
+                len = xend - x;
+            }
+            if (len <= 0) {
+                continue;
+            }
+        }
+        fill_span((uint16_t *)g->data + (p.y + span->y) * g->width + p.x + x, color, len);
+    }
+
+    return width;
+}
+
+short tf_draw_glyph(gbuf_t *g, tf_t *tf, char c, point_t p)
+{
+    short width = draw_glyph(g, tf, pixel_color(g, tf->color), c, p);
+    rect_t r = { p.x, p.y, width, tf->font->height };
+    gbuf_mark_dirty(g, r);
+    return width;
+}
+
+/* Draw a line with its top left corner at p, tf aligns it within its width */
+static void draw_line_glyphs(gbuf_t *g, const tf_t *tf, uint16_t color, const tf_line_t *line, point_t p)
+{
+    short xoff = 0;
+    if (tf->width <= 0 || !(tf->flags & TF_ALIGN_RIGHT || tf->flags & TF_ALIGN_CENTER)) {
+        xoff = 0;
+    } else if (tf->flags & TF_ALIGN_RIGHT) {
+        xoff = tf->width - line->width;
+    } else if (tf->flags & TF_ALIGN_CENTER) {
+        xoff = (tf->width - line->width) / 2;
+    }
+    short line_start = xoff;
+
+    /* lines inside the buffer and the clip, like most of the UI, skip clipping every glyph */
+    const short x0 = p.x + xoff;
+    const short x1 = x0 + line->width;
+    const short y1 = p.y + tf->font->height;
+    if (x0 >= 0 && p.y >= 0 && x1 <= g->width && y1 <= g->height &&
+        (tf->clip.width <= 0 || (x0 >= tf->clip.x && x1 <= tf->clip.x + tf->clip.width)) &&
+        (tf->clip.height <= 0 || (p.y >= tf->clip.y && y1 <= tf->clip.y + tf->clip.height))) {
+        uint16_t *row = (uint16_t *)g->data + p.y * g->width + x0;
+        short x = 0;
+        for (size_t i = 0; i < line->len; i++) {
+            x += draw_glyph_unclipped(tf->atlas, row + x, g->width, color, line->s[i]);
+        }
+        if (line->ellipsis) {
+            for (int i = 0; i < 3; i++) {
+                x += draw_glyph_unclipped(tf->atlas, row + x, g->width, color, '.');
+            }
+        }
+        rect_t line_rect = { x0, p.y, x, tf->font->height };
+        gbuf_mark_dirty(g, line_rect);
+        return;
+    }
+
+    for (size_t i = 0; i < line->len; i++) {
+        point_t gp = {p.x + xoff, p.y};
+        xoff += draw_glyph(g, tf, color, line->s[i], gp);
+        if (tf->clip.width > 0 && xoff + p.x > tf->clip.x + tf->clip.width) {
+            break;
+        }
+    }
+
+    if (line->ellipsis) {
+        point_t gp = {p.x + xoff, p.y};
+        xoff += draw_glyph(g, tf, color, '.', gp);
+        gp.x = p.x + xoff;
+        xoff += draw_glyph(g, tf, color, '.', gp);
+        gp.x = p.x + xoff;
+        xoff += draw_glyph(g, tf, color, '.', gp);
+    }
+
+    /* the whole line changed at most */
+    rect_t line_rect = { p.x + line_start, p.y, xoff - line_start, tf->font->height };
+    gbuf_mark_dirty(g, line_rect);
+}
+
+void tf_draw_str(gbuf_t *g, tf_t *tf, const char *s, point_t p)
+{
+    const uint16_t color = pixel_color(g, tf->color);
+
+    tf_line_t ii = tf_iter_lines(tf, &s, true);
+    for (; ii.len && p.y < g->height; p.y += tf->font->height) {
+        if (p.y + tf->font->height > 0) {
+            draw_line_glyphs(g, tf, color, &ii, p);
+        }
+        ii = tf_iter_lines(tf, &s, false);
     }
+}
+
+void tf_draw_layout(gbuf_t *g, const tf_layout_t *layout, point_t p)
+{
+    tf_draw_layout_lines(g, layout, 0, layout->line_count, p);
+}
 
+void tf_draw_layout_lines(gbuf_t *g, const tf_layout_t *layout, short first, short count, point_t p)
+{
+    const tf_t *tf = layout->tf;
+    const uint16_t color = pixel_color(g, tf->color);
+
+    if (first + count > layout->line_count) {
+        count = layout->line_count - first;
+    }
+    p.y += first * tf->font->height;
+    for (short i = first; i < first + count && p.y < g->height; i++, p.y += tf->font->height) {
+        if (p.y + tf->font->height > 0) {
+            draw_line_glyphs(g, tf, color, &layout->lines[i], p);
+        }
+    }
+}
+
+#ifdef BENCH_TF
+/* Compare the span renderer with drawing glyphs bit by bit as tf did before and time both:
+ * cc -O2 -DBENCH_TF -I. -I../hardware/src tf.c OpenSans_Regular_11X12.c ../hardware/src/gbuf.c -o bench_tf && ./bench_tf
+ */
+
+#include <time.h>
+
+#include "OpenSans_Regular_11X12.h"
+
+static short reference_draw_glyph(gbuf_t *g, tf_t *tf, char c, point_t p)
+{
+    short width = tf->font->widths ? tf->font->widths[c - tf->font->first] : tf->font->width;
+
+    short xstart = p.x < 0 ? -p.x : 0;
+    short xend = p.x + width > g->width ? g->width - p.x : width;
+    short ystart = p.y < 0 ? -p.y : 0;
+    short yend = p.y + tf->font->height > g->height ? g->height - p.y : tf->font->height;
+
+    if (tf->clip.width > 0) {
+        if (p.x + xstart < tf->clip.x) {
+            xstart = tf->clip.x - p.x;
+        }
+        if (p.x + xend > tf->clip.x + tf->clip.width) {
+            xend = tf->clip.x + tf->clip.width - p.x;
+        }
+    }
+
+    if (tf->clip.height > 0) {
+        if (p.y + ystart < tf->clip.y) {
+            ystart = tf->clip.y - p.y;
+        }
+        if (p.y + yend > tf->clip.y + tf->clip.height) {
+            yend = tf->clip.y + tf->clip.height - p.y;
+        }
+    }
+
+    uint16_t color = pixel_color(g, tf->color);
     const unsigned char *glyph = tf->font->p + ((tf->font->width + 7) / 8) * tf->font->height * (c - tf->font->first);
 
     for (short yoff = ystart; yoff < yend; yoff++) {
@@ -168,54 +495,130 @@ short tf_draw_glyph(gbuf_t *g, tf_t *tf, char c, point_t p)
     return width;
 }
 
-void tf_draw_str(gbuf_t *g, tf_t *tf, const char *s, point_t p)
+static double seconds(void)
 {
-    short xoff = 0;
-    short yoff = 0;
-
-    tf_iterinfo_t ii = tf_iter_lines(tf, s);
-    int line = 1;
-    while (true) {
-        short ystart = p.y + yoff < 0 ? -(p.y + yoff) : yoff;
-        short yend = p.y + yoff + tf->font->height > g->height ? g->height - p.y : yoff + tf->font->height;
-
-        /* TODO: Y clipping */
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-        if (ystart >= line * tf->font->height || yend <= 0) {
-            break;
+int main(void)
+{
+    const size_t size = 320 * 240 * 2;
+    gbuf_t *a = gbuf_new(320, 240, 2, BIG_ENDIAN);
+    gbuf_t *b = gbuf_new(320, 240, 2, BIG_ENDIAN);
+    tf_t *tf = tf_new(&font_OpenSans_Regular_11X12, 0xF81F, 0, 0);
+
+    /* every glyph at random positions, partly off the buffer and clipped */
+    srand(1);
+    int failures = 0;
+    for (int i = 0; i < 200000 && failures < 10; i++) {
+        char c = tf->font->first + rand() % (tf->font->last - tf->font->first + 1);
+        point_t p = { rand() % 340 - 10, rand() % 260 - 10 };
+        if (rand() % 4 == 0) {
+            tf->clip = (rect_t) { p.x + rand() % 12 - 2, p.y + rand() % 14 - 2, rand() % 12, rand() % 14 };
+        } else {
+            tf->clip = (rect_t) { 0 };
         }
-
-        if (tf->width <= 0 || !(tf->flags & TF_ALIGN_RIGHT || tf->flags & TF_ALIGN_CENTER)) {
-            xoff = 0;
-        } else if (tf->flags & TF_ALIGN_RIGHT) {
-            xoff = tf->width - ii.width; 
-        } else if (tf->flags & TF_ALIGN_CENTER) {
-            xoff = (tf->width - ii.width) / 2;
+        memset(a->data, 0, size);
+        memset(b->data, 0, size);
+        short wa = draw_glyph(a, tf, pixel_color(a, tf->color), c, p);
+        short wb = reference_draw_glyph(b, tf, c, p);
+        if (wa != wb || memcmp(a->data, b->data, size) != 0) {
+            printf("'%c' at %d,%d clip %d,%d %dx%d differs\n", c, p.x, p.y,
+                   tf->clip.x, tf->clip.y, tf->clip.width, tf->clip.height);
+            failures++;
         }
-
-        for (int i = 0; i < ii.len; i++) {
-            point_t gp = {p.x + xoff, p.y + yoff};
-            xoff += tf_draw_glyph(g, tf, ii.s[i], gp);
-            if (tf->clip.width > 0 && xoff + p.x > tf->clip.x + tf->clip.width) {
-                break;
+    }
+    tf->clip = (rect_t) { 0 };
+
+    const char *line = "WIFI CONNECTED, IP:192.168.100.200 ClientConnected";
+
+    /* lines drawn whole and clipped, as the glyphs above */
+    tf_t *aligned = tf_new(&font_OpenSans_Regular_11X12, 0x07E0, 200, TF_ALIGN_CENTER | TF_ELIDE);
+    for (int i = 0; i < 20000 && failures < 10; i++) {
+        point_t p = { rand() % 300 - 120, rand() % 260 - 10 };
+        aligned->clip = rand() % 4 == 0 ? (rect_t) { rand() % 320, rand() % 240, rand() % 200, rand() % 20 } : (rect_t) { 0 };
+        const char *s = line + rand() % 20;
+        memset(a->data, 0, size);
+        memset(b->data, 0, size);
+        tf_draw_str(a, aligned, s, p);
+        tf_layout_t layout;
+        tf_layout(&layout, aligned, s);
+        short x = p.x + (aligned->width - layout.lines[0].width) / 2;
+        for (size_t n = 0; n < layout.lines[0].len; n++) {
+            x += draw_glyph(b, aligned, pixel_color(b, aligned->color), layout.lines[0].s[n], (point_t) { x, p.y });
+        }
+        for (int n = 0; layout.lines[0].ellipsis && n < 3; n++) {
+            x += draw_glyph(b, aligned, pixel_color(b, aligned->color), '.', (point_t) { x, p.y });
+        }
+        if (memcmp(a->data, b->data, size) != 0) {
+            printf("line at %d,%d clip %d,%d %dx%d differs\n", p.x, p.y,
+                   aligned->clip.x, aligned->clip.y, aligned->clip.width, aligned->clip.height);
+            failures++;
+        }
+    }
+    tf_free(aligned);
+
+    /* the best of a few rounds, each way timed in turn */
+    const int iterations = 20000;
+    double reference = 1e9, spans = 1e9, measure = 1e9, measured = 1e9, laid_out = 1e9;
+    for (int round = 0; round < 5; round++) {
+        double start = seconds();
+        for (int i = 0; i < iterations; i++) {
+            point_t p = { 4, i % 228 };
+            for (const char *c = line; *c; c++) {
+                p.x += reference_draw_glyph(b, tf, *c, p);
             }
         }
+        double t = seconds() - start;
+        reference = t < reference ? t : reference;
 
-        if (ii.ellipsis) {
-            point_t gp = {p.x + xoff, p.y + yoff};
-            xoff += tf_draw_glyph(g, tf, '.', gp);
-            gp.x = p.x + xoff;
-            xoff += tf_draw_glyph(g, tf, '.', gp);
-            gp.x = p.x + xoff;
-            xoff += tf_draw_glyph(g, tf, '.', gp);
+        start = seconds();
+        for (int i = 0; i < iterations; i++) {
+            point_t p = { 4, i % 228 };
+            tf_draw_str(a, tf, line, p);
         }
-
-        ii = tf_iter_lines(tf, NULL);
-        if (ii.len == 0) {
-            break;
+        t = seconds() - start;
+        spans = t < spans ? t : spans;
+
+        /* measuring and drawing a string walks it twice, a layout is drawn right away */
+        volatile short width = 0;
+        start = seconds();
+        for (int i = 0; i < iterations; i++) {
+            width += tf_get_str_metrics(tf, line).width;
         }
+        t = seconds() - start;
+        measure = t < measure ? t : measure;
 
-        yoff += tf->font->height;
-        line++;
+        start = seconds();
+        for (int i = 0; i < iterations; i++) {
+            point_t p = { 160 - tf_get_str_metrics(tf, line).width / 2, i % 228 };
+            tf_draw_str(a, tf, line, p);
+        }
+        t = seconds() - start;
+        measured = t < measured ? t : measured;
+
+        start = seconds();
+        for (int i = 0; i < iterations; i++) {
+            tf_layout_t layout;
+            tf_layout(&layout, tf, line);
+            point_t p = { 160 - layout.metrics.width / 2, i % 228 };
+            tf_draw_layout(a, &layout, p);
+        }
+        t = seconds() - start;
+        laid_out = t < laid_out ? t : laid_out;
     }
+
+    printf("%d glyph and line mismatches\n", failures);
+    printf("draw %zu chars: bits %.2f us, spans %.2f us\n", strlen(line),
+           reference / iterations * 1e6, spans / iterations * 1e6);
+    printf("centered: measure %.2f us, measure and draw %.2f us, layout %.2f us\n",
+           measure / iterations * 1e6, measured / iterations * 1e6, laid_out / iterations * 1e6);
+    tf_free(tf);
+    gbuf_free(a);
+    gbuf_free(b);
+    return failures != 0;
 }
+
+#endif
@@ -14,6 +14,13 @@ enum tf_flags_t {
 };
 
 typedef struct tf_font_t tf_font_t;
+/* glyphs of a font as runs of pixels, built once per font by tf_new */
+typedef struct tf_atlas_t tf_atlas_t;
+
+typedef struct  {
+    short width;
+    short height;
+} tf_metrics_t;
 
 typedef struct {
     const tf_font_t *font;
@@ -21,8 +28,30 @@ typedef struct {
     short width;
     uint16_t flags;
     rect_t clip;
+    const tf_atlas_t *atlas;
 } tf_t;
 
+/* a line of a string that fits the width of a tf_t */
+typedef struct {
+    const char *s;
+    size_t len;
+    short width;
+    bool ellipsis;
+} tf_line_t;
+
+/* Lines a layout holds. Text that needs more lines is cut off at the end of the
+ * last one, which ends with an ellipsis; tf_draw_str draws any number of lines. */
+#define TF_LAYOUT_MAX_LINES 8
+
+/* A string broken into lines once, to be measured and drawn any number of times.
+ * It points into the string and the tf_t it was laid out with, both have to stay unchanged. */
+typedef struct {
+    const tf_t *tf;
+    short line_count;
+    tf_line_t lines[TF_LAYOUT_MAX_LINES];
+    tf_metrics_t metrics;
+} tf_layout_t;
+
 struct tf_font_t {
    const unsigned char *p;
    short width;
@@ -32,13 +61,14 @@ struct tf_font_t {
    const short *widths;
 };
 
-typedef struct  {
-    short width;
-    short height;
-} tf_metrics_t;
-
 tf_t *tf_new(const tf_font_t *font, uint16_t color, short width, uint32_t flags);
 void tf_free(tf_t *tf);
 tf_metrics_t tf_get_str_metrics(tf_t *tf, const char *s);
 short tf_draw_glyph(gbuf_t *g, tf_t *tf, char c, point_t p);
 void tf_draw_str(gbuf_t *g, tf_t *tf, const char *s, point_t p);
+
+/* Layouts only read the tf_t, so any task can lay out and draw text once tf_new returned */
+void tf_layout(tf_layout_t *layout, const tf_t *tf, const char *s);
+void tf_draw_layout(gbuf_t *g, const tf_layout_t *layout, point_t p);
+/* draw count lines starting at line first, p is where the whole layout is drawn */
+void tf_draw_layout_lines(gbuf_t *g, const tf_layout_t *layout, short first, short count, point_t p);
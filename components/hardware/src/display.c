@@ -1,14 +1,18 @@
+#include <stdio.h>
 #include <string.h>
 
 #include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 #include "esp_heap_caps.h"
 #include "esp_system.h"
 #include "esp_event.h"
+#include "esp_timer.h"
 #include "driver/gpio.h"
 #include "driver/spi_master.h"
 #include "driver/ledc.h"
 
 #include "display.h"
+#include "spibus.h"
 
 
 static const gpio_num_t SPI_PIN_NUM_MISO = GPIO_NUM_19;
@@ -26,14 +30,23 @@ const int LCD_SPI_CLOCK_RATE = SPI_MASTER_FREQ_40M;
 #define MADCTL_MH 0x04
 #define TFT_RGB_BGR 0x08
 
-static spi_transaction_t trans[8];
+// The window of a region, then a ring of chunks of its pixels. The driver finishes
+// transactions in the order they were queued, so the oldest chunk is free first.
+static spi_transaction_t trans[5];
+static spi_transaction_t chunk_trans[DISPLAY_MAX_QUEUE][2];
 static spi_device_handle_t spi;
-static TaskHandle_t xTaskToNotify = NULL;
-static bool waitForTransactions = false;
-
-#define PARALLEL_LINES (5)
-
-static uint16_t* pbuf[2];
+static bool busHeld = false;
+static int queued = 0;            // Transactions queued and not collected yet
+static bool window_queued = false; // trans[] is still queued
+static int chunks_queued = 0;
+static bool fb_queued = false;     // A queued chunk is sent straight from fb
+static int next_chunk = 0;
+
+static display_config_t s_config;
+static display_stats_t s_stats = { 0 };
+
+// Chunks are copied here unless they are sent straight from fb
+static uint16_t* pbuf[DISPLAY_MAX_QUEUE];
 gbuf_t *fb = NULL;
 
 /*
@@ -122,24 +135,10 @@ static void ili_data(spi_device_handle_t spi, const uint8_t *data, int len)
 // It will set the D/C line to the value indicated in the user field.
 static void ili_spi_pre_transfer_callback(spi_transaction_t *t)
 {
-    int dc = (int)t->user;
+    int dc = (int)(intptr_t)t->user;
     gpio_set_level(LCD_PIN_NUM_DC, dc);
 }
 
-static void ili_spi_post_transfer_callback(spi_transaction_t *t)
-{
-    if(xTaskToNotify && t == &trans[7]) {
-        BaseType_t xHigherPriorityTaskWoken = pdFALSE;
-
-        /* Notify the task that the transmission is complete. */
-        vTaskNotifyGiveFromISR(xTaskToNotify, &xHigherPriorityTaskWoken);
-
-        if (xHigherPriorityTaskWoken) {
-            portYIELD_FROM_ISR();
-        }
-    }
-}
-
 // Initialize the display
 static void ili_init()
 {
@@ -158,93 +157,194 @@ static void ili_init()
     }
 }
 
-static void send_reset_drawing(int x, int y, int width, int height)
+// The bus is held while chunks are queued, waiting card accesses go in between
+static void bus_acquire(void)
 {
-  trans[0].tx_data[0] = 0x2A;       // Column Address Set
-  trans[1].tx_data[0] = x >> 8;     // Start Col High
-  trans[1].tx_data[1] = x & 0xff;   // Start Col Low
-  trans[1].tx_data[2] = (x + width - 1) >> 8;       // End Col High
-  trans[1].tx_data[3] = (x + width - 1) & 0xff;     // End Col Low
-  trans[2].tx_data[0] = 0x2B;       // Page address set
-  trans[3].tx_data[0] = y >> 8;     // Start page high
-  trans[3].tx_data[1] = y & 0xff;   // Start page low
-  trans[3].tx_data[2] = (y + height - 1) >> 8;      // End page high
-  trans[3].tx_data[3] = (y + height - 1) & 0xff;    // End page low
-  trans[4].tx_data[0] = 0x2C;       // Memory write
-
-  // Queue all transactions.
-  for (int x = 0; x < 5; x++) {
-      esp_err_t ret = spi_device_queue_trans(spi, &trans[x], 1000 / portTICK_RATE_MS);
-      assert(ret == ESP_OK);
-  }
+    if (!busHeld) {
+        spibus_acquire(SPIBUS_DISPLAY);
+        busHeld = true;
+    }
+}
+
+static void bus_release(void)
+{
+    if (busHeld) {
+        spibus_release(SPIBUS_DISPLAY);
+        busHeld = false;
+    }
+}
+
+static void queue_trans(spi_transaction_t *t)
+{
+    esp_err_t ret = spi_device_queue_trans(spi, t, 1000 / portTICK_RATE_MS);
+    assert(ret == ESP_OK);
+    queued++;
 }
 
-static void send_continue_wait()
+// Wait for the oldest queued transaction
+static void collect_trans(void)
 {
-  if (waitForTransactions) {
-    ulTaskNotifyTake(pdTRUE, 1000 / portTICK_RATE_MS);
-
-    // Drain SPI queue
-    esp_err_t err = ESP_OK;
-    while(err == ESP_OK) {
-        spi_transaction_t* trans_desc;
-        err = spi_device_get_trans_result(spi, &trans_desc, 0);
+    spi_transaction_t *t;
+    esp_err_t ret = spi_device_get_trans_result(spi, &t, 1000 / portTICK_RATE_MS);
+    assert(ret == ESP_OK);
+    queued--;
+    if (t == &trans[4]) {
+        window_queued = false;
+    } else if (!(t->flags & SPI_TRANS_USE_TXDATA)) {
+        chunks_queued--;
     }
+}
 
-    waitForTransactions = false;
-  }
+static void send_drain(void)
+{
+    while (queued > 0) {
+        collect_trans();
+    }
+    fb_queued = false;
 }
 
-static void send_continue_line(uint16_t *line, int width, int height)
+// Take the bus for the next transactions, after letting waiting card accesses go
+static void send_yield(void)
 {
-  send_continue_wait();
-
-  trans[6].tx_data[0] = 0x3C;   //memory write continue
-  trans[6].length = 8;          //Data length, in bits
-  trans[6].flags = SPI_TRANS_USE_TXDATA;
-
-  trans[7].tx_buffer = line;    //finally send the line data
-  trans[7].length = width * height * 16; //Data length, in bits
-  trans[7].rxlength = 0;
-  trans[7].flags = 0;
-  
-  // Queue transactions.
-  for (int x = 6; x < 8; x++) {
-      esp_err_t ret = spi_device_queue_trans(spi, &trans[x], 1000 / portTICK_RATE_MS);
-      assert(ret == ESP_OK);
-  }
-
-  waitForTransactions = true;
+    if (busHeld && spibus_sd_waiting()) {
+        send_drain();
+        bus_release();
+    }
+    bus_acquire();
 }
 
-static uint16_t *get_pbuf(void) {
-    static uint16_t *current = NULL;
-    if (current == NULL) {
-        current = pbuf[0];
+static void send_window(int x, int y, int width, int height)
+{
+    send_yield();
+    while (window_queued) {
+        collect_trans();
+    }
+
+    trans[0].tx_data[0] = 0x2A;       // Column Address Set
+    trans[1].tx_data[0] = x >> 8;     // Start Col High
+    trans[1].tx_data[1] = x & 0xff;   // Start Col Low
+    trans[1].tx_data[2] = (x + width - 1) >> 8;       // End Col High
+    trans[1].tx_data[3] = (x + width - 1) & 0xff;     // End Col Low
+    trans[2].tx_data[0] = 0x2B;       // Page address set
+    trans[3].tx_data[0] = y >> 8;     // Start page high
+    trans[3].tx_data[1] = y & 0xff;   // Start page low
+    trans[3].tx_data[2] = (y + height - 1) >> 8;      // End page high
+    trans[3].tx_data[3] = (y + height - 1) & 0xff;    // End page low
+    trans[4].tx_data[0] = 0x2C;       // Memory write
+
+    for (int i = 0; i < 5; i++) {
+        queue_trans(&trans[i]);
     }
-    uint16_t *result = current;
+    window_queued = true;
+}
 
-    if (current == pbuf[0]) {
-        current = pbuf[1];
-    } else {
-        current = pbuf[0];
+// Wait until a chunk can be queued and return its slot, its buffer is free then
+static int chunk_slot(void)
+{
+    while (chunks_queued >= s_config.queue_depth) {
+        collect_trans();
     }
-    return result;
+    return next_chunk;
+}
+
+static void send_chunk(int slot, const uint16_t *pixels, int count)
+{
+    send_yield();
+
+    chunk_trans[slot][1].tx_buffer = pixels;
+    chunk_trans[slot][1].length = count * 16;   // Data length, in bits
+    queue_trans(&chunk_trans[slot][0]);
+    queue_trans(&chunk_trans[slot][1]);
+    chunks_queued++;
+    next_chunk = (slot + 1) % s_config.queue_depth;
+}
+
+// Queue the pixels of r, the transactions of the last chunks are still in flight after
+static void send_rect(rect_t r)
+{
+    send_window(r.x, r.y, r.width, r.height);
+
+    const bool contiguous = r.width == DISPLAY_WIDTH && s_stats.zero_copy;
+    const int lines = DISPLAY_WIDTH * s_config.chunk_lines / r.width;
+    const uint16_t *src = ((uint16_t *)fb->data) + DISPLAY_WIDTH * r.y + r.x;
+    for (int dy = 0; dy < r.height; dy += lines, src += DISPLAY_WIDTH * lines) {
+        const int count = r.height - dy < lines ? r.height - dy : lines;
+        const int slot = chunk_slot();
+        if (contiguous) {
+            send_chunk(slot, src, r.width * count);
+            fb_queued = true;
+        } else {
+            // Copying the next chunk overlaps with sending the queued ones
+            for (int line = 0; line < count; line++) {
+                memcpy(pbuf[slot] + r.width * line, src + DISPLAY_WIDTH * line, r.width * sizeof(uint16_t));
+            }
+            send_chunk(slot, pbuf[slot], r.width * count);
+        }
+    }
+    s_stats.pixels += r.width * r.height;
+}
+
+// Let the bus go and count the time since start. Chunks copied into pbuf are still sent
+// while the caller draws the next frame, chunks sent straight from fb are waited for
+// since fb is drawn into. Card accesses get the bus right away, the display's last
+// chunks only hold them up for as long as those take on the bus.
+static void send_finish(int64_t start)
+{
+    if (fb_queued) {
+        send_drain();
+    }
+    bus_release();
+    s_stats.updates++;
+    s_stats.update_us += esp_timer_get_time() - start;
+}
+
+static void *dma_malloc(size_t size)
+{
+    return heap_caps_malloc(size, MALLOC_CAP_DMA | MALLOC_CAP_8BIT);
 }
 
 void display_init(void)
 {
-    fb = gbuf_new(DISPLAY_WIDTH, DISPLAY_HEIGHT, 2, BIG_ENDIAN);
-    memset(fb->data, 0, DISPLAY_WIDTH * DISPLAY_HEIGHT * 2);
+    display_config_t config = DISPLAY_CONFIG_DEFAULT();
+    display_init_config(&config);
+}
 
-    pbuf[0] = heap_caps_malloc(320 * PARALLEL_LINES * sizeof(uint16_t), MALLOC_CAP_DMA | MALLOC_CAP_8BIT);
-    if (!pbuf[0]) abort();
+void display_init_config(const display_config_t *config)
+{
+    s_config = *config;
+    if (s_config.chunk_lines < 1) {
+        s_config.chunk_lines = 1;
+    } else if (s_config.chunk_lines > DISPLAY_HEIGHT) {
+        s_config.chunk_lines = DISPLAY_HEIGHT;
+    }
+    if (s_config.queue_depth < 1) {
+        s_config.queue_depth = 1;
+    } else if (s_config.queue_depth > DISPLAY_MAX_QUEUE) {
+        s_config.queue_depth = DISPLAY_MAX_QUEUE;
+    }
 
-    pbuf[1] = heap_caps_malloc(320 * PARALLEL_LINES * sizeof(uint16_t), MALLOC_CAP_DMA | MALLOC_CAP_8BIT);
-    if (!pbuf[1]) abort();
+    // The internal memory DMA can read from is scarce and Wi-Fi, lwIP and the FTP server
+    // allocate theirs later, so fb only goes there if enough is left over for them
+    const size_t fb_size = DISPLAY_WIDTH * DISPLAY_HEIGHT * 2;
+    fb = NULL;
+    if (s_config.zero_copy &&
+        heap_caps_get_free_size(MALLOC_CAP_INTERNAL) >= fb_size + s_config.zero_copy_reserve) {
+        fb = gbuf_new_alloc(DISPLAY_WIDTH, DISPLAY_HEIGHT, 2, BIG_ENDIAN, dma_malloc);
+    }
+    s_stats.zero_copy = fb != NULL;
+    if (!fb) {
+        fb = gbuf_new(DISPLAY_WIDTH, DISPLAY_HEIGHT, 2, BIG_ENDIAN);
+    }
+    memset(fb->data, 0, fb_size);
+
+    const size_t chunk_size = DISPLAY_WIDTH * s_config.chunk_lines * sizeof(uint16_t);
+    for (int i = 0; i < s_config.queue_depth; i++) {
+        pbuf[i] = dma_malloc(chunk_size);
+        if (!pbuf[i]) abort();
+    }
 
-	// Initialize transactions
-    for (int x = 0; x < 8; x++) {
+    // Initialize transactions
+    for (int x = 0; x < 5; x++) {
         memset(&trans[x], 0, sizeof(spi_transaction_t));
         if ((x & 1) == 0) {
             // Even transfers are commands
@@ -257,8 +357,17 @@ void display_init(void)
         }
         trans[x].flags = SPI_TRANS_USE_TXDATA;
     }
+    for (int x = 0; x < DISPLAY_MAX_QUEUE; x++) {
+        memset(chunk_trans[x], 0, sizeof(chunk_trans[x]));
+        chunk_trans[x][0].tx_data[0] = 0x3C;   // Memory write continue
+        chunk_trans[x][0].length = 8;
+        chunk_trans[x][0].user = (void*)0;
+        chunk_trans[x][0].flags = SPI_TRANS_USE_TXDATA;
+        chunk_trans[x][1].user = (void*)1;
+    }
 
-    // Initialize SPI
+    // Initialize SPI, the SD card shares the bus
+    spibus_init();
     esp_err_t ret;
     spi_bus_config_t buscfg;
 
@@ -269,6 +378,7 @@ void display_init(void)
     buscfg.sclk_io_num = SPI_PIN_NUM_CLK;
     buscfg.quadwp_io_num = -1;
     buscfg.quadhd_io_num = -1;
+    buscfg.max_transfer_sz = chunk_size;
 
     spi_device_interface_config_t devcfg;
 
@@ -277,9 +387,8 @@ void display_init(void)
     devcfg.clock_speed_hz = LCD_SPI_CLOCK_RATE;
     devcfg.mode = 0;                                // SPI mode 0
     devcfg.spics_io_num = LCD_PIN_NUM_CS;           // CS pin
-    devcfg.queue_size = 7;                          // We want to be able to queue 7 transactions at a time
+    devcfg.queue_size = 5 + 2 * DISPLAY_MAX_QUEUE;  // A window and all chunks in flight
     devcfg.pre_cb = ili_spi_pre_transfer_callback;  // Specify pre-transfer callback to handle D/C line
-    devcfg.post_cb = ili_spi_post_transfer_callback;
     devcfg.flags = SPI_DEVICE_NO_DUMMY;
 
     ret = spi_bus_initialize(HSPI_HOST, &buscfg, 1);
@@ -289,19 +398,20 @@ void display_init(void)
     assert(ret == ESP_OK);
 
     ili_init();
+
+    // Send the cleared fb, which also prints how long a full frame takes
+    const int64_t start = esp_timer_get_time();
+    display_update();
+    display_drain();
+    printf("display: full frame in %u us, %u us of it drawing has to wait, %d lines per chunk, %d queued, %s\n",
+           (unsigned)(esp_timer_get_time() - start), s_stats.frame_us, s_config.chunk_lines,
+           s_config.queue_depth, s_stats.zero_copy ? "sent from fb" : "copied");
 }
 
 void display_drain(void)
 {
-    // Drain SPI queue
-    xTaskToNotify = 0;
-
-    esp_err_t err = ESP_OK;
-
-    while(err == ESP_OK) {
-        spi_transaction_t* trans_desc;
-        err = spi_device_get_trans_result(spi, &trans_desc, 0);
-    }
+    send_drain();
+    bus_release();
 }
 
 void display_poweroff()
@@ -309,6 +419,7 @@ void display_poweroff()
     display_drain();
 
     // Disable LCD panel
+    spibus_acquire(SPIBUS_DISPLAY);
     int cmd = 0;
     while (ili_sleep_cmds[cmd].databytes != 0xff) {
         ili_cmd(spi, ili_sleep_cmds[cmd].cmd);
@@ -318,42 +429,41 @@ void display_poweroff()
         }
         cmd++;
     }
+    spibus_release(SPIBUS_DISPLAY);
 }
 
 void display_clear(uint16_t color)
 {
-    xTaskToNotify = xTaskGetCurrentTaskHandle();
+    spibus_defer_display();
+    const int64_t start = esp_timer_get_time();
 
-    send_reset_drawing(0, 0, DISPLAY_WIDTH, DISPLAY_HEIGHT);
+    send_window(0, 0, DISPLAY_WIDTH, DISPLAY_HEIGHT);
 
-    uint16_t *pbuf = get_pbuf();
-
-    // clear the buffer
-    for (int i = 0; i < DISPLAY_WIDTH * PARALLEL_LINES; i++) {
-        pbuf[i] = (color << 8) | (color >> 8);
+    // Every chunk sends the same buffer, so the chunks of the last update have to be out
+    send_drain();
+    for (int i = 0; i < DISPLAY_WIDTH * s_config.chunk_lines; i++) {
+        pbuf[0][i] = (color << 8) | (color >> 8);
     }
-
-    // clear the screen
-    for (short dy = 0; dy < DISPLAY_HEIGHT; dy += PARALLEL_LINES) {
-        send_continue_line(pbuf, DISPLAY_WIDTH, PARALLEL_LINES);
+    for (short dy = 0; dy < DISPLAY_HEIGHT; dy += s_config.chunk_lines) {
+        const short count = DISPLAY_HEIGHT - dy < s_config.chunk_lines ? DISPLAY_HEIGHT - dy : s_config.chunk_lines;
+        send_chunk(chunk_slot(), pbuf[0], DISPLAY_WIDTH * count);
     }
+    s_stats.pixels += DISPLAY_WIDTH * DISPLAY_HEIGHT;
 
-    send_continue_wait();
+    send_finish(start);
 }
 
 void display_update(void)
 {
-    xTaskToNotify = xTaskGetCurrentTaskHandle();
+    spibus_defer_display();
+    const int64_t start = esp_timer_get_time();
 
-    send_reset_drawing(0, 0, DISPLAY_WIDTH, DISPLAY_HEIGHT);
-
-    for (short dy = 0; dy < DISPLAY_HEIGHT; dy += PARALLEL_LINES) {
-        uint16_t *pbuf = get_pbuf();
-        memcpy(pbuf, ((uint16_t *)fb->data) + DISPLAY_WIDTH * dy, DISPLAY_WIDTH * PARALLEL_LINES * sizeof(uint16_t));
-        send_continue_line(pbuf, DISPLAY_WIDTH, PARALLEL_LINES);
-    }
+    rect_t r = { 0, 0, DISPLAY_WIDTH, DISPLAY_HEIGHT };
+    send_rect(r);
 
-    send_continue_wait();
+    send_finish(start);
+    s_stats.frame_us = esp_timer_get_time() - start;
+    gbuf_clear_dirty(fb);
 }
 
 void display_update_rect(rect_t r)
@@ -365,29 +475,29 @@ void display_update_rect(rect_t r)
     assert(r.x + r.width <= DISPLAY_WIDTH);
     assert(r.y + r.height <= DISPLAY_HEIGHT);
 
-    xTaskToNotify = xTaskGetCurrentTaskHandle();
+    spibus_defer_display();
+    const int64_t start = esp_timer_get_time();
+    send_rect(r);
+    send_finish(start);
+}
 
-    send_reset_drawing(r.x, r.y, r.width, r.height);
+void display_flush(void)
+{
+    if (fb->dirty_count == 0) {
+        return;
+    }
 
-    if (r.width == DISPLAY_WIDTH) {
-        for (short dy = 0; dy < r.height; dy += PARALLEL_LINES) {
-            uint16_t *pbuf = get_pbuf();
-            short numLines = r.height - dy;
-            numLines = numLines < PARALLEL_LINES ? numLines : PARALLEL_LINES; 
-            memcpy(pbuf, ((uint16_t *)fb->data) + DISPLAY_WIDTH * (r.y + dy) + r.x, r.width * numLines * sizeof(uint16_t));
-            send_continue_line(pbuf, r.width, numLines);
-        }
-    } else {
-        for (short dy = 0; dy < r.height; dy += PARALLEL_LINES) {
-            uint16_t *pbuf = get_pbuf();
-            short numLines = r.height - dy;
-            numLines = numLines < PARALLEL_LINES ? numLines : PARALLEL_LINES;
-            for (short line = 0; line < numLines; line++) {
-                memcpy(pbuf + r.width * line, ((uint16_t *)fb->data) + DISPLAY_WIDTH * (r.y + dy + line) + r.x, r.width * sizeof(uint16_t));
-            }
-            send_continue_line(pbuf, r.width, numLines);
-        }
+    // The regions follow each other in the queue
+    spibus_defer_display();
+    const int64_t start = esp_timer_get_time();
+    for (int i = 0; i < fb->dirty_count; i++) {
+        send_rect(fb->dirty[i]);
     }
+    send_finish(start);
+    gbuf_clear_dirty(fb);
+}
 
-    send_continue_wait();
+void display_get_stats(display_stats_t *stats)
+{
+    *stats = s_stats;
 }
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #include "gbuf.h"
@@ -8,11 +10,51 @@
 #define DISPLAY_WIDTH (320)
 #define DISPLAY_HEIGHT (240)
 
-gbuf_t *fb;
+// Chunks queued to the SPI driver at a time at most
+#define DISPLAY_MAX_QUEUE 4
+
+typedef struct display_config_t {
+    // Lines of the screen sent in one SPI transaction, narrower regions fit more lines
+    int chunk_lines;
+    // Chunks queued at a time, the next one is prepared while they are sent
+    int queue_depth;
+    // Put fb in DMA capable memory and send full width regions straight from it, if
+    // zero_copy_reserve bytes of internal memory stay free for what is allocated later.
+    // Otherwise fb is copied into chunk buffers, whose last chunks are still sent after
+    // an update returned while the next frame is drawn.
+    bool zero_copy;
+    size_t zero_copy_reserve;
+} display_config_t;
+
+// Internal memory the rest of the app needs once Wi-Fi is up and a client transfers:
+// about 60 KiB for Wi-Fi, 20 KiB for lwIP, 16 KiB for the FTP task's stack and
+// 64 KiB for its transfer buffers
+#define DISPLAY_ZERO_COPY_RESERVE (160 * 1024)
+
+#define DISPLAY_CONFIG_DEFAULT() { \
+    .chunk_lines = 16, \
+    .queue_depth = 2, \
+    .zero_copy = true, \
+    .zero_copy_reserve = DISPLAY_ZERO_COPY_RESERVE, \
+}
+
+typedef struct display_stats_t {
+    bool zero_copy;      // fb is sent without copying
+    uint32_t updates;    // Updates sent, a flush counts once
+    uint64_t pixels;     // Pixels sent
+    uint64_t update_us;  // Time the callers were held up sending them
+    uint32_t frame_us;   // Time display_update was held up by the last full frame
+} display_stats_t;
+
+extern gbuf_t *fb;
 
 void display_init(void);
+void display_init_config(const display_config_t *config);
 void display_poweroff(void);
 void display_clear(uint16_t color);
 void display_update(void);
 void display_update_rect(rect_t r);
+// Send the regions of fb that changed since the last update
+void display_flush(void);
 void display_drain(void);
+void display_get_stats(display_stats_t *stats);
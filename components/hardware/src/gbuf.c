@@ -5,13 +5,24 @@
 
 gbuf_t *gbuf_new(uint16_t width, uint16_t height, uint16_t bytes_per_pixel, uint16_t endian)
 {
-    gbuf_t *g = malloc(sizeof(gbuf_t) + width * height * bytes_per_pixel);
+    gbuf_t *g = gbuf_new_alloc(width, height, bytes_per_pixel, endian, malloc);
     if (!g) abort();
+    return g;
+}
+
+gbuf_t *gbuf_new_alloc(uint16_t width, uint16_t height, uint16_t bytes_per_pixel, uint16_t endian,
+                       void *(*alloc)(size_t size))
+{
+    gbuf_t *g = alloc(sizeof(gbuf_t) + width * height * bytes_per_pixel);
+    if (!g) {
+        return NULL;
+    }
 
     g->width = width;
     g->height = height;
     g->bytes_per_pixel = bytes_per_pixel;
     g->endian = endian;
+    g->dirty_count = 0;
 
     return g;
 }
@@ -20,3 +31,73 @@ void gbuf_free(gbuf_t *g)
 {
     free(g);
 }
+
+static int rect_area(rect_t r)
+{
+    return r.width * r.height;
+}
+
+static rect_t rect_union(rect_t a, rect_t b)
+{
+    rect_t u;
+    u.x = a.x < b.x ? a.x : b.x;
+    u.y = a.y < b.y ? a.y : b.y;
+    u.width = (a.x + a.width > b.x + b.width ? a.x + a.width : b.x + b.width) - u.x;
+    u.height = (a.y + a.height > b.y + b.height ? a.y + a.height : b.y + b.height) - u.y;
+    return u;
+}
+
+void gbuf_mark_dirty(gbuf_t *g, rect_t r)
+{
+    /* clip to the buffer */
+    if (r.x < 0) {
+        r.width += r.x;
+        r.x = 0;
+    }
+    if (r.y < 0) {
+        r.height += r.y;
+        r.y = 0;
+    }
+    if (r.x + r.width > g->width) {
+        r.width = g->width - r.x;
+    }
+    if (r.y + r.height > g->height) {
+        r.height = g->height - r.y;
+    }
+    if (r.width <= 0 || r.height <= 0) {
+        return;
+    }
+
+    /* merge with regions that cover about as many pixels together as apart,
+       like a text line and the background cleared for it, until none is left */
+    for (int i = 0; i < g->dirty_count; i++) {
+        rect_t u = rect_union(g->dirty[i], r);
+        if (rect_area(u) <= rect_area(g->dirty[i]) + rect_area(r)) {
+            r = u;
+            g->dirty[i] = g->dirty[--g->dirty_count];
+            i = -1;
+        }
+    }
+
+    if (g->dirty_count < GBUF_MAX_DIRTY) {
+        g->dirty[g->dirty_count++] = r;
+        return;
+    }
+
+    /* out of slots, grow the region that grows least */
+    int best = 0;
+    int best_growth = -1;
+    for (int i = 0; i < g->dirty_count; i++) {
+        int growth = rect_area(rect_union(g->dirty[i], r)) - rect_area(g->dirty[i]);
+        if (best_growth < 0 || growth < best_growth) {
+            best = i;
+            best_growth = growth;
+        }
+    }
+    g->dirty[best] = rect_union(g->dirty[best], r);
+}
+
+void gbuf_clear_dirty(gbuf_t *g)
+{
+    g->dirty_count = 0;
+}
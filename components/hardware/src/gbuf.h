@@ -1,16 +1,28 @@
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
 
+#include "rect.h"
+
+/* Regions changed since the last flush, overlapping ones are merged */
+#define GBUF_MAX_DIRTY 8
 
 typedef struct {
     uint16_t width;
     uint16_t height;
     uint16_t bytes_per_pixel; /* 2:RGB16, 3:RGB, 4:RGBA */  
     uint16_t endian;
-    uint8_t data[];
+    uint16_t dirty_count;
+    rect_t dirty[GBUF_MAX_DIRTY];
+    uint8_t data[] __attribute__((aligned(4))); /* word aligned for DMA and word stores */
 } gbuf_t;
 
 
 gbuf_t *gbuf_new(uint16_t width, uint16_t height, uint16_t bytes_per_pixel, uint16_t endian);
+/* Like gbuf_new, with the buffer in memory from alloc, NULL if it fails; free it with gbuf_free */
+gbuf_t *gbuf_new_alloc(uint16_t width, uint16_t height, uint16_t bytes_per_pixel, uint16_t endian,
+                       void *(*alloc)(size_t size));
 void gbuf_free(gbuf_t *g);
+void gbuf_mark_dirty(gbuf_t *g, rect_t r);
+void gbuf_clear_dirty(gbuf_t *g);
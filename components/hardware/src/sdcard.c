@@ -1,8 +1,19 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
 #include "driver/gpio.h"
 #include "driver/sdspi_host.h"
+#include "diskio.h"
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
 #include "esp_vfs_fat.h"
+#include "sdmmc_cmd.h"
 
 #include "sdcard.h"
+#include "spibus.h"
 
 
 #define SDCARD_IO_MISO GPIO_NUM_19
@@ -10,13 +21,76 @@
 #define SDCARD_IO_CLK GPIO_NUM_18
 #define SDCARD_IO_CS GPIO_NUM_22
 
+// The self test transfers large sector aligned chunks of DMA capable memory, so FATFS
+// moves them straight to and from the card in multi-block commands like big file transfers
+#define SELF_TEST_FILE "/.sdtest.bin"
+#define SELF_TEST_CHUNK (16 * 1024)
+// Card and clock that passed the test, so it runs only once per card
+#define SELF_TEST_RESULT_FILE "/.sdtest"
+
 static sdmmc_card_t *sdcard = NULL;
+static sdcard_speed_t s_speed = { 0 };
 
-esp_err_t sdcard_init(const char *mount_path)
+// FATFS accesses the card through these, like the driver registered by
+// esp_vfs_fat_sdmmc_mount, but takes the SPI bus from the display first
+
+static DSTATUS sdcard_disk_status(BYTE pdrv)
+{
+    return 0;
+}
+
+static DRESULT sdcard_disk_read(BYTE pdrv, BYTE *buff, DWORD sector, UINT count)
+{
+    spibus_acquire(SPIBUS_SD);
+    esp_err_t err = sdmmc_read_sectors(sdcard, buff, sector, count);
+    spibus_release(SPIBUS_SD);
+    return err == ESP_OK ? RES_OK : RES_ERROR;
+}
+
+static DRESULT sdcard_disk_write(BYTE pdrv, const BYTE *buff, DWORD sector, UINT count)
 {
+    spibus_acquire(SPIBUS_SD);
+    esp_err_t err = sdmmc_write_sectors(sdcard, buff, sector, count);
+    spibus_release(SPIBUS_SD);
+    return err == ESP_OK ? RES_OK : RES_ERROR;
+}
+
+static DRESULT sdcard_disk_ioctl(BYTE pdrv, BYTE cmd, void *buff)
+{
+    switch (cmd) {
+        case CTRL_SYNC:
+            return RES_OK;
+        case GET_SECTOR_COUNT:
+            *((DWORD *)buff) = sdcard->csd.capacity;
+            return RES_OK;
+        case GET_SECTOR_SIZE:
+            *((WORD *)buff) = sdcard->csd.sector_size;
+            return RES_OK;
+        default:
+            return RES_ERROR;
+    }
+}
+
+static const ff_diskio_impl_t s_diskio = {
+    .init = &sdcard_disk_status,
+    .status = &sdcard_disk_status,
+    .read = &sdcard_disk_read,
+    .write = &sdcard_disk_write,
+    .ioctl = &sdcard_disk_ioctl,
+};
+
+// Mount the card and have FATFS access it through s_diskio
+static esp_err_t mount(const char *mount_path, int freq_khz, int max_files)
+{
+    // The mount takes the first free drive
+    BYTE pdrv = FF_DRV_NOT_USED;
+    if (ff_diskio_get_drive(&pdrv) != ESP_OK) {
+        return ESP_ERR_NO_MEM;
+    }
+
     sdmmc_host_t host = SDSPI_HOST_DEFAULT();
     host.slot = HSPI_HOST;
-    host.max_freq_khz = SDMMC_FREQ_DEFAULT;
+    host.max_freq_khz = freq_khz;
 
     sdspi_slot_config_t slot_config = SDSPI_SLOT_CONFIG_DEFAULT();
     slot_config.gpio_miso = SDCARD_IO_MISO;
@@ -26,9 +100,210 @@ esp_err_t sdcard_init(const char *mount_path)
 
     esp_vfs_fat_sdmmc_mount_config_t mount_config = { 0 };
     mount_config.format_if_mount_failed = false;
-    mount_config.max_files = 5;
+    mount_config.max_files = max_files;
+
+    esp_err_t err = esp_vfs_fat_sdmmc_mount(mount_path, &host, &slot_config, &mount_config, &sdcard);
+    if (err != ESP_OK) {
+        sdcard = NULL;
+        return err;
+    }
+    s_speed.freq_khz = freq_khz;
+    ff_diskio_register(pdrv, &s_diskio);
+    return ESP_OK;
+}
+
+static esp_err_t remount(const char *mount_path, int freq_khz, int max_files)
+{
+    printf("sdcard: remounting at %d kHz\n", freq_khz);
+    esp_vfs_fat_sdmmc_unmount();
+    sdcard = NULL;
+    return mount(mount_path, freq_khz, max_files);
+}
+
+static uint32_t kbps(size_t bytes, int64_t us)
+{
+    return us > 0 ? (uint32_t)((uint64_t)bytes * 1000 / us) : 0;
+}
+
+// Each chunk gets its own pattern, so chunks that end up in the wrong place are noticed too
+static void fill_pattern(uint8_t *buf, size_t chunk)
+{
+    for (size_t i = 0; i < SELF_TEST_CHUNK; i++) {
+        buf[i] = (uint8_t)(i + chunk * 101) ^ (uint8_t)(i >> 8);
+    }
+}
+
+// Write size bytes to a file, read them back, compare and remove it again
+static esp_err_t self_test(const char *mount_path, size_t size)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "%s" SELF_TEST_FILE, mount_path);
+    uint8_t *buf = heap_caps_malloc(SELF_TEST_CHUNK, MALLOC_CAP_DMA | MALLOC_CAP_8BIT);
+    uint8_t *pattern = malloc(SELF_TEST_CHUNK);
+    if (!buf || !pattern) {
+        free(buf);
+        free(pattern);
+        return ESP_ERR_NO_MEM;
+    }
+
+    esp_err_t err = ESP_FAIL;
+    size_t done = 0;
+    int64_t compare_us = 0;
+    s_speed.read_kbps = 0;
+    s_speed.write_kbps = 0;
+    int64_t start = esp_timer_get_time();
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        goto out;
+    }
+    while (done < size) {
+        fill_pattern(buf, done / SELF_TEST_CHUNK);
+        if (write(fd, buf, SELF_TEST_CHUNK) != SELF_TEST_CHUNK) {
+            break;
+        }
+        done += SELF_TEST_CHUNK;
+    }
+    // Closing flushes what FATFS still holds
+    if (close(fd) == -1 || done < size) {
+        goto out;
+    }
+    s_speed.write_kbps = kbps(done, esp_timer_get_time() - start);
+
+    done = 0;
+    start = esp_timer_get_time();
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        goto out;
+    }
+    while (done < size && read(fd, buf, SELF_TEST_CHUNK) == SELF_TEST_CHUNK) {
+        // Comparing is not part of the read speed
+        const int64_t compare_start = esp_timer_get_time();
+        fill_pattern(pattern, done / SELF_TEST_CHUNK);
+        if (memcmp(buf, pattern, SELF_TEST_CHUNK) != 0) {
+            printf("sdcard: read back differs in chunk %u\n", (unsigned)(done / SELF_TEST_CHUNK));
+            err = ESP_ERR_INVALID_CRC;
+            break;
+        }
+        compare_us += esp_timer_get_time() - compare_start;
+        done += SELF_TEST_CHUNK;
+    }
+    close(fd);
+    if (done < size) {
+        goto out;
+    }
+    s_speed.read_kbps = kbps(done, esp_timer_get_time() - start - compare_us);
+    err = ESP_OK;
+
+out:
+    unlink(path);
+    free(pattern);
+    free(buf);
+    return err;
+}
+
+// The card the test result belongs to
+static uint32_t card_id(void)
+{
+    return (uint32_t)sdcard->cid.serial ^ (uint32_t)sdcard->cid.mfg_id << 24 ^ (uint32_t)sdcard->csd.capacity;
+}
 
-    return esp_vfs_fat_sdmmc_mount(mount_path, &host, &slot_config, &mount_config, &sdcard);
+// Read the result of an earlier self test of this card, false if there is none
+static bool load_result(const char *mount_path, int *freq_khz)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "%s" SELF_TEST_RESULT_FILE, mount_path);
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return false;
+    }
+    unsigned id, read_kbps, write_kbps;
+    const bool found = fscanf(f, "%x %d %u %u", &id, freq_khz, &read_kbps, &write_kbps) == 4 &&
+                       id == card_id() && *freq_khz >= SDMMC_FREQ_DEFAULT;
+    fclose(f);
+    if (found) {
+        s_speed.read_kbps = read_kbps;
+        s_speed.write_kbps = write_kbps;
+    }
+    return found;
+}
+
+static void save_result(const char *mount_path)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "%s" SELF_TEST_RESULT_FILE, mount_path);
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        return;
+    }
+    fprintf(f, "%08x %d %u %u\n", card_id(), s_speed.freq_khz, s_speed.read_kbps, s_speed.write_kbps);
+    fclose(f);
+}
+
+// Check the card copes with the clock it is mounted at, once per card. A card that
+// fails at a faster clock is remounted at SDMMC_FREQ_DEFAULT, now and on later mounts.
+static esp_err_t check_card(const char *mount_path, const sdcard_config_t *config)
+{
+    int freq_khz;
+    if (load_result(mount_path, &freq_khz)) {
+        if (freq_khz < s_speed.freq_khz) {
+            return remount(mount_path, freq_khz, config->max_files);
+        }
+        return ESP_OK;
+    }
+
+    const size_t size = (config->self_test_size + SELF_TEST_CHUNK - 1) / SELF_TEST_CHUNK * SELF_TEST_CHUNK;
+    esp_err_t err = self_test(mount_path, size);
+    if (err != ESP_OK && s_speed.freq_khz > SDMMC_FREQ_DEFAULT) {
+        printf("sdcard: self test at %d kHz failed (0x%x)\n", s_speed.freq_khz, err);
+        err = remount(mount_path, SDMMC_FREQ_DEFAULT, config->max_files);
+        if (err != ESP_OK) {
+            return err;
+        }
+        err = self_test(mount_path, size);
+    }
+    if (err != ESP_OK) {
+        // Nothing slower to try, the card stays usable as far as mounting goes
+        printf("sdcard: self test failed (0x%x)\n", err);
+        return ESP_OK;
+    }
+    save_result(mount_path);
+    return ESP_OK;
+}
+
+esp_err_t sdcard_init(const char *mount_path)
+{
+    sdcard_config_t config = SDCARD_CONFIG_DEFAULT();
+    return sdcard_init_config(mount_path, &config);
+}
+
+esp_err_t sdcard_init_config(const char *mount_path, const sdcard_config_t *config)
+{
+    memset(&s_speed, 0, sizeof(s_speed));
+    spibus_init();
+
+    // Not every card copes with a faster clock on the bus shared with the display
+    int freq_khz = config->max_freq_khz;
+    esp_err_t err = mount(mount_path, freq_khz, config->max_files);
+    if (err != ESP_OK && err != ESP_ERR_INVALID_STATE && freq_khz > SDMMC_FREQ_DEFAULT) {
+        printf("sdcard: mounting at %d kHz failed (0x%x), retrying at %d kHz\n",
+               freq_khz, err, SDMMC_FREQ_DEFAULT);
+        err = mount(mount_path, SDMMC_FREQ_DEFAULT, config->max_files);
+    }
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    if (config->self_test_size > 0) {
+        if ((err = check_card(mount_path, config)) != ESP_OK) {
+            return err;
+        }
+        if (s_speed.read_kbps > 0) {
+            printf("sdcard: %d kHz, read %u.%02u MB/s, write %u.%02u MB/s\n", s_speed.freq_khz,
+                   s_speed.read_kbps / 1000, s_speed.read_kbps % 1000 / 10,
+                   s_speed.write_kbps / 1000, s_speed.write_kbps % 1000 / 10);
+        }
+    }
+    return ESP_OK;
 }
 
 esp_err_t sdcard_deinit()
@@ -37,10 +312,17 @@ esp_err_t sdcard_deinit()
         return ESP_FAIL;
     }
 
-    return esp_vfs_fat_sdmmc_unmount();
+    esp_err_t err = esp_vfs_fat_sdmmc_unmount();
+    sdcard = NULL;
+    return err;
 }
 
 bool sdcard_present(void)
 {
     return sdcard != NULL;
 }
+
+void sdcard_get_speed(sdcard_speed_t *speed)
+{
+    *speed = s_speed;
+}
@@ -1,8 +1,41 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include "esp_err.h"
+#include "driver/sdmmc_types.h"
+
+// Where the card is mounted, host builds point it at a local directory
+#ifndef SDCARD_MOUNT_POINT
+#define SDCARD_MOUNT_POINT "/sdcard"
+#endif
+
+typedef struct sdcard_config_t {
+    // SPI clock, the card is mounted at SDMMC_FREQ_DEFAULT if it fails at a higher one
+    int max_freq_khz;
+    // Files that can be open at the same time
+    int max_files;
+    // Bytes written, read back and compared to check the card copes with max_freq_khz and
+    // to measure the speed. It runs once per card, a card that fails it is used at
+    // SDMMC_FREQ_DEFAULT from then on. 0 skips the test.
+    size_t self_test_size;
+} sdcard_config_t;
+
+#define SDCARD_CONFIG_DEFAULT() { \
+    .max_freq_khz = SDMMC_FREQ_DEFAULT, \
+    .max_files = 5, \
+    .self_test_size = 0, \
+}
+
+typedef struct sdcard_speed_t {
+    int freq_khz;        // SPI clock the card is mounted at
+    uint32_t read_kbps;  // Kilobytes per second measured by the self test of this card, 0 if not run
+    uint32_t write_kbps;
+} sdcard_speed_t;
 
 esp_err_t sdcard_init(const char *mount_path);
+esp_err_t sdcard_init_config(const char *mount_path, const sdcard_config_t *config);
 esp_err_t sdcard_deinit(void);
-bool sdcard_present(void);
\ No newline at end of file
+bool sdcard_present(void);
+void sdcard_get_speed(sdcard_speed_t *speed);
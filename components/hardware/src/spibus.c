@@ -0,0 +1,100 @@
+#include <assert.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+
+#include "spibus.h"
+
+
+static SemaphoreHandle_t s_bus = NULL;
+static portMUX_TYPE s_mux = portMUX_INITIALIZER_UNLOCKED;
+// Card accesses waiting for the bus, the display lets them go first
+static volatile int s_sd_waiting = 0;
+static volatile int64_t s_sd_last_us = 0;
+static int64_t s_acquired_us[SPIBUS_USER_COUNT];
+static spibus_stats_t s_stats = { 0 };
+
+void spibus_init(void)
+{
+    if (s_bus == NULL) {
+        s_bus = xSemaphoreCreateMutex();
+        assert(s_bus != NULL);
+    }
+}
+
+static void count_wait(spibus_user_t user, int64_t start)
+{
+    const int64_t now = esp_timer_get_time();
+    const uint32_t wait_us = now - start;
+    s_acquired_us[user] = now;
+    s_stats.acquired[user]++;
+    s_stats.wait_us[user] += wait_us;
+    if (wait_us > s_stats.max_wait_us[user]) {
+        s_stats.max_wait_us[user] = wait_us;
+    }
+}
+
+void spibus_acquire(spibus_user_t user)
+{
+    const int64_t start = esp_timer_get_time();
+    if (user == SPIBUS_SD) {
+        portENTER_CRITICAL(&s_mux);
+        s_sd_waiting++;
+        portEXIT_CRITICAL(&s_mux);
+        xSemaphoreTake(s_bus, portMAX_DELAY);
+        portENTER_CRITICAL(&s_mux);
+        s_sd_waiting--;
+        portEXIT_CRITICAL(&s_mux);
+    } else {
+        for (;;) {
+            while (s_sd_waiting > 0) {
+                vTaskDelay(1);
+            }
+            xSemaphoreTake(s_bus, portMAX_DELAY);
+            if (s_sd_waiting == 0) {
+                break;
+            }
+            // A card access came in while waiting for the bus
+            xSemaphoreGive(s_bus);
+        }
+    }
+    count_wait(user, start);
+}
+
+void spibus_release(spibus_user_t user)
+{
+    const int64_t now = esp_timer_get_time();
+    s_stats.hold_us[user] += now - s_acquired_us[user];
+    if (user == SPIBUS_SD) {
+        s_sd_last_us = now;
+    }
+    xSemaphoreGive(s_bus);
+}
+
+bool spibus_sd_waiting(void)
+{
+    return s_sd_waiting > 0;
+}
+
+void spibus_defer_display(void)
+{
+    const int64_t start = esp_timer_get_time();
+    int64_t now = start;
+    while (now - s_sd_last_us < SPIBUS_SD_IDLE_MS * 1000 &&
+           now - start < SPIBUS_DEFER_MAX_MS * 1000) {
+        vTaskDelay(SPIBUS_SD_IDLE_MS / portTICK_PERIOD_MS);
+        now = esp_timer_get_time();
+    }
+    if (now != start) {
+        s_stats.deferred++;
+        s_stats.defer_us += now - start;
+    }
+}
+
+void spibus_get_stats(spibus_stats_t *stats)
+{
+    memcpy(stats, &s_stats, sizeof(s_stats));
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Arbitration of the SPI bus shared by the display and the SD card.
+//
+// The SPI driver interleaves the transactions of both devices as they are queued,
+// so a display update of 48 chunks slows down every card access it overlaps with.
+// Both devices take the bus for a burst of transactions instead, a chunk of lines
+// or a run of sectors, and the card goes first: the display lets waiting card
+// accesses through between its chunks and holds back updates for a while after
+// the card was used.
+
+// Card accesses less than this apart count as one busy period
+#define SPIBUS_SD_IDLE_MS 10
+// Display updates are held back at most this long for a busy card
+#define SPIBUS_DEFER_MAX_MS 200
+
+typedef enum spibus_user_t {
+    SPIBUS_SD,
+    SPIBUS_DISPLAY,
+    SPIBUS_USER_COUNT,
+} spibus_user_t;
+
+typedef struct spibus_stats_t {
+    uint32_t acquired[SPIBUS_USER_COUNT]; // Times the bus was taken
+    uint64_t wait_us[SPIBUS_USER_COUNT];  // Time spent waiting for the bus
+    uint32_t max_wait_us[SPIBUS_USER_COUNT];
+    uint64_t hold_us[SPIBUS_USER_COUNT];  // Time the bus was held
+    uint32_t deferred;    // Display updates held back for the card
+    uint64_t defer_us;    // Time display updates were held back
+} spibus_stats_t;
+
+void spibus_init(void);
+void spibus_acquire(spibus_user_t user);
+void spibus_release(spibus_user_t user);
+
+// Card accesses are waiting for the bus, the display should let them go first
+bool spibus_sd_waiting(void);
+
+// Wait until the card is idle before a display update, up to SPIBUS_DEFER_MAX_MS
+void spibus_defer_display(void);
+
+void spibus_get_stats(spibus_stats_t *stats);
@@ -12,11 +12,12 @@
 #include "lwip/ip4_addr.h"
 
 #include "frozen.h"
+#include "sdcard.h"
 #include "wifi.h"
 
 
 #define CONFIG_FILE "/spiffs/wifi.json"
-#define BACKUP_CONFIG_FILE "/sdcard/wifi.json"
+#define BACKUP_CONFIG_FILE SDCARD_MOUNT_POINT "/wifi.json"
 
 wifi_network_t **wifi_networks = NULL;
 size_t wifi_network_count = 0;
@@ -24,8 +24,8 @@ typedef enum wifi_state_t {
 typedef void (*wifi_scan_done_cb_t)(void *arg);
 typedef void (*wifi_changed_cb_t)(system_event_id_t);
 
-wifi_network_t **wifi_networks;
-size_t wifi_network_count;
+extern wifi_network_t **wifi_networks;
+extern size_t wifi_network_count;
 
 void wifi_init(void);
 void wifi_enable(void);
@@ -9,3 +9,10 @@
 
 COMPONENT_ADD_INCLUDEDIRS = src
 COMPONENT_SRCDIRS = src
+
+# cmdparser.c is generated from cmdparser.re and committed, so building doesn't need
+# re2c. Where re2c is installed it is generated again once the grammar changed.
+ifneq ($(shell which re2c 2>/dev/null),)
+$(COMPONENT_PATH)/src/cmdparser.c: $(COMPONENT_PATH)/src/cmdparser.re
+	re2c -W $< -o $@
+endif
@@ -42,6 +42,13 @@ const char *keyword_names[] = {
     "STAT",           // [<SP> <pathname>] <CRLF>
     "HELP",           // [<SP> <string>] <CRLF>
     "NOOP",           // <CRLF>
+    "FEAT",           // <CRLF> see https://tools.ietf.org/html/rfc2389
+    "OPTS",           // <SP> <command-name> [<SP> <command-options>] <CRLF>
+    "HASH",           // <SP> <pathname> <CRLF> see draft-bryan-ftp-hash
+    "XCRC",           // <SP> <pathname> <CRLF>
+    "XMD5",           // <SP> <pathname> <CRLF>
+    "XSHA1",          // <SP> <pathname> <CRLF>
+    "XSHA256",        // <SP> <pathname> <CRLF>
     "NUM_FTPKEYWORDS" // is set to number of commands
 };
 
@@ -74,7 +81,7 @@ FtpCmd parse_ftpcmd(const char *YYCURSOR) {
 	const char *p1, *p2, *p3, *p4, *p5, *p6;
 	const char *yyt1;const char *yyt2;const char *yyt3;const char *yyt4;const char *yyt5;const char *yyt6;
 	
-#line 78 "cmdparser.c"
+#line 85 "cmdparser.c"
 {
 	char yych;
 	yych = *YYCURSOR;
@@ -82,24 +89,27 @@ FtpCmd parse_ftpcmd(const char *YYCURSOR) {
 	case 'A':	goto yy4;
 	case 'C':	goto yy5;
 	case 'D':	goto yy6;
+	case 'F':	goto yy310;
 	case 'H':	goto yy7;
 	case 'L':	goto yy8;
 	case 'M':	goto yy9;
 	case 'N':	goto yy10;
+	case 'O':	goto yy314;
 	case 'P':	goto yy11;
 	case 'Q':	goto yy12;
 	case 'R':	goto yy13;
 	case 'S':	goto yy14;
 	case 'T':	goto yy15;
 	case 'U':	goto yy16;
+	case 'X':	goto yy321;
 	default:	goto yy2;
 	}
 yy2:
 	++YYCURSOR;
 yy3:
-#line 98 "cmdparser.re"
+#line 105 "cmdparser.re"
 	{ goto done; }
-#line 103 "cmdparser.c"
+#line 113 "cmdparser.c"
 yy4:
 	yych = *(YYMARKER = ++YYCURSOR);
 	switch (yych) {
@@ -124,6 +134,7 @@ yy6:
 yy7:
 	yych = *(YYMARKER = ++YYCURSOR);
 	switch (yych) {
+	case 'A':	goto yy318;
 	case 'E':	goto yy24;
 	default:	goto yy3;
 	}
@@ -679,9 +690,9 @@ yy88:
 	}
 yy89:
 	++YYCURSOR;
-#line 144 "cmdparser.re"
+#line 151 "cmdparser.re"
 	{ CMD_NOPARAM(PWD) }
-#line 685 "cmdparser.c"
+#line 696 "cmdparser.c"
 yy91:
 	yych = *++YYCURSOR;
 	switch (yych) {
@@ -817,9 +828,9 @@ yy107:
 	}
 yy108:
 	++YYCURSOR;
-#line 140 "cmdparser.re"
+#line 147 "cmdparser.re"
 	{ CMD_NOPARAM(ABOR) }
-#line 823 "cmdparser.c"
+#line 834 "cmdparser.c"
 yy110:
 	yych = *++YYCURSOR;
 	switch (yych) {
@@ -840,9 +851,9 @@ yy111:
 	}
 yy113:
 	++YYCURSOR;
-#line 136 "cmdparser.re"
+#line 143 "cmdparser.re"
 	{ CMD_NOPARAM(ALLO) }
-#line 846 "cmdparser.c"
+#line 857 "cmdparser.c"
 yy115:
 	yych = *++YYCURSOR;
 	switch (yych) {
@@ -851,9 +862,9 @@ yy115:
 	}
 yy116:
 	++YYCURSOR;
-#line 103 "cmdparser.re"
+#line 110 "cmdparser.re"
 	{ CMD_NOPARAM(CDUP) }
-#line 857 "cmdparser.c"
+#line 868 "cmdparser.c"
 yy118:
 	yych = *++YYCURSOR;
 	switch (yych) {
@@ -888,9 +899,9 @@ yy123:
 	++YYCURSOR;
 	p1 = yyt2;
 	p2 = yyt1;
-#line 150 "cmdparser.re"
+#line 157 "cmdparser.re"
 	{ CMD_OPT_STRING(HELP) }
-#line 894 "cmdparser.c"
+#line 905 "cmdparser.c"
 yy125:
 	yych = *++YYCURSOR;
 	switch (yych) {
@@ -913,9 +924,9 @@ yy128:
 	++YYCURSOR;
 	p1 = yyt2;
 	p2 = yyt1;
-#line 145 "cmdparser.re"
+#line 152 "cmdparser.re"
 	{ CMD_OPT_STRING(LIST) }
-#line 919 "cmdparser.c"
+#line 930 "cmdparser.c"
 yy130:
 	yych = *++YYCURSOR;
 	switch (yych) {
@@ -954,6 +965,7 @@ yy135:
 	case 'B':
 	case 'C':
 	case 'S':
+	case 'Z':
 		yyt1 = YYCURSOR;
 		goto yy205;
 	default:	goto yy18;
@@ -962,9 +974,9 @@ yy137:
 	++YYCURSOR;
 	p1 = yyt2;
 	p2 = yyt1;
-#line 146 "cmdparser.re"
+#line 153 "cmdparser.re"
 	{ CMD_OPT_STRING(NLST) }
-#line 968 "cmdparser.c"
+#line 980 "cmdparser.c"
 yy139:
 	yych = *++YYCURSOR;
 	switch (yych) {
@@ -985,9 +997,9 @@ yy141:
 	}
 yy142:
 	++YYCURSOR;
-#line 151 "cmdparser.re"
+#line 158 "cmdparser.re"
 	{ CMD_NOPARAM(NOOP) }
-#line 991 "cmdparser.c"
+#line 1003 "cmdparser.c"
 yy144:
 	yych = *++YYCURSOR;
 	switch (yych) {
@@ -1008,9 +1020,9 @@ yy145:
 	}
 yy147:
 	++YYCURSOR;
-#line 117 "cmdparser.re"
+#line 124 "cmdparser.re"
 	{ CMD_NOPARAM(PASV) }
-#line 1014 "cmdparser.c"
+#line 1026 "cmdparser.c"
 yy149:
 	yych = *++YYCURSOR;
 	switch (yych) {
@@ -1045,9 +1057,9 @@ yy151:
 	}
 yy152:
 	++YYCURSOR;
-#line 105 "cmdparser.re"
+#line 112 "cmdparser.re"
 	{ CMD_NOPARAM(QUIT) }
-#line 1051 "cmdparser.c"
+#line 1063 "cmdparser.c"
 yy154:
 	yych = *++YYCURSOR;
 	switch (yych) {
@@ -1118,9 +1130,9 @@ yy165:
 	++YYCURSOR;
 	p1 = yyt2;
 	p2 = yyt1;
-#line 147 "cmdparser.re"
+#line 154 "cmdparser.re"
 	{ CMD_STRING(SITE) }
-#line 1124 "cmdparser.c"
+#line 1136 "cmdparser.c"
 yy167:
 	yych = *++YYCURSOR;
 	switch (yych) {
@@ -1155,9 +1167,9 @@ yy172:
 	++YYCURSOR;
 	p1 = yyt2;
 	p2 = yyt1;
-#line 149 "cmdparser.re"
+#line 156 "cmdparser.re"
 	{ CMD_OPT_STRING(STAT) }
-#line 1161 "cmdparser.c"
+#line 1173 "cmdparser.c"
 yy174:
 	yych = *++YYCURSOR;
 	switch (yych) {
@@ -1190,9 +1202,9 @@ yy177:
 	}
 yy179:
 	++YYCURSOR;
-#line 135 "cmdparser.re"
+#line 142 "cmdparser.re"
 	{ CMD_NOPARAM(STOU) }
-#line 1196 "cmdparser.c"
+#line 1208 "cmdparser.c"
 yy181:
 	yych = *++YYCURSOR;
 	switch (yych) {
@@ -1213,9 +1225,9 @@ yy182:
 	}
 yy184:
 	++YYCURSOR;
-#line 148 "cmdparser.re"
+#line 155 "cmdparser.re"
 	{ CMD_NOPARAM(SYST) }
-#line 1219 "cmdparser.c"
+#line 1231 "cmdparser.c"
 yy186:
 	yych = *++YYCURSOR;
 	switch (yych) {
@@ -1263,9 +1275,9 @@ yy193:
 	++YYCURSOR;
 	p1 = yyt1;
 	p2 = yyt2;
-#line 102 "cmdparser.re"
+#line 109 "cmdparser.re"
 	{ CMD_STRING(CWD)  }
-#line 1269 "cmdparser.c"
+#line 1281 "cmdparser.c"
 yy195:
 	yych = *++YYCURSOR;
 	switch (yych) {
@@ -1312,9 +1324,9 @@ yy202:
 	++YYCURSOR;
 	p1 = yyt1;
 	p2 = yyt2;
-#line 143 "cmdparser.re"
+#line 150 "cmdparser.re"
 	{ CMD_STRING(MKD) }
-#line 1318 "cmdparser.c"
+#line 1330 "cmdparser.c"
 yy204:
 	yych = *++YYCURSOR;
 	switch (yych) {
@@ -1435,9 +1447,9 @@ yy218:
 	++YYCURSOR;
 	p1 = yyt1;
 	p2 = yyt2;
-#line 142 "cmdparser.re"
+#line 149 "cmdparser.re"
 	{ CMD_STRING(RMD) }
-#line 1441 "cmdparser.c"
+#line 1453 "cmdparser.c"
 yy220:
 	yych = *++YYCURSOR;
 	switch (yych) {
@@ -1548,9 +1560,9 @@ yy237:
 	++YYCURSOR;
 	p1 = yyt1;
 	p2 = yyt2;
-#line 101 "cmdparser.re"
+#line 108 "cmdparser.re"
 	{ CMD_STRING(ACCT) }
-#line 1554 "cmdparser.c"
+#line 1566 "cmdparser.c"
 yy239:
 	yych = *++YYCURSOR;
 	switch (yych) {
@@ -1561,9 +1573,9 @@ yy240:
 	++YYCURSOR;
 	p1 = yyt1;
 	p2 = yyt2;
-#line 141 "cmdparser.re"
+#line 148 "cmdparser.re"
 	{ CMD_STRING(DELE) }
-#line 1567 "cmdparser.c"
+#line 1579 "cmdparser.c"
 yy242:
 	yych = *++YYCURSOR;
 	switch (yych) {
@@ -1573,13 +1585,13 @@ yy242:
 yy243:
 	++YYCURSOR;
 	p1 = yyt1;
-#line 128 "cmdparser.re"
+#line 135 "cmdparser.re"
 	{
 	        cmd.keyword = MODE;
 	        cmd.parameter.code = *p1;
 	        goto done;
 	    }
-#line 1583 "cmdparser.c"
+#line 1595 "cmdparser.c"
 yy245:
 	yych = *++YYCURSOR;
 	switch (yych) {
@@ -1590,9 +1602,9 @@ yy246:
 	++YYCURSOR;
 	p1 = yyt1;
 	p2 = yyt2;
-#line 100 "cmdparser.re"
+#line 107 "cmdparser.re"
 	{ CMD_STRING(PASS) }
-#line 1596 "cmdparser.c"
+#line 1608 "cmdparser.c"
 yy248:
 	yych = *++YYCURSOR;
 	switch (yych) {
@@ -1638,9 +1650,9 @@ yy251:
 	++YYCURSOR;
 	p1 = yyt1;
 	p2 = yyt2;
-#line 137 "cmdparser.re"
+#line 144 "cmdparser.re"
 	{ CMD_STRING(REST) }
-#line 1644 "cmdparser.c"
+#line 1656 "cmdparser.c"
 yy253:
 	yych = *++YYCURSOR;
 	switch (yych) {
@@ -1651,9 +1663,9 @@ yy254:
 	++YYCURSOR;
 	p1 = yyt1;
 	p2 = yyt2;
-#line 133 "cmdparser.re"
+#line 140 "cmdparser.re"
 	{ CMD_STRING(RETR) }
-#line 1657 "cmdparser.c"
+#line 1669 "cmdparser.c"
 yy256:
 	yych = *++YYCURSOR;
 	switch (yych) {
@@ -1664,9 +1676,9 @@ yy257:
 	++YYCURSOR;
 	p1 = yyt1;
 	p2 = yyt2;
-#line 138 "cmdparser.re"
+#line 145 "cmdparser.re"
 	{ CMD_STRING(RNFR) }
-#line 1670 "cmdparser.c"
+#line 1682 "cmdparser.c"
 yy259:
 	yych = *++YYCURSOR;
 	switch (yych) {
@@ -1677,9 +1689,9 @@ yy260:
 	++YYCURSOR;
 	p1 = yyt1;
 	p2 = yyt2;
-#line 139 "cmdparser.re"
+#line 146 "cmdparser.re"
 	{ CMD_STRING(RNTO) }
-#line 1683 "cmdparser.c"
+#line 1695 "cmdparser.c"
 yy262:
 	yych = *++YYCURSOR;
 	switch (yych) {
@@ -1690,9 +1702,9 @@ yy263:
 	++YYCURSOR;
 	p1 = yyt1;
 	p2 = yyt2;
-#line 104 "cmdparser.re"
+#line 111 "cmdparser.re"
 	{ CMD_STRING(SMNT) }
-#line 1696 "cmdparser.c"
+#line 1708 "cmdparser.c"
 yy265:
 	yych = *++YYCURSOR;
 	switch (yych) {
@@ -1703,9 +1715,9 @@ yy266:
 	++YYCURSOR;
 	p1 = yyt1;
 	p2 = yyt2;
-#line 134 "cmdparser.re"
+#line 141 "cmdparser.re"
 	{ CMD_STRING(STOR) }
-#line 1709 "cmdparser.c"
+#line 1721 "cmdparser.c"
 yy268:
 	yych = *++YYCURSOR;
 	switch (yych) {
@@ -1715,13 +1727,13 @@ yy268:
 yy269:
 	++YYCURSOR;
 	p1 = yyt1;
-#line 123 "cmdparser.re"
+#line 130 "cmdparser.re"
 	{
 	        cmd.keyword = STRU;
 	        cmd.parameter.code = *p1;
 	        goto done;
 	    }
-#line 1725 "cmdparser.c"
+#line 1737 "cmdparser.c"
 yy271:
 	yych = *++YYCURSOR;
 	switch (yych) {
@@ -1731,13 +1743,13 @@ yy271:
 yy272:
 	++YYCURSOR;
 	p1 = yyt1;
-#line 118 "cmdparser.re"
+#line 125 "cmdparser.re"
 	{
 	        cmd.keyword = TYPE;
 	        cmd.parameter.code = *p1;
 	        goto done;
 	    }
-#line 1741 "cmdparser.c"
+#line 1753 "cmdparser.c"
 yy274:
 	yych = *++YYCURSOR;
 	switch (yych) {
@@ -1748,9 +1760,9 @@ yy275:
 	++YYCURSOR;
 	p1 = yyt1;
 	p2 = yyt2;
-#line 99 "cmdparser.re"
+#line 106 "cmdparser.re"
 	{ CMD_STRING(USER) }
-#line 1754 "cmdparser.c"
+#line 1766 "cmdparser.c"
 yy277:
 	yych = *++YYCURSOR;
 	switch (yych) {
@@ -2183,7 +2195,7 @@ yy306:
 	p4 = yyt4;
 	p5 = yyt5;
 	p6 = yyt6;
-#line 106 "cmdparser.re"
+#line 113 "cmdparser.re"
 	{
 	        cmd.keyword = PORT;
 	        cmd.parameter.numbers[0] = strtoul(p1, NULL, 10);
@@ -2195,7 +2207,7 @@ yy306:
 	        cmd.parameter.numbers[5] = strtoul(p6, NULL, 10);
 	        goto done;
 	    }
-#line 2199 "cmdparser.c"
+#line 2211 "cmdparser.c"
 yy308:
 	yych = *++YYCURSOR;
 	switch (yych) {
@@ -2216,8 +2228,402 @@ yy309:
 	case '5':	goto yy302;
 	default:	goto yy18;
 	}
+yy310:
+	yych = *(YYMARKER = ++YYCURSOR);
+	switch (yych) {
+	case 'E':	goto yy311;
+	default:	goto yy3;
+	}
+yy311:
+	yych = *++YYCURSOR;
+	switch (yych) {
+	case 'A':	goto yy312;
+	default:	goto yy18;
+	}
+yy312:
+	yych = *++YYCURSOR;
+	switch (yych) {
+	case 'T':	goto yy313;
+	default:	goto yy18;
+	}
+yy314:
+	yych = *(YYMARKER = ++YYCURSOR);
+	switch (yych) {
+	case 'P':	goto yy315;
+	default:	goto yy3;
+	}
+yy315:
+	yych = *++YYCURSOR;
+	switch (yych) {
+	case 'T':	goto yy316;
+	default:	goto yy18;
+	}
+yy316:
+	yych = *++YYCURSOR;
+	switch (yych) {
+	case 'S':	goto yy317;
+	default:	goto yy18;
+	}
+yy318:
+	yych = *++YYCURSOR;
+	switch (yych) {
+	case 'S':	goto yy319;
+	default:	goto yy18;
+	}
+yy319:
+	yych = *++YYCURSOR;
+	switch (yych) {
+	case 'H':	goto yy320;
+	default:	goto yy18;
+	}
+yy321:
+	yych = *(YYMARKER = ++YYCURSOR);
+	switch (yych) {
+	case 'C':	goto yy322;
+	case 'M':	goto yy325;
+	case 'S':	goto yy328;
+	default:	goto yy3;
+	}
+yy322:
+	yych = *++YYCURSOR;
+	switch (yych) {
+	case 'R':	goto yy323;
+	default:	goto yy18;
+	}
+yy323:
+	yych = *++YYCURSOR;
+	switch (yych) {
+	case 'C':	goto yy324;
+	default:	goto yy18;
+	}
+yy325:
+	yych = *++YYCURSOR;
+	switch (yych) {
+	case 'D':	goto yy326;
+	default:	goto yy18;
+	}
+yy326:
+	yych = *++YYCURSOR;
+	switch (yych) {
+	case '5':	goto yy327;
+	default:	goto yy18;
+	}
+yy328:
+	yych = *++YYCURSOR;
+	switch (yych) {
+	case 'H':	goto yy329;
+	default:	goto yy18;
+	}
+yy329:
+	yych = *++YYCURSOR;
+	switch (yych) {
+	case 'A':	goto yy330;
+	default:	goto yy18;
+	}
+yy330:
+	yych = *++YYCURSOR;
+	switch (yych) {
+	case '1':	goto yy331;
+	case '2':	goto yy332;
+	default:	goto yy18;
+	}
+yy332:
+	yych = *++YYCURSOR;
+	switch (yych) {
+	case '5':	goto yy333;
+	default:	goto yy18;
+	}
+yy333:
+	yych = *++YYCURSOR;
+	switch (yych) {
+	case '6':	goto yy334;
+	default:	goto yy18;
+	}
+yy313:
+	yych = *++YYCURSOR;
+	switch (yych) {
+	case 0x00:
+	case '\n':	goto yy335;
+	case '\r':	goto yy336;
+	default:	goto yy18;
+	}
+yy335:
+	++YYCURSOR;
+#line 159 "cmdparser.re"
+	{ CMD_NOPARAM(FEAT) }
+#line 2355 "cmdparser.c"
+yy336:
+	yych = *++YYCURSOR;
+	switch (yych) {
+	case '\n':	goto yy335;
+	default:	goto yy18;
+	}
+yy317:
+	yych = *++YYCURSOR;
+	switch (yych) {
+	case '\t':
+	case ' ':	goto yy339;
+	default:	goto yy18;
+	}
+yy339:
+	yych = *++YYCURSOR;
+	switch (yych) {
+	case 0x00:
+	case '\n':
+	case '\r':	goto yy18;
+	case '\t':
+	case ' ':	goto yy339;
+	default:
+		yyt1 = YYCURSOR;
+		goto yy340;
+	}
+yy340:
+	yych = *++YYCURSOR;
+	switch (yych) {
+	case 0x00:
+	case '\n':
+		yyt2 = YYCURSOR;
+		goto yy337;
+	case '\r':
+		yyt2 = YYCURSOR;
+		goto yy338;
+	default:	goto yy340;
+	}
+yy337:
+	++YYCURSOR;
+	p1 = yyt1;
+	p2 = yyt2;
+#line 160 "cmdparser.re"
+	{ CMD_STRING(OPTS) }
+#line 2399 "cmdparser.c"
+yy338:
+	yych = *++YYCURSOR;
+	switch (yych) {
+	case '\n':	goto yy337;
+	default:	goto yy18;
+	}
+yy320:
+	yych = *++YYCURSOR;
+	switch (yych) {
+	case '\t':
+	case ' ':	goto yy343;
+	default:	goto yy18;
+	}
+yy343:
+	yych = *++YYCURSOR;
+	switch (yych) {
+	case 0x00:
+	case '\n':
+	case '\r':	goto yy18;
+	case '\t':
+	case ' ':	goto yy343;
+	default:
+		yyt1 = YYCURSOR;
+		goto yy344;
+	}
+yy344:
+	yych = *++YYCURSOR;
+	switch (yych) {
+	case 0x00:
+	case '\n':
+		yyt2 = YYCURSOR;
+		goto yy341;
+	case '\r':
+		yyt2 = YYCURSOR;
+		goto yy342;
+	default:	goto yy344;
+	}
+yy341:
+	++YYCURSOR;
+	p1 = yyt1;
+	p2 = yyt2;
+#line 161 "cmdparser.re"
+	{ CMD_STRING(HASH) }
+#line 2443 "cmdparser.c"
+yy342:
+	yych = *++YYCURSOR;
+	switch (yych) {
+	case '\n':	goto yy341;
+	default:	goto yy18;
+	}
+yy324:
+	yych = *++YYCURSOR;
+	switch (yych) {
+	case '\t':
+	case ' ':	goto yy347;
+	default:	goto yy18;
+	}
+yy347:
+	yych = *++YYCURSOR;
+	switch (yych) {
+	case 0x00:
+	case '\n':
+	case '\r':	goto yy18;
+	case '\t':
+	case ' ':	goto yy347;
+	default:
+		yyt1 = YYCURSOR;
+		goto yy348;
+	}
+yy348:
+	yych = *++YYCURSOR;
+	switch (yych) {
+	case 0x00:
+	case '\n':
+		yyt2 = YYCURSOR;
+		goto yy345;
+	case '\r':
+		yyt2 = YYCURSOR;
+		goto yy346;
+	default:	goto yy348;
+	}
+yy345:
+	++YYCURSOR;
+	p1 = yyt1;
+	p2 = yyt2;
+#line 162 "cmdparser.re"
+	{ CMD_STRING(XCRC) }
+#line 2487 "cmdparser.c"
+yy346:
+	yych = *++YYCURSOR;
+	switch (yych) {
+	case '\n':	goto yy345;
+	default:	goto yy18;
+	}
+yy327:
+	yych = *++YYCURSOR;
+	switch (yych) {
+	case '\t':
+	case ' ':	goto yy351;
+	default:	goto yy18;
+	}
+yy351:
+	yych = *++YYCURSOR;
+	switch (yych) {
+	case 0x00:
+	case '\n':
+	case '\r':	goto yy18;
+	case '\t':
+	case ' ':	goto yy351;
+	default:
+		yyt1 = YYCURSOR;
+		goto yy352;
+	}
+yy352:
+	yych = *++YYCURSOR;
+	switch (yych) {
+	case 0x00:
+	case '\n':
+		yyt2 = YYCURSOR;
+		goto yy349;
+	case '\r':
+		yyt2 = YYCURSOR;
+		goto yy350;
+	default:	goto yy352;
+	}
+yy349:
+	++YYCURSOR;
+	p1 = yyt1;
+	p2 = yyt2;
+#line 163 "cmdparser.re"
+	{ CMD_STRING(XMD5) }
+#line 2531 "cmdparser.c"
+yy350:
+	yych = *++YYCURSOR;
+	switch (yych) {
+	case '\n':	goto yy349;
+	default:	goto yy18;
+	}
+yy331:
+	yych = *++YYCURSOR;
+	switch (yych) {
+	case '\t':
+	case ' ':	goto yy355;
+	default:	goto yy18;
+	}
+yy355:
+	yych = *++YYCURSOR;
+	switch (yych) {
+	case 0x00:
+	case '\n':
+	case '\r':	goto yy18;
+	case '\t':
+	case ' ':	goto yy355;
+	default:
+		yyt1 = YYCURSOR;
+		goto yy356;
+	}
+yy356:
+	yych = *++YYCURSOR;
+	switch (yych) {
+	case 0x00:
+	case '\n':
+		yyt2 = YYCURSOR;
+		goto yy353;
+	case '\r':
+		yyt2 = YYCURSOR;
+		goto yy354;
+	default:	goto yy356;
+	}
+yy353:
+	++YYCURSOR;
+	p1 = yyt1;
+	p2 = yyt2;
+#line 164 "cmdparser.re"
+	{ CMD_STRING(XSHA1) }
+#line 2575 "cmdparser.c"
+yy354:
+	yych = *++YYCURSOR;
+	switch (yych) {
+	case '\n':	goto yy353;
+	default:	goto yy18;
+	}
+yy334:
+	yych = *++YYCURSOR;
+	switch (yych) {
+	case '\t':
+	case ' ':	goto yy359;
+	default:	goto yy18;
+	}
+yy359:
+	yych = *++YYCURSOR;
+	switch (yych) {
+	case 0x00:
+	case '\n':
+	case '\r':	goto yy18;
+	case '\t':
+	case ' ':	goto yy359;
+	default:
+		yyt1 = YYCURSOR;
+		goto yy360;
+	}
+yy360:
+	yych = *++YYCURSOR;
+	switch (yych) {
+	case 0x00:
+	case '\n':
+		yyt2 = YYCURSOR;
+		goto yy357;
+	case '\r':
+		yyt2 = YYCURSOR;
+		goto yy358;
+	default:	goto yy360;
+	}
+yy357:
+	++YYCURSOR;
+	p1 = yyt1;
+	p2 = yyt2;
+#line 165 "cmdparser.re"
+	{ CMD_STRING(XSHA256) }
+#line 2619 "cmdparser.c"
+yy358:
+	yych = *++YYCURSOR;
+	switch (yych) {
+	case '\n':	goto yy357;
+	default:	goto yy18;
+	}
 }
-#line 152 "cmdparser.re"
+#line 166 "cmdparser.re"
 
 done:
 	return cmd;
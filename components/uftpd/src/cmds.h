@@ -40,6 +40,13 @@ enum FtpKeyword {
 	STAT,            // [<SP> <pathname>] <CRLF>
 	HELP,            // [<SP> <string>] <CRLF>
 	NOOP,            // <CRLF>
+	FEAT,            // <CRLF> see https://tools.ietf.org/html/rfc2389
+	OPTS,            // <SP> <command-name> [<SP> <command-options>] <CRLF>
+	HASH,            // <SP> <pathname> <CRLF> see draft-bryan-ftp-hash
+	XCRC,            // <SP> <pathname> <CRLF>
+	XMD5,            // <SP> <pathname> <CRLF>
+	XSHA1,           // <SP> <pathname> <CRLF>
+	XSHA256,         // <SP> <pathname> <CRLF>
 	NUM_FTPKEYWORDS, // is set to number of commands
 };
 
@@ -0,0 +1,168 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "contentcache.h"
+
+#ifdef ESP_PLATFORM
+#include "esp_heap_caps.h"
+#include "sdkconfig.h"
+#endif
+
+TAILQ_HEAD(ContentList, ContentEntry);
+
+// Most recently used first
+static struct ContentList content_lru = TAILQ_HEAD_INITIALIZER(content_lru);
+static ContentCacheStats content_stats;
+static size_t content_max_file_size;
+
+// Path hashes of recent misses
+static uint32_t content_seen[CONTENT_CACHE_SEEN];
+static int content_seen_next = 0;
+
+// FNV-1a, never 0
+static uint32_t path_hash(const char *path) {
+	uint32_t hash = 2166136261u;
+	while (*path) {
+		hash = (hash ^ (uint8_t)*path++) * 16777619u;
+	}
+	return hash != 0 ? hash : 1;
+}
+
+static void *content_alloc(size_t size) {
+#if defined(ESP_PLATFORM) && CONFIG_SPIRAM_SUPPORT
+	return heap_caps_malloc(size > 0 ? size : 1, MALLOC_CAP_SPIRAM);
+#else
+	return malloc(size > 0 ? size : 1);
+#endif
+}
+
+static void content_unref(ContentEntry *entry) {
+	if (--entry->refs == 0) {
+		free((void *)entry->data);
+		free(entry->path);
+		free(entry);
+	}
+}
+
+// Take an entry out of the cache, transfers still sending it keep it alive
+static void content_remove(ContentEntry *entry) {
+	TAILQ_REMOVE(&content_lru, entry, lru);
+	content_stats.entries--;
+	content_stats.bytes -= entry->size;
+	content_unref(entry);
+}
+
+// Evict the least recently used files until size more bytes fit into the budget
+static void content_make_room(size_t size) {
+	while (content_stats.bytes + size > content_stats.budget && !TAILQ_EMPTY(&content_lru)) {
+		content_remove(TAILQ_LAST(&content_lru, ContentList));
+		content_stats.evictions++;
+	}
+}
+
+void content_cache_configure(size_t budget, size_t max_file_size) {
+	content_stats.budget = budget;
+	content_max_file_size = max_file_size;
+	content_make_room(0);
+}
+
+static ContentEntry *content_find(const char *path, uint32_t hash) {
+	ContentEntry *entry;
+	TAILQ_FOREACH(entry, &content_lru, lru) {
+		if (entry->path_hash == hash && strcmp(entry->path, path) == 0) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+// Whether the file missed recently already, remembers it otherwise
+static bool content_seen_before(uint32_t hash) {
+	for (int i = 0; i < CONTENT_CACHE_SEEN; i++) {
+		if (content_seen[i] == hash) {
+			content_seen[i] = 0;
+			return true;
+		}
+	}
+	content_seen[content_seen_next] = hash;
+	content_seen_next = (content_seen_next + 1) % CONTENT_CACHE_SEEN;
+	return false;
+}
+
+// Read the whole file at path into a new entry
+static ContentEntry *content_load(const char *path, uint32_t hash) {
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		return NULL;
+	}
+	struct stat st;
+	if (fstat(fileno(f), &st) == -1 || !S_ISREG(st.st_mode) ||
+	    (size_t)st.st_size > content_max_file_size || (size_t)st.st_size > content_stats.budget) {
+		fclose(f);
+		return NULL;
+	}
+
+	const size_t size = st.st_size;
+	content_make_room(size);
+	ContentEntry *entry = calloc(1, sizeof(ContentEntry));
+	char *data = content_alloc(size);
+	char *path_copy = strdup(path);
+	if (entry == NULL || data == NULL || path_copy == NULL || fread(data, 1, size, f) != size) {
+		fclose(f);
+		free(entry);
+		free(data);
+		free(path_copy);
+		return NULL;
+	}
+	fclose(f);
+
+	entry->data = data;
+	entry->size = size;
+	entry->path = path_copy;
+	entry->path_hash = hash;
+	entry->refs = 1;
+	TAILQ_INSERT_HEAD(&content_lru, entry, lru);
+	content_stats.entries++;
+	content_stats.bytes += size;
+	content_stats.loads++;
+	return entry;
+}
+
+ContentEntry *content_cache_get(const char *path) {
+	if (content_stats.budget == 0) {
+		return NULL;
+	}
+	const uint32_t hash = path_hash(path);
+	ContentEntry *entry = content_find(path, hash);
+	if (entry != NULL) {
+		content_stats.hits++;
+		TAILQ_REMOVE(&content_lru, entry, lru);
+		TAILQ_INSERT_HEAD(&content_lru, entry, lru);
+	} else {
+		content_stats.misses++;
+		if (!content_seen_before(hash) || (entry = content_load(path, hash)) == NULL) {
+			return NULL;
+		}
+	}
+	entry->refs++;
+	return entry;
+}
+
+void content_cache_release(ContentEntry *entry) { content_unref(entry); }
+
+void content_cache_invalidate(const char *path) {
+	ContentEntry *entry = content_find(path, path_hash(path));
+	if (entry != NULL) {
+		content_remove(entry);
+	}
+}
+
+void content_cache_clear(void) {
+	while (!TAILQ_EMPTY(&content_lru)) {
+		content_remove(TAILQ_FIRST(&content_lru));
+	}
+}
+
+void content_cache_stats(ContentCacheStats *stats) { *stats = content_stats; }
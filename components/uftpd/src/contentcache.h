@@ -0,0 +1,56 @@
+#ifndef CONTENTCACHE_H
+#define CONTENTCACHE_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "queue.h"
+
+// Cache of the whole content of small files that are retrieved repeatedly.
+//
+// Cached files are sent straight from memory without touching the card.
+// The content lives in PSRAM on the ESP32. Entries are keyed by the resolved
+// path and evicted least recently used first once the byte budget is exceeded.
+// A file is only loaded on its second miss within the last CONTENT_CACHE_SEEN
+// misses, so walking through many files once doesn't flush the hot ones.
+#define CONTENT_CACHE_SEEN 64
+
+typedef struct ContentEntry {
+	const char *data;
+	size_t size;
+
+	// Internal
+	char *path;
+	uint32_t path_hash;
+	int refs; // Transfers sending it, plus one while it is cached
+	TAILQ_ENTRY(ContentEntry) lru;
+} ContentEntry;
+
+typedef struct ContentCacheStats {
+	uint32_t hits;
+	uint32_t misses;
+	uint32_t loads;     // Files read into the cache
+	uint32_t evictions; // Files dropped to stay within the budget
+	size_t entries;
+	size_t bytes;  // Content held by cached files
+	size_t budget; // 0 if the cache is disabled
+} ContentCacheStats;
+
+// Hold up to budget bytes of files up to max_file_size bytes each, 0 disables the cache.
+// Cached files exceeding a new budget are dropped.
+void content_cache_configure(size_t budget, size_t max_file_size);
+
+// Get the content of the file at path from the cache, loading it if it is hot.
+// Returns NULL if it is not cached, otherwise release the entry once done with it.
+ContentEntry *content_cache_get(const char *path);
+void content_cache_release(ContentEntry *entry);
+
+// Forget the file at path, transfers sending it keep the content until they release it
+void content_cache_invalidate(const char *path);
+
+// Forget all files
+void content_cache_clear(void);
+
+void content_cache_stats(ContentCacheStats *stats);
+
+#endif /* end of include guard */
@@ -0,0 +1,516 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "digest.h"
+
+#ifdef ESP_PLATFORM
+#include "rom/crc.h"
+#endif
+
+const char *digest_names[] = {
+    "CRC32",
+    "MD5",
+    "SHA-1",
+    "SHA-256",
+};
+
+const size_t digest_sizes[] = {
+    4,
+    16,
+    20,
+    32,
+};
+
+enum DigestAlgo digest_algo_from_name(const char *name) {
+	for (int algo = 0; algo < NUM_DIGESTS; algo++) {
+		if (strcasecmp(name, digest_names[algo]) == 0) {
+			return algo;
+		}
+	}
+	return NUM_DIGESTS;
+}
+
+void digest_hex(char *out, const uint8_t *digest, size_t len, bool upper) {
+	const char *digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+	for (size_t i = 0; i < len; i++) {
+		*out++ = digits[digest[i] >> 4];
+		*out++ = digits[digest[i] & 0xf];
+	}
+	*out = '\0';
+}
+
+static void put_be32(uint8_t *out, uint32_t x) {
+	out[0] = x >> 24;
+	out[1] = x >> 16;
+	out[2] = x >> 8;
+	out[3] = x;
+}
+
+#ifdef ESP_PLATFORM
+
+void digest_init(DigestCtx *ctx, enum DigestAlgo algo) {
+	ctx->algo = algo;
+	switch (algo) {
+	case DigestCRC32:
+		ctx->u.crc = 0;
+		break;
+	case DigestMD5:
+		mbedtls_md5_init(&ctx->u.md5);
+		mbedtls_md5_starts_ret(&ctx->u.md5);
+		break;
+	case DigestSHA1:
+		mbedtls_sha1_init(&ctx->u.sha1);
+		mbedtls_sha1_starts_ret(&ctx->u.sha1);
+		break;
+	default:
+		mbedtls_sha256_init(&ctx->u.sha256);
+		mbedtls_sha256_starts_ret(&ctx->u.sha256, 0);
+		break;
+	}
+}
+
+void digest_update(DigestCtx *ctx, const void *data, size_t len) {
+	switch (ctx->algo) {
+	case DigestCRC32:
+		// The ROM function inverts before and after, so it can be chained
+		ctx->u.crc = crc32_le(ctx->u.crc, data, len);
+		break;
+	case DigestMD5:
+		mbedtls_md5_update_ret(&ctx->u.md5, data, len);
+		break;
+	case DigestSHA1:
+		mbedtls_sha1_update_ret(&ctx->u.sha1, data, len);
+		break;
+	default:
+		mbedtls_sha256_update_ret(&ctx->u.sha256, data, len);
+		break;
+	}
+}
+
+size_t digest_final(DigestCtx *ctx, uint8_t *out) {
+	switch (ctx->algo) {
+	case DigestCRC32:
+		put_be32(out, ctx->u.crc);
+		break;
+	case DigestMD5:
+		mbedtls_md5_finish_ret(&ctx->u.md5, out);
+		break;
+	case DigestSHA1:
+		mbedtls_sha1_finish_ret(&ctx->u.sha1, out);
+		break;
+	default:
+		mbedtls_sha256_finish_ret(&ctx->u.sha256, out);
+		break;
+	}
+	return digest_sizes[ctx->algo];
+}
+
+// Contexts using the SHA accelerator hold it until they are freed
+void digest_free(DigestCtx *ctx) {
+	switch (ctx->algo) {
+	case DigestCRC32:
+		break;
+	case DigestMD5:
+		mbedtls_md5_free(&ctx->u.md5);
+		break;
+	case DigestSHA1:
+		mbedtls_sha1_free(&ctx->u.sha1);
+		break;
+	default:
+		mbedtls_sha256_free(&ctx->u.sha256);
+		break;
+	}
+}
+
+#else
+
+// ============================================================================
+// CRC32 (IEEE 802.3), slicing by 8 bytes per step
+// ============================================================================
+static uint32_t crc_table[8][256];
+static bool crc_table_initialized = false;
+
+static void crc_table_init(void) {
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t crc = i;
+		for (int bit = 0; bit < 8; bit++) {
+			crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+		}
+		crc_table[0][i] = crc;
+	}
+	for (uint32_t i = 0; i < 256; i++) {
+		for (int slice = 1; slice < 8; slice++) {
+			const uint32_t prev = crc_table[slice - 1][i];
+			crc_table[slice][i] = (prev >> 8) ^ crc_table[0][prev & 0xff];
+		}
+	}
+	crc_table_initialized = true;
+}
+
+static uint32_t crc32_update(uint32_t crc, const uint8_t *p, size_t len) {
+	crc = ~crc;
+	while (len >= 8) {
+		const uint32_t lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24);
+		const uint32_t hi = p[4] | p[5] << 8 | p[6] << 16 | (uint32_t)p[7] << 24;
+		crc = crc_table[7][lo & 0xff] ^ crc_table[6][(lo >> 8) & 0xff] ^
+		      crc_table[5][(lo >> 16) & 0xff] ^ crc_table[4][lo >> 24] ^
+		      crc_table[3][hi & 0xff] ^ crc_table[2][(hi >> 8) & 0xff] ^
+		      crc_table[1][(hi >> 16) & 0xff] ^ crc_table[0][hi >> 24];
+		p += 8;
+		len -= 8;
+	}
+	while (len--) {
+		crc = (crc >> 8) ^ crc_table[0][(crc ^ *p++) & 0xff];
+	}
+	return ~crc;
+}
+
+// ============================================================================
+// MD5 (RFC 1321), SHA-1 and SHA-256 (FIPS 180-4)
+// ============================================================================
+#define ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static uint32_t get_be32(const uint8_t *p) {
+	return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static uint32_t get_le32(const uint8_t *p) {
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void md5_block(uint32_t *state, const uint8_t *block) {
+	static const uint32_t k[64] = {
+	    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613,
+	    0xfd469501, 0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193,
+	    0xa679438e, 0x49b40821, 0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d,
+	    0x02441453, 0xd8a1e681, 0xe7d3fbc8, 0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
+	    0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a, 0xfffa3942, 0x8771f681, 0x6d9d6122,
+	    0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70, 0x289b7ec6, 0xeaa127fa,
+	    0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665, 0xf4292244,
+	    0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+	    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb,
+	    0xeb86d391,
+	};
+	static const uint8_t r[64] = {
+	    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 5, 9,  14, 20, 5, 9,
+	    14, 20, 5, 9,  14, 20, 5, 9,  14, 20, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+	    4, 11, 16, 23, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21,
+	};
+	uint32_t w[16];
+	for (int i = 0; i < 16; i++) {
+		w[i] = get_le32(block + 4 * i);
+	}
+
+	uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+	for (int i = 0; i < 64; i++) {
+		uint32_t f;
+		int g;
+		if (i < 16) {
+			f = d ^ (b & (c ^ d));
+			g = i;
+		} else if (i < 32) {
+			f = c ^ (d & (b ^ c));
+			g = (5 * i + 1) & 15;
+		} else if (i < 48) {
+			f = b ^ c ^ d;
+			g = (3 * i + 5) & 15;
+		} else {
+			f = c ^ (b | ~d);
+			g = (7 * i) & 15;
+		}
+		const uint32_t tmp = d;
+		d = c;
+		c = b;
+		b = b + ROL(a + f + k[i] + w[g], r[i]);
+		a = tmp;
+	}
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+}
+
+static void sha1_block(uint32_t *state, const uint8_t *block) {
+	uint32_t w[80];
+	for (int i = 0; i < 16; i++) {
+		w[i] = get_be32(block + 4 * i);
+	}
+	for (int i = 16; i < 80; i++) {
+		w[i] = ROL(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+	}
+
+	uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+	for (int i = 0; i < 80; i++) {
+		uint32_t f, k;
+		if (i < 20) {
+			f = d ^ (b & (c ^ d));
+			k = 0x5a827999;
+		} else if (i < 40) {
+			f = b ^ c ^ d;
+			k = 0x6ed9eba1;
+		} else if (i < 60) {
+			f = (b & c) | (d & (b | c));
+			k = 0x8f1bbcdc;
+		} else {
+			f = b ^ c ^ d;
+			k = 0xca62c1d6;
+		}
+		const uint32_t tmp = ROL(a, 5) + f + e + k + w[i];
+		e = d;
+		d = c;
+		c = ROL(b, 30);
+		b = a;
+		a = tmp;
+	}
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+}
+
+static void sha256_block(uint32_t *state, const uint8_t *block) {
+	static const uint32_t k[64] = {
+	    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4,
+	    0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe,
+	    0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f,
+	    0x4a7484aa, 0x5cb0a9dc, 0x76f988da, 0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc,
+	    0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+	    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070, 0x19a4c116,
+	    0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7,
+	    0xc67178f2,
+	};
+	uint32_t w[64];
+	for (int i = 0; i < 16; i++) {
+		w[i] = get_be32(block + 4 * i);
+	}
+	for (int i = 16; i < 64; i++) {
+		const uint32_t s0 = ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+		const uint32_t s1 = ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+
+	uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+	uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+	for (int i = 0; i < 64; i++) {
+		const uint32_t s1 = ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25);
+		const uint32_t t1 = h + s1 + (g ^ (e & (f ^ g))) + k[i] + w[i];
+		const uint32_t s0 = ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22);
+		const uint32_t t2 = s0 + ((a & b) | (c & (a | b)));
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+	state[5] += f;
+	state[6] += g;
+	state[7] += h;
+}
+
+typedef void (*block_func)(uint32_t *state, const uint8_t *block);
+
+static block_func block_funcs[] = {
+    NULL,
+    md5_block,
+    sha1_block,
+    sha256_block,
+};
+
+void digest_init(DigestCtx *ctx, enum DigestAlgo algo) {
+	static const uint32_t md5_iv[] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+	static const uint32_t sha1_iv[] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476,
+	                                   0xc3d2e1f0};
+	static const uint32_t sha256_iv[] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	                                     0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+	ctx->algo = algo;
+	switch (algo) {
+	case DigestCRC32:
+		if (!crc_table_initialized) {
+			crc_table_init();
+		}
+		ctx->u.crc = 0;
+		return;
+	case DigestMD5:
+		memcpy(ctx->u.md.state, md5_iv, sizeof(md5_iv));
+		break;
+	case DigestSHA1:
+		memcpy(ctx->u.md.state, sha1_iv, sizeof(sha1_iv));
+		break;
+	default:
+		memcpy(ctx->u.md.state, sha256_iv, sizeof(sha256_iv));
+		break;
+	}
+	ctx->u.md.length = 0;
+}
+
+void digest_update(DigestCtx *ctx, const void *data, size_t len) {
+	const uint8_t *p = data;
+	if (ctx->algo == DigestCRC32) {
+		ctx->u.crc = crc32_update(ctx->u.crc, p, len);
+		return;
+	}
+
+	const block_func block = block_funcs[ctx->algo];
+	size_t used = ctx->u.md.length % 64;
+	ctx->u.md.length += len;
+
+	// Complete a partially filled block first
+	if (used > 0) {
+		const size_t n = len < 64 - used ? len : 64 - used;
+		memcpy(ctx->u.md.block + used, p, n);
+		p += n;
+		len -= n;
+		if (used + n < 64) {
+			return;
+		}
+		block(ctx->u.md.state, ctx->u.md.block);
+	}
+	// Hash full blocks directly from the input
+	while (len >= 64) {
+		block(ctx->u.md.state, p);
+		p += 64;
+		len -= 64;
+	}
+	memcpy(ctx->u.md.block, p, len);
+}
+
+size_t digest_final(DigestCtx *ctx, uint8_t *out) {
+	if (ctx->algo == DigestCRC32) {
+		put_be32(out, ctx->u.crc);
+		return digest_sizes[DigestCRC32];
+	}
+
+	// Pad with a one bit, zeros and the message length in bits
+	const uint64_t bits = ctx->u.md.length * 8;
+	const size_t used = ctx->u.md.length % 64;
+	static const uint8_t padding[64] = {0x80};
+	digest_update(ctx, padding, used < 56 ? 56 - used : 120 - used);
+	uint8_t length[8];
+	for (int i = 0; i < 8; i++) {
+		// MD5 stores the length little endian, the SHA digests big endian
+		length[ctx->algo == DigestMD5 ? i : 7 - i] = bits >> (8 * i);
+	}
+	digest_update(ctx, length, sizeof(length));
+
+	const size_t size = digest_sizes[ctx->algo];
+	for (size_t i = 0; i < size / 4; i++) {
+		if (ctx->algo == DigestMD5) {
+			const uint32_t x = ctx->u.md.state[i];
+			out[4 * i] = x;
+			out[4 * i + 1] = x >> 8;
+			out[4 * i + 2] = x >> 16;
+			out[4 * i + 3] = x >> 24;
+		} else {
+			put_be32(out + 4 * i, ctx->u.md.state[i]);
+		}
+	}
+	return size;
+}
+
+void digest_free(DigestCtx *ctx) { (void)ctx; }
+
+#endif
+
+// ============================================================================
+// Digest cache
+// ============================================================================
+typedef struct DigestCacheEntry {
+	char *path; // NULL marks an unused entry
+	uint32_t path_hash;
+	off_t size;
+	time_t mtime;
+	uint32_t last_used;
+	uint8_t valid; // Bit mask of the algorithms in digests
+	uint8_t digests[NUM_DIGESTS][DIGEST_MAX_SIZE];
+} DigestCacheEntry;
+
+static DigestCacheEntry digest_cache[DIGEST_CACHE_SIZE];
+static uint32_t digest_cache_clock = 0;
+
+// FNV-1a
+static uint32_t path_hash(const char *path) {
+	uint32_t hash = 2166136261u;
+	while (*path) {
+		hash = (hash ^ (uint8_t)*path++) * 16777619u;
+	}
+	return hash;
+}
+
+static void digest_cache_remove(DigestCacheEntry *entry) {
+	free(entry->path);
+	entry->path = NULL;
+	entry->valid = 0;
+}
+
+static DigestCacheEntry *digest_cache_find(const char *path, uint32_t hash, const struct stat *st) {
+	for (int i = 0; i < DIGEST_CACHE_SIZE; i++) {
+		DigestCacheEntry *entry = &digest_cache[i];
+		if (entry->path != NULL && entry->path_hash == hash && strcmp(entry->path, path) == 0 &&
+		    entry->size == st->st_size && entry->mtime == st->st_mtime) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+bool digest_cache_get(const char *path, const struct stat *st, enum DigestAlgo algo, uint8_t *out) {
+	DigestCacheEntry *entry = digest_cache_find(path, path_hash(path), st);
+	if (entry == NULL || !(entry->valid & (1 << algo))) {
+		return false;
+	}
+	entry->last_used = ++digest_cache_clock;
+	memcpy(out, entry->digests[algo], digest_sizes[algo]);
+	return true;
+}
+
+void digest_cache_put(const char *path, const struct stat *st, enum DigestAlgo algo,
+                      const uint8_t *digest) {
+	const uint32_t hash = path_hash(path);
+	DigestCacheEntry *entry = digest_cache_find(path, hash, st);
+	if (entry == NULL) {
+		char *path_copy = strdup(path);
+		if (path_copy == NULL) {
+			return;
+		}
+		// Drop older digests of the file, then replace the least recently used entry
+		digest_cache_invalidate(path);
+		entry = &digest_cache[0];
+		for (int i = 1; i < DIGEST_CACHE_SIZE && entry->path != NULL; i++) {
+			if (digest_cache[i].path == NULL || digest_cache[i].last_used < entry->last_used) {
+				entry = &digest_cache[i];
+			}
+		}
+		digest_cache_remove(entry);
+		entry->path = path_copy;
+		entry->path_hash = hash;
+		entry->size = st->st_size;
+		entry->mtime = st->st_mtime;
+	}
+	entry->last_used = ++digest_cache_clock;
+	entry->valid |= 1 << algo;
+	memcpy(entry->digests[algo], digest, digest_sizes[algo]);
+}
+
+void digest_cache_invalidate(const char *path) {
+	const uint32_t hash = path_hash(path);
+	for (int i = 0; i < DIGEST_CACHE_SIZE; i++) {
+		DigestCacheEntry *entry = &digest_cache[i];
+		if (entry->path != NULL && entry->path_hash == hash && strcmp(entry->path, path) == 0) {
+			digest_cache_remove(entry);
+		}
+	}
+}
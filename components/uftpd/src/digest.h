@@ -0,0 +1,81 @@
+#ifndef DIGEST_H
+#define DIGEST_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#ifdef ESP_PLATFORM
+#include "mbedtls/md5.h"
+#include "mbedtls/sha1.h"
+#include "mbedtls/sha256.h"
+#endif
+
+// Message digests used to verify transfers (HASH, XCRC, XMD5, XSHA1, XSHA256).
+//
+// On the ESP32 the SHA digests go through mbedtls, which uses the hardware
+// accelerator if CONFIG_MBEDTLS_HARDWARE_SHA is set, and CRC32 uses the ROM
+// implementation. Elsewhere portable software implementations are used.
+
+enum DigestAlgo {
+	DigestCRC32,
+	DigestMD5,
+	DigestSHA1,
+	DigestSHA256,
+	NUM_DIGESTS,
+};
+
+// Size of the largest digest in bytes
+#define DIGEST_MAX_SIZE 32
+
+// Names as used by HASH and FEAT, e.g. "SHA-256"
+extern const char *digest_names[];
+
+// Size of the digest of algo in bytes
+extern const size_t digest_sizes[];
+
+typedef struct DigestCtx {
+	enum DigestAlgo algo;
+	union {
+		uint32_t crc;
+#ifdef ESP_PLATFORM
+		mbedtls_md5_context md5;
+		mbedtls_sha1_context sha1;
+		mbedtls_sha256_context sha256;
+#else
+		struct {
+			uint32_t state[8];
+			uint64_t length; // Number of bytes hashed so far
+			uint8_t block[64];
+		} md;
+#endif
+	} u;
+} DigestCtx;
+
+// Look up an algorithm by its name, case insensitive. Returns NUM_DIGESTS if unknown.
+enum DigestAlgo digest_algo_from_name(const char *name);
+
+void digest_init(DigestCtx *ctx, enum DigestAlgo algo);
+void digest_update(DigestCtx *ctx, const void *data, size_t len);
+// Write the digest to out and return its size in bytes
+size_t digest_final(DigestCtx *ctx, uint8_t *out);
+// Release the resources of an initialized context, whether it was finalized or not
+void digest_free(DigestCtx *ctx);
+
+// Format a digest as hexadecimal string, out needs room for 2 * len + 1 characters
+void digest_hex(char *out, const uint8_t *digest, size_t len, bool upper);
+
+// Cache of digests of recently hashed files.
+//
+// Entries are keyed by path, size and modification time of the file,
+// so a file that was changed since it was hashed never hits.
+#define DIGEST_CACHE_SIZE 32
+
+// Copy the cached digest of the file at path with stat st to out, returns false on a miss
+bool digest_cache_get(const char *path, const struct stat *st, enum DigestAlgo algo, uint8_t *out);
+void digest_cache_put(const char *path, const struct stat *st, enum DigestAlgo algo,
+                      const uint8_t *digest);
+// Forget all digests of the file at path
+void digest_cache_invalidate(const char *path);
+
+#endif /* end of include guard */
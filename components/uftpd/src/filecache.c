@@ -0,0 +1,131 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "filecache.h"
+
+typedef struct FileCacheEntry {
+	char *path; // NULL if unused
+	uint32_t path_hash;
+	FILE *file;
+	bool lent; // The handle is used by a transfer
+	char *head;
+	size_t head_len;
+	uint32_t last_used;
+} FileCacheEntry;
+
+static FileCacheEntry file_cache[FILE_CACHE_SIZE];
+static uint32_t file_cache_clock = 0;
+
+// FNV-1a
+static uint32_t path_hash(const char *path) {
+	uint32_t hash = 2166136261u;
+	while (*path) {
+		hash = (hash ^ (uint8_t)*path++) * 16777619u;
+	}
+	return hash;
+}
+
+static FileCacheEntry *file_cache_find(const char *path) {
+	const uint32_t hash = path_hash(path);
+	for (int i = 0; i < FILE_CACHE_SIZE; i++) {
+		FileCacheEntry *entry = &file_cache[i];
+		if (entry->path != NULL && entry->path_hash == hash && strcmp(entry->path, path) == 0) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+// Drop an entry, the transfer a handle is lent to closes it when returning it
+static void file_cache_drop(FileCacheEntry *entry) {
+	if (!entry->lent) {
+		fclose(entry->file);
+	}
+	entry->file = NULL;
+	free(entry->path);
+	entry->path = NULL;
+	entry->lent = false;
+}
+
+FILE *file_cache_take(const char *path, void *head, size_t *head_len) {
+	FileCacheEntry *entry = file_cache_find(path);
+	if (entry == NULL || entry->lent) {
+		return NULL;
+	}
+	if (fseek(entry->file, entry->head_len, SEEK_SET) == -1) {
+		file_cache_drop(entry);
+		return NULL;
+	}
+	entry->lent = true;
+	entry->last_used = ++file_cache_clock;
+	memcpy(head, entry->head, entry->head_len);
+	*head_len = entry->head_len;
+	return entry->file;
+}
+
+bool file_cache_add(const char *path, FILE *f, const void *head, size_t len) {
+	if (len > FILE_CACHE_HEAD_SIZE) {
+		len = FILE_CACHE_HEAD_SIZE;
+	}
+	if (file_cache_find(path) != NULL) {
+		return false;
+	}
+
+	// Replace an unused or the least recently used entry not lent to a transfer
+	FileCacheEntry *entry = NULL;
+	for (int i = 0; i < FILE_CACHE_SIZE; i++) {
+		FileCacheEntry *e = &file_cache[i];
+		if (e->path == NULL) {
+			entry = e;
+			break;
+		}
+		if (!e->lent && (entry == NULL || e->last_used < entry->last_used)) {
+			entry = e;
+		}
+	}
+	if (entry == NULL) {
+		return false;
+	}
+	if (entry->path != NULL) {
+		file_cache_drop(entry);
+	}
+	if (entry->head == NULL && (entry->head = malloc(FILE_CACHE_HEAD_SIZE)) == NULL) {
+		return false;
+	}
+	if ((entry->path = strdup(path)) == NULL) {
+		return false;
+	}
+	entry->path_hash = path_hash(path);
+	entry->file = f;
+	entry->lent = true;
+	memcpy(entry->head, head, len);
+	entry->head_len = len;
+	entry->last_used = ++file_cache_clock;
+	return true;
+}
+
+void file_cache_give(const char *path, FILE *f) {
+	FileCacheEntry *entry = file_cache_find(path);
+	if (entry == NULL || entry->file != f) {
+		// Invalidated while it was lent
+		fclose(f);
+		return;
+	}
+	entry->lent = false;
+}
+
+void file_cache_invalidate(const char *path) {
+	FileCacheEntry *entry = file_cache_find(path);
+	if (entry != NULL) {
+		file_cache_drop(entry);
+	}
+}
+
+void file_cache_clear(void) {
+	for (int i = 0; i < FILE_CACHE_SIZE; i++) {
+		if (file_cache[i].path != NULL) {
+			file_cache_drop(&file_cache[i]);
+		}
+	}
+}
@@ -0,0 +1,36 @@
+#ifndef FILECACHE_H
+#define FILECACHE_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+// Cache of open read-only handles of recently retrieved files and their first bytes.
+//
+// Opening a file on FAT walks its directory on the card, and so does the first
+// read. Files retrieved again and again skip both. Entries are keyed by the
+// resolved path, so everything that changes or removes a file has to invalidate it.
+// Handles are lent to one transfer at a time and returned once it is done.
+#define FILE_CACHE_SIZE 2
+#define FILE_CACHE_HEAD_SIZE 4096
+
+// Borrow the cached handle of the file at path, positioned after its first
+// *head_len bytes which are copied to head (room for FILE_CACHE_HEAD_SIZE bytes).
+// Returns NULL on a miss or if the handle is lent already.
+FILE *file_cache_take(const char *path, void *head, size_t *head_len);
+
+// Cache the handle f of the file at path with its first len bytes, read by a transfer
+// reading it from the start. Returns false if it can't be cached, the transfer
+// keeps its handle then. Otherwise it is lent to the transfer, return it using file_cache_give.
+bool file_cache_add(const char *path, FILE *f, const void *head, size_t len);
+
+// Return the handle f of path lent by file_cache_take or file_cache_add.
+// It is closed if the file was invalidated in the meantime.
+void file_cache_give(const char *path, FILE *f);
+
+// Forget the file at path, its handle is closed or closed once it is returned
+void file_cache_invalidate(const char *path);
+
+// Forget all files, for example to free file handles
+void file_cache_clear(void);
+
+#endif /* end of include guard */
@@ -0,0 +1,12 @@
+#ifndef PATH_H
+#define PATH_H
+#include <stddef.h>
+
+// Join path to the directory dir and canonicalize the result into out of size n,
+// in a single pass and without allocating: empty and "." segments are dropped
+// and ".." removes the segment before it, but never goes above "/".
+// An absolute path replaces dir. The result starts with '/' and has no trailing '/'
+// unless it is "/" itself. Returns its length or -1 if it doesn't fit into out.
+int path_canonicalize(char *out, size_t n, const char *dir, const char *path);
+
+#endif /* end of include guard */
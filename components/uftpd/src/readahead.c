@@ -0,0 +1,205 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "queue.h"
+#include "readahead.h"
+
+// Reading FAT needs little stack, unlike the default of pthreads on the host
+#define READER_STACK_SIZE 4096
+
+struct ReadAhead {
+	FILE *file;
+	size_t block_size;
+	// Ring of blocks, allocated once the reader first fills them
+	char *blocks[READAHEAD_MAX_BLOCKS];
+	size_t lens[READAHEAD_MAX_BLOCKS];
+	size_t head;   // Next block to copy out
+	size_t filled; // Blocks read but not copied out yet
+	size_t window; // Blocks to keep read ahead
+	int full_reads; // Reads in a row that found the window full
+	bool reading;   // The reader is filling the block after the filled ones
+	bool eof;
+	int error; // errno of a failed read, 0 if none
+	TAILQ_ENTRY(ReadAhead) entries;
+};
+
+// Everything is guarded by lock, but the blocks the reader and event loop are copying
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER; // A stream wants more blocks
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER; // The reader finished a block
+static TAILQ_HEAD(StreamList, ReadAhead) streams = TAILQ_HEAD_INITIALIZER(streams);
+static pthread_t reader;
+static bool reader_running = false;
+static bool reader_quit = false;
+
+// The first stream that has room in its window, streams are served in turn
+static ReadAhead *next_stream(void) {
+	ReadAhead *ra;
+	TAILQ_FOREACH(ra, &streams, entries) {
+		if (!ra->eof && ra->error == 0 && ra->filled < ra->window) {
+			TAILQ_REMOVE(&streams, ra, entries);
+			TAILQ_INSERT_TAIL(&streams, ra, entries);
+			return ra;
+		}
+	}
+	return NULL;
+}
+
+static void *reader_main(void *arg) {
+	(void)arg;
+	pthread_mutex_lock(&lock);
+	while (!reader_quit) {
+		ReadAhead *ra = next_stream();
+		if (ra == NULL) {
+			pthread_cond_wait(&work_cond, &lock);
+			continue;
+		}
+		const size_t slot = (ra->head + ra->filled) % READAHEAD_MAX_BLOCKS;
+		char *data = ra->blocks[slot];
+		ra->reading = true;
+		pthread_mutex_unlock(&lock);
+
+		if (data == NULL) {
+			data = malloc(ra->block_size);
+		}
+		size_t len = 0;
+		int error = 0;
+		if (data == NULL) {
+			error = ENOMEM;
+		} else {
+			len = fread(data, 1, ra->block_size, ra->file);
+			if (ferror(ra->file)) {
+				error = errno != 0 ? errno : EIO;
+			}
+		}
+
+		pthread_mutex_lock(&lock);
+		ra->blocks[slot] = data;
+		ra->reading = false;
+		if (error != 0) {
+			ra->error = error;
+		} else {
+			ra->lens[slot] = len;
+			ra->filled++;
+			ra->eof = len < ra->block_size;
+		}
+		pthread_cond_broadcast(&done_cond);
+	}
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+static bool reader_start(void) {
+	if (reader_running) {
+		return true;
+	}
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+#ifdef ESP_PLATFORM
+	pthread_attr_setstacksize(&attr, READER_STACK_SIZE);
+#endif
+	reader_quit = false;
+	reader_running = pthread_create(&reader, &attr, reader_main, NULL) == 0;
+	pthread_attr_destroy(&attr);
+	if (!reader_running) {
+		perror("pthread_create");
+	}
+	return reader_running;
+}
+
+ReadAhead *readahead_start(FILE *f, size_t block_size) {
+	if (!reader_start()) {
+		return NULL;
+	}
+	ReadAhead *ra = calloc(1, sizeof(ReadAhead));
+	if (ra == NULL) {
+		return NULL;
+	}
+	ra->file = f;
+	ra->block_size = block_size;
+	ra->window = READAHEAD_START_BLOCKS;
+#if defined(POSIX_FADV_SEQUENTIAL) && !defined(ESP_PLATFORM)
+	// Let the kernel read ahead further as well
+	posix_fadvise(fileno(f), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+	pthread_mutex_lock(&lock);
+	TAILQ_INSERT_TAIL(&streams, ra, entries);
+	pthread_cond_signal(&work_cond);
+	pthread_mutex_unlock(&lock);
+	return ra;
+}
+
+ssize_t readahead_read(ReadAhead *ra, char *buf) {
+	pthread_mutex_lock(&lock);
+	if (ra->filled == 0 && !ra->eof && ra->error == 0) {
+		// The card is behind the network, read further ahead
+		if (ra->window < READAHEAD_MAX_BLOCKS) {
+			ra->window++;
+			pthread_cond_signal(&work_cond);
+		}
+		ra->full_reads = 0;
+		while (ra->filled == 0 && !ra->eof && ra->error == 0) {
+			pthread_cond_wait(&done_cond, &lock);
+		}
+	} else if (ra->filled >= ra->window && ++ra->full_reads >= READAHEAD_SHRINK_AFTER) {
+		// The network is behind the card, blocks would just wait for it
+		if (ra->window > READAHEAD_MIN_BLOCKS) {
+			ra->window--;
+		}
+		ra->full_reads = 0;
+	}
+
+	if (ra->filled == 0) {
+		const int error = ra->error;
+		pthread_mutex_unlock(&lock);
+		if (error != 0) {
+			errno = error;
+			return -1;
+		}
+		return 0;
+	}
+	const size_t slot = ra->head;
+	const size_t len = ra->lens[slot];
+	pthread_mutex_unlock(&lock);
+
+	// The reader leaves filled blocks alone
+	memcpy(buf, ra->blocks[slot], len);
+
+	pthread_mutex_lock(&lock);
+	ra->head = (ra->head + 1) % READAHEAD_MAX_BLOCKS;
+	ra->filled--;
+	pthread_cond_signal(&work_cond);
+	pthread_mutex_unlock(&lock);
+	return len;
+}
+
+void readahead_stop(ReadAhead *ra) {
+	pthread_mutex_lock(&lock);
+	while (ra->reading) {
+		pthread_cond_wait(&done_cond, &lock);
+	}
+	TAILQ_REMOVE(&streams, ra, entries);
+	pthread_mutex_unlock(&lock);
+
+	for (int i = 0; i < READAHEAD_MAX_BLOCKS; i++) {
+		free(ra->blocks[i]);
+	}
+	free(ra);
+}
+
+void readahead_shutdown(void) {
+	if (!reader_running) {
+		return;
+	}
+	pthread_mutex_lock(&lock);
+	reader_quit = true;
+	pthread_cond_signal(&work_cond);
+	pthread_mutex_unlock(&lock);
+	pthread_join(reader, NULL);
+	reader_running = false;
+}
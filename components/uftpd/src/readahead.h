@@ -0,0 +1,38 @@
+#ifndef READAHEAD_H
+#define READAHEAD_H
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+// Sequential read-ahead of files being retrieved.
+//
+// A reader thread keeps a window of blocks of every stream read from the card
+// while the event loop is busy sending, so the card and the network work at the
+// same time instead of taking turns. The window grows whenever the event loop has
+// to wait for a block, the card being slower, and shrinks while it stays full,
+// the network being slower. There is a single reader, as reading several files
+// at once only makes the card seek.
+#define READAHEAD_MIN_BLOCKS 1
+#define READAHEAD_MAX_BLOCKS 4
+#define READAHEAD_START_BLOCKS 2
+// Reads finding the window full in a row before it shrinks
+#define READAHEAD_SHRINK_AFTER 8
+
+typedef struct ReadAhead ReadAhead;
+
+// Start reading f ahead from its current position in blocks of block_size bytes.
+// f must not be used otherwise until the stream is stopped.
+// Returns NULL if the reader can't be started, read f directly then.
+ReadAhead *readahead_start(FILE *f, size_t block_size);
+
+// Copy the next block into buf of block_size bytes, waiting for it if it isn't read yet.
+// Returns the number of bytes, 0 at the end or -1 on error with errno set.
+ssize_t readahead_read(ReadAhead *ra, char *buf);
+
+// Stop reading ahead and free the stream, the position of its file is undefined afterwards
+void readahead_stop(ReadAhead *ra);
+
+// Stop the reader thread, once all streams are stopped
+void readahead_shutdown(void);
+
+#endif /* end of include guard */
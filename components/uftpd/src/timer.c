@@ -0,0 +1,111 @@
+#include <stddef.h>
+
+#include "timer.h"
+
+// Slot of level that a timer expiring at tick expires belongs to
+#define SLOT_INDEX(expires, level) (((expires) >> (TIMER_SLOT_BITS * (level))) & TIMER_SLOT_MASK)
+
+void timer_wheel_init(TimerWheel *wheel, uint32_t now) {
+	wheel->now = now;
+	for (int level = 0; level < TIMER_LEVELS; level++) {
+		for (int slot = 0; slot < TIMER_SLOTS; slot++) {
+			LIST_INIT(&wheel->slots[level][slot]);
+		}
+	}
+}
+
+void timer_init(Timer *timer, timer_callback callback, void *arg) {
+	timer->expires = 0;
+	timer->pending = false;
+	timer->callback = callback;
+	timer->arg = arg;
+}
+
+// Put timer into the lowest level whose range reaches its expiry
+static void timer_insert(TimerWheel *wheel, Timer *timer) {
+	uint32_t delta = timer->expires - wheel->now;
+	if ((int32_t)delta < 0) {
+		// Already expired: fire with the next processed tick
+		timer->expires = wheel->now;
+		delta = 0;
+	} else if (delta > TIMER_MAX_TICKS) {
+		timer->expires = wheel->now + TIMER_MAX_TICKS;
+		delta = TIMER_MAX_TICKS;
+	}
+
+	int level = 0;
+	while (level < TIMER_LEVELS - 1 && delta >= (1u << (TIMER_SLOT_BITS * (level + 1)))) {
+		level++;
+	}
+	LIST_INSERT_HEAD(&wheel->slots[level][SLOT_INDEX(timer->expires, level)], timer, entries);
+	timer->pending = true;
+}
+
+void timer_mod(TimerWheel *wheel, Timer *timer, uint32_t expires) {
+	timer_cancel(timer);
+	timer->expires = expires;
+	timer_insert(wheel, timer);
+}
+
+void timer_cancel(Timer *timer) {
+	if (timer->pending) {
+		LIST_REMOVE(timer, entries);
+		timer->pending = false;
+	}
+}
+
+// Move all timers of a slot of a higher level down to where they belong now
+static void timer_cascade(TimerWheel *wheel, int level, int slot) {
+	struct TimerList *list = &wheel->slots[level][slot];
+	while (!LIST_EMPTY(list)) {
+		Timer *timer = LIST_FIRST(list);
+		LIST_REMOVE(timer, entries);
+		timer_insert(wheel, timer);
+	}
+}
+
+void timer_wheel_advance(TimerWheel *wheel, uint32_t now) {
+	while ((int32_t)(now - wheel->now) >= 0) {
+		const uint32_t tick = wheel->now;
+
+		// Whenever a level wrapped around, the next slot of the level above is due
+		for (int level = 1; level < TIMER_LEVELS; level++) {
+			if (SLOT_INDEX(tick, level - 1) != 0) {
+				break;
+			}
+			timer_cascade(wheel, level, SLOT_INDEX(tick, level));
+		}
+
+		// Callbacks may change the list, so always take the first timer
+		struct TimerList *list = &wheel->slots[0][SLOT_INDEX(tick, 0)];
+		while (!LIST_EMPTY(list)) {
+			Timer *timer = LIST_FIRST(list);
+			LIST_REMOVE(timer, entries);
+			timer->pending = false;
+			timer->callback(timer, timer->arg);
+		}
+
+		wheel->now++;
+	}
+}
+
+uint32_t timer_wheel_next(const TimerWheel *wheel) {
+	for (uint32_t delta = 0; delta < TIMER_SLOTS; delta++) {
+		const uint32_t tick = wheel->now + delta;
+		// Higher levels cascade in when the lowest level wraps around, stop there if they hold timers
+		if (SLOT_INDEX(tick, 0) == 0) {
+			for (int level = 1; level < TIMER_LEVELS; level++) {
+				for (int slot = 0; slot < TIMER_SLOTS; slot++) {
+					if (!LIST_EMPTY(&wheel->slots[level][slot])) {
+						return delta;
+					}
+				}
+			}
+		}
+		// Exact expiry of timers in the lowest level
+		if (!LIST_EMPTY(&wheel->slots[0][SLOT_INDEX(tick, 0)])) {
+			return delta;
+		}
+	}
+	return TIMER_MAX_TICKS;
+}
@@ -0,0 +1,63 @@
+#ifndef TIMER_H
+#define TIMER_H
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "queue.h"
+
+// Hierarchical timer wheel used by the event loop for timeouts.
+//
+// Time is measured in ticks. Every level has TIMER_SLOTS slots, a slot of a level
+// covers TIMER_SLOTS times the ticks of a slot of the level below. Timers are
+// kept in the lowest level that can hold them and cascade down as time passes,
+// so adding, modifying and cancelling a timer are O(1).
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+#define TIMER_SLOT_MASK (TIMER_SLOTS - 1)
+#define TIMER_LEVELS 3
+
+// Timers further away than this many ticks fire after this many ticks
+#define TIMER_MAX_TICKS ((1u << (TIMER_SLOT_BITS * TIMER_LEVELS)) - 1)
+
+struct Timer;
+typedef void (*timer_callback)(struct Timer *timer, void *arg);
+
+typedef struct Timer {
+	uint32_t expires; // Tick at which the timer fires
+	bool pending;     // Whether the timer is in the wheel
+	timer_callback callback;
+	void *arg;
+
+	// For linked list
+	LIST_ENTRY(Timer) entries;
+} Timer;
+
+LIST_HEAD(TimerList, Timer);
+
+typedef struct TimerWheel {
+	uint32_t now; // Next tick that is going to be processed
+	struct TimerList slots[TIMER_LEVELS][TIMER_SLOTS];
+} TimerWheel;
+
+// Initialize the wheel so that now is the next tick to be processed
+void timer_wheel_init(TimerWheel *wheel, uint32_t now);
+
+// Process all ticks up to and including now and run the callbacks of expired timers.
+// Callbacks may add, modify and cancel any timer.
+void timer_wheel_advance(TimerWheel *wheel, uint32_t now);
+
+// Number of ticks until the next timer might fire, TIMER_MAX_TICKS if there is none.
+// Timers in higher levels are only known to the tick they cascade at,
+// so the result may be earlier than the actual expiry, but never later.
+uint32_t timer_wheel_next(const TimerWheel *wheel);
+
+// Initialize a timer that is not pending
+void timer_init(Timer *timer, timer_callback callback, void *arg);
+
+// (Re)schedule the timer to fire at tick expires
+void timer_mod(TimerWheel *wheel, Timer *timer, uint32_t expires);
+
+// Remove the timer from the wheel if it is pending
+void timer_cancel(Timer *timer);
+
+#endif /* end of include guard */
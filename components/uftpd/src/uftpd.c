@@ -2,13 +2,16 @@
 #include <assert.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <netdb.h>
+#include <netinet/in.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -16,8 +19,20 @@
 #include <unistd.h>
 
 #include "cmds.h"
+#include "contentcache.h"
+#include "digest.h"
+#include "filecache.h"
+#include "path.h"
 #include "queue.h"
+#include "readahead.h"
+#include "timer.h"
 #include "uftpd.h"
+#include "zstream.h"
+
+// lwIP defines TCP_NODELAY in its socket header already
+#ifndef TCP_NODELAY
+#include <netinet/tcp.h>
+#endif
 
 // Set PATH_MAX to 4096 for now
 // Actually paths can be much longer but I don't care about that use case for
@@ -31,6 +46,48 @@
 
 #define USERNAME_SIZE 32
 #define DATABUF_SIZE 16384
+// Fits a command with a parameter of maximum size and its line ending
+#define CMDBUF_SIZE (MAX_STRSIZE + 16)
+
+// Longest line a directory listing can produce for a single entry.
+// Listings are only continued while at least this much space is left in the buffer.
+#define LISTLINE_SIZE 512
+
+// Listing a STAT <path> reply holds at most. It goes out on the blocking control connection,
+// so it has to fit into the socket's send buffer (5744 bytes with lwIP's defaults).
+#define STAT_LISTING_SIZE 4096
+
+// Maximum time select waits before the loop checks for stop/drain requests
+#define SELECT_TIMEOUT_MS 250
+
+// Timeouts are checked by the event loop with a resolution of TIMER_TICK_MS
+#define TIMER_TICK_MS 100
+#define IDLE_TIMEOUT_MS (5 * 60 * 1000) // Control connection without commands or transfer
+#define STALL_TIMEOUT_MS (60 * 1000)    // Data connection without any progress
+#define ACCEPT_TIMEOUT_MS (30 * 1000)   // Data connection that didn't get established
+#define PASV_LINGER_MS (10 * 1000)      // Passive data port kept open for the next PASV
+
+// Telnet commands that can show up on the control connection
+#define TELNET_IAC 255  // Interpret as command
+#define TELNET_WILL 251 // Option negotiation: followed by an option byte
+#define TELNET_DONT 254
+
+// Number of transfer buffers kept around for reuse once a transfer is done
+#define SPARE_DATABUFS 2
+
+// Files retrieved with more than this left to send are read ahead
+#define READAHEAD_MIN_SIZE (4 * DATABUF_SIZE)
+
+// Files that don't get any smaller by compressing them again.
+// MODE Z sends them using deflate's stored blocks, which costs next to nothing.
+static const char *compressed_extensions[] = {
+    ".zip", ".gz", ".tgz", ".bz2", ".xz", ".7z", ".rar", ".chd", ".cso",
+    ".png", ".jpg", ".jpeg", ".gif", ".mp3", ".ogg", ".mp4", ".mkv",
+};
+
+// Digests computed while receiving a file with STOR
+#define NUM_STORE_DIGESTS 2
+static const enum DigestAlgo store_digest_algos[NUM_STORE_DIGESTS] = {DigestCRC32, DigestSHA256};
 
 // Helper macros for less typing
 
@@ -70,13 +127,13 @@
 
 #define rpath_extend(dest, n, base, child)                                                         \
 	if (path_extend(dest, n, base, child) < 0) {                                                   \
-		rreply(client->socket, "500 Internal error: Path is too long!");                           \
+		rreply(client->socket, "500 Internal error: Path is too long!\r\n");                       \
 		return -1;                                                                                 \
 	}
 
 #define rpath_resolve(dest, base, child)                                                           \
-	if (path_resolve(dest, base, child) < 0) {                                                     \
-		rreply(client->socket, "500 Internal error: Path is too long!");                           \
+	if (path_resolve(dest, client->root, client->root_len, base, child) < 0) {                     \
+		rreply(client->socket, "500 Internal error: Path is too long!\r\n");                       \
 		return -1;                                                                                 \
 	}
 
@@ -96,7 +153,9 @@ static int replyf(int sock, const char *format, ...) {
 }
 /// Appends the path child to base and writes the result to dest.
 static int path_extend(char *dest, size_t n, const char *base, const char *child) {
-	int len = snprintf(dest, n, "%s/%s", base, child);
+	const size_t base_len = strlen(base);
+	const bool slash = base_len > 0 && base[base_len - 1] == '/';
+	int len = snprintf(dest, n, slash ? "%s%s" : "%s/%s", base, child);
 	if (len > (int)n) {
 		fprintf(stderr, "the new path is too long!\n");
 		return -1;
@@ -107,20 +166,24 @@ static int path_extend(char *dest, size_t n, const char *base, const char *child
 	return 0;
 }
 
-/// If child is a realative path then append the path child to base and writes the result to dest.
-/// Otherwise simply set dest to child.
+/// Resolves the path child a client sent relative to its working directory base
+/// and sets dest to the file it refers to. Clients see the directory root of
+/// length root_len as "/" and can't leave it, no matter how many ".." they use.
 static char fullpath_resolve[PATH_MAX];
-static int path_resolve(char **dest, const char *base, const char *child) {
-	if (child[0] == '/') {
-		// path is absolute: just copy pointer to dest
-		*dest = (char *)child;
-	} else {
-		// path is relative: extend it using cwd
-		if (path_extend(fullpath_resolve, sizeof(fullpath_resolve), base, child) != 0) {
-			return -1;
-		}
-		*dest = fullpath_resolve;
+static int path_resolve(char **dest, const char *root, size_t root_len, const char *base,
+                        const char *child) {
+	memcpy(fullpath_resolve, root, root_len);
+	const int len = path_canonicalize(fullpath_resolve + root_len,
+	                                  sizeof(fullpath_resolve) - root_len, base, child);
+	if (len < 0) {
+		fprintf(stderr, "the new path is too long!\n");
+		return -1;
 	}
+	if (len == 1 && root_len > 0) {
+		// The root itself
+		fullpath_resolve[root_len] = '\0';
+	}
+	*dest = fullpath_resolve;
 	return 0;
 }
 
@@ -152,57 +215,1071 @@ enum StructureType {
 	Page,
 };
 
+// The kind of data transfer a client is currently running.
+// Transfers are driven by the event loop, one buffer at a time.
+enum TransferKind {
+	NoTransfer = 0,
+	Retrieve, // Sending a file to the client
+	Store,    // Receiving a file from the client
+	Listing,  // Sending a directory listing to the client
+	Hashing,  // Computing the digest of a file, needs no data connection
+};
+
+// Entries of a listed directory, sorted by name. Clients mirroring a directory
+// usually retrieve its files in this order, so it is used to guess the next one.
+typedef struct DirList {
+	char *names; // Type ('d' or '-') followed by the name and '\0' for every entry
+	size_t names_len;
+	size_t names_size;
+	size_t *entries; // Offsets of the entries in names
+	size_t count;
+	size_t capacity;
+} DirList;
+
+// LIST -R leaves out directories nested deeper than this below the listed one.
+// The tree is walked using a snapshot per level instead of recursion on the small task stack.
+#define WALK_MAX_DEPTH 16
+
+typedef struct WalkLevel {
+	DirList list;
+	size_t pos;      // Next entry to list
+	size_t next_dir; // Next entry to check for a subdirectory to descend into
+	size_t path_len; // Length of the path of this directory
+} WalkLevel;
+
+// A directory tree being listed, level 0 is the listed directory itself
+typedef struct DirWalk {
+	WalkLevel levels[WALK_MAX_DEPTH];
+	size_t depth; // Number of levels being walked, 0 once done
+	bool recursive;
+	char path[PATH_MAX]; // Path of the deepest level
+} DirWalk;
+
 typedef struct Client {
 	enum ClientState state;
 	int socket;
 	int data_socket;
 
 	char username[USERNAME_SIZE];
-	char cwd[PATH_MAX];
+	char cwd[PATH_MAX]; // Canonical working directory as the client sees it
+	const char *root;   // Directory the client sees as "/"
+	size_t root_len;    // Length of root without trailing '/'
 	enum TranfserType ttype;
 	enum StructureType stype;
+	bool mode_z;      // Transfers are deflate compressed (MODE Z)
+	int mode_z_level; // Compression level used by MODE Z
 
 	// Adress and port used for active or passive ftp?
 	bool passive_mode;
 	struct sockaddr_in addr;
+	struct sockaddr_in peer; // Peer of the control connection, PORT doesn't change it
+	int pasv_socket;              // Listening for data connections in passive mode
+	struct sockaddr_in pasv_addr; // Address pasv_socket listens on
+	bool pasv_armed;              // A PASV waits for its data connection on pasv_socket
+	bool data_connecting;         // Active data connection is not established yet
 
 	// Used for moving/renaming files
 	char from_path[PATH_MAX];
 
+	// Received part of the next command line
+	char cmd_buf[CMDBUF_SIZE];
+	size_t cmd_len;
+
+	// Offset requested using REST, applies to the next RETR or STOR
+	off_t rest_offset;
+
+	// State of the running transfer
+	enum TransferKind transfer;
+	FILE *file;
+	bool file_cached; // file is lent by the file cache
+	bool cache_head;  // The first read of file is offered to the file cache
+	ContentEntry *content; // Cached content of the file being sent, instead of file
+	ReadAhead *readahead;  // Reads file ahead while the transfer is sending
+	char transfer_path[PATH_MAX];
+	ssize_t transfer_index; // Entry of the listed directory being retrieved, -1 if none
+	off_t offset; // Offset in the file up to which data was transferred
+	uint64_t transfer_bytes; // Bytes moved over the data connection by the running transfer
+	uint64_t total_bytes;    // Bytes moved over data connections since the client connected
+	uint64_t interval_bytes; // Bytes moved since the last stats were reported
+	char *data_buf;
+	size_t data_len; // Number of valid bytes in data_buf
+	size_t data_pos; // Number of bytes of data_buf that were already sent
+
+	// In MODE Z data_buf holds the compressed data and z_buf the plain data
+	ZStream *zstream;
+	char *z_buf;
+	size_t z_len;
+	size_t z_pos;
+	bool z_eof; // All plain data was read into z_buf
+
+	// Digest computed by a Hashing transfer
+	DigestCtx digest;
+	enum FtpKeyword digest_cmd; // Command that asked for the digest
+	struct stat digest_stat;    // Stat of the hashed file, used as key of the digest cache
+	enum DigestAlgo hash_algo;  // Algorithm used by HASH, set using OPTS HASH
+
+	// Digests of a file received from its start, cached once it is complete
+	DigestCtx store_digests[NUM_STORE_DIGESTS];
+	bool store_hashing;
+
+	// Last listed directory tree. LIST sends it and RETR guesses the next file
+	// from its top level, which stays in walk.levels[0] with its path in walk.path.
+	DirWalk walk;
+
+	// Start of the file that is expected to be retrieved next
+	FILE *prefetch_file;
+	char *prefetch_buf;
+	size_t prefetch_len;
+	size_t prefetch_index; // Entry of list that was prefetched
+
+	// Timeouts of the control and data connection
+	Timer idle_timer;
+	Timer data_timer;
+	uftpd_ctx *ctx;
+
 	// For linked list
 	SLIST_ENTRY(Client) entries;
 } Client;
 
+// The path a client sees for a path inside its root directory
+static const char *client_path(const Client *client, const char *path) {
+	return path[client->root_len] == '\0' ? "/" : path + client->root_len;
+}
+
 // Creates the list head struct
 SLIST_HEAD(ClientList, Client)
 client_list = SLIST_HEAD_INITIALIZER(client_list);
 static bool list_initialized = false;
 
-// Retrieve client struct by its socket
-static Client *get_client(int socket) {
+// Timeouts of all clients
+static TimerWheel timers;
+
+// Reports transfer statistics to the stats callback
+static Timer stats_timer;
+static uint64_t stats_last_ms;
+
+static uint64_t now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Current time in timer ticks
+static uint32_t timer_now(void) { return (uint32_t)(now_ms() / TIMER_TICK_MS); }
+
+// Restart the idle timeout of the control connection
+static void client_touch(Client *client) {
+	timer_mod(&timers, &client->idle_timer, timer_now() + IDLE_TIMEOUT_MS / TIMER_TICK_MS);
+}
+
+// Restart the timeout of the data connection
+static void data_touch(Client *client, uint32_t timeout_ms) {
+	timer_mod(&timers, &client->data_timer, timer_now() + timeout_ms / TIMER_TICK_MS);
+}
+
+static int set_nonblocking(int sock) {
+	int flags = fcntl(sock, F_GETFL, 0);
+	if (flags == -1 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) == -1) {
+		perror("fcntl");
+		return -1;
+	}
+	return 0;
+}
+
+// Transfer buffers are kept after a transfer is done, so that following transfers,
+// new clients and a restarted server don't have to allocate them again.
+static char *spare_databufs[SPARE_DATABUFS];
+static int num_spare_databufs = 0;
+
+static char *databuf_get(void) {
+	if (num_spare_databufs > 0) {
+		return spare_databufs[--num_spare_databufs];
+	}
+	return malloc(DATABUF_SIZE);
+}
+
+static void databuf_put(char *buf) {
+	if (buf == NULL) {
+		return;
+	}
+	if (num_spare_databufs < SPARE_DATABUFS) {
+		spare_databufs[num_spare_databufs++] = buf;
+	} else {
+		free(buf);
+	}
+}
+
+// Close the data connection and stop waiting for one. The passive data port
+// stays open for a while, clients send PASV again for every file they transfer.
+static void data_close(Client *client) {
+	if (client->data_socket != -1) {
+		if (close(client->data_socket) == -1) {
+			perror("close");
+		}
+		client->data_socket = -1;
+	}
+	client->pasv_armed = false;
+	client->data_connecting = false;
+	if (client->pasv_socket != -1) {
+		data_touch(client, PASV_LINGER_MS);
+	} else {
+		timer_cancel(&client->data_timer);
+	}
+}
+
+// Stop listening on the passive data port
+static void pasv_close(Client *client) {
+	if (client->pasv_socket != -1) {
+		if (close(client->pasv_socket) == -1) {
+			perror("close");
+		}
+		client->pasv_socket = -1;
+	}
+	client->pasv_armed = false;
+}
+
+// Names of the list being sorted, qsort passes no context to the comparison
+static const char *dirlist_sorting;
+
+static int dirlist_compare(const void *a, const void *b) {
+	return strcmp(dirlist_sorting + *(const size_t *)a + 1,
+	              dirlist_sorting + *(const size_t *)b + 1);
+}
+
+// Read the entries of dir into list, replacing the ones it held before.
+// Returns -1 if out of memory.
+static int dirlist_read(DirList *list, DIR *dir) {
+	list->names_len = 0;
+	list->count = 0;
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] == '.') { // skip . file for now
+			continue;
+		}
+		const size_t size = strlen(entry->d_name) + 2;
+		if (list->names_len + size > list->names_size) {
+			size_t names_size = list->names_size > 0 ? list->names_size : 1024;
+			while (names_size < list->names_len + size) {
+				names_size *= 2;
+			}
+			char *names = realloc(list->names, names_size);
+			if (names == NULL) {
+				return -1;
+			}
+			list->names = names;
+			list->names_size = names_size;
+		}
+		if (list->count == list->capacity) {
+			const size_t capacity = list->capacity > 0 ? list->capacity * 2 : 64;
+			size_t *entries = realloc(list->entries, capacity * sizeof(size_t));
+			if (entries == NULL) {
+				return -1;
+			}
+			list->entries = entries;
+			list->capacity = capacity;
+		}
+		list->entries[list->count++] = list->names_len;
+		list->names[list->names_len] = entry->d_type == DT_DIR ? 'd' : '-';
+		memcpy(list->names + list->names_len + 1, entry->d_name, size - 1);
+		list->names_len += size;
+	}
+	dirlist_sorting = list->names;
+	qsort(list->entries, list->count, sizeof(size_t), dirlist_compare);
+	return 0;
+}
+
+static const char *dirlist_name(const DirList *list, size_t i) {
+	return list->names + list->entries[i] + 1;
+}
+
+static bool dirlist_is_dir(const DirList *list, size_t i) {
+	return list->names[list->entries[i]] == 'd';
+}
+
+// Index of the entry called name, -1 if there is none
+static ssize_t dirlist_find(const DirList *list, const char *name) {
+	size_t lo = 0;
+	size_t hi = list->count;
+	while (lo < hi) {
+		const size_t mid = lo + (hi - lo) / 2;
+		const int cmp = strcmp(name, dirlist_name(list, mid));
+		if (cmp == 0) {
+			return mid;
+		} else if (cmp < 0) {
+			hi = mid;
+		} else {
+			lo = mid + 1;
+		}
+	}
+	return -1;
+}
+
+static void dirlist_free(DirList *list) {
+	free(list->names);
+	free(list->entries);
+	memset(list, 0, sizeof(*list));
+}
+
+// Start walking the directory at path, only its entries unless recursive.
+// Returns -1 with errno set if it can't be read.
+static int dirwalk_start(DirWalk *walk, const char *path, bool recursive) {
+	DIR *dir = opendir(path);
+	if (dir == NULL) {
+		return -1;
+	}
+	WalkLevel *top = &walk->levels[0];
+	const int res = dirlist_read(&top->list, dir);
+	closedir(dir);
+	if (res == -1) {
+		top->list.count = 0;
+		errno = ENOMEM;
+		return -1;
+	}
+	strncpy(walk->path, path, PATH_MAX);
+	top->pos = 0;
+	top->next_dir = 0;
+	top->path_len = strlen(walk->path);
+	walk->depth = 1;
+	walk->recursive = recursive;
+	return 0;
+}
+
+// Continue in the subdirectory name of the deepest level.
+// Returns false if it is too deep or can't be read, it is left out then.
+static bool dirwalk_descend(DirWalk *walk, const char *name) {
+	if (walk->depth == WALK_MAX_DEPTH) {
+		return false;
+	}
+	const size_t parent_len = walk->levels[walk->depth - 1].path_len;
+	const int len =
+	    snprintf(walk->path + parent_len, sizeof(walk->path) - parent_len, "/%s", name);
+	if (len < 0 || (size_t)len >= sizeof(walk->path) - parent_len) {
+		walk->path[parent_len] = 0;
+		return false;
+	}
+
+	DIR *dir = opendir(walk->path);
+	WalkLevel *level = &walk->levels[walk->depth];
+	if (dir == NULL || dirlist_read(&level->list, dir) == -1) {
+		perror("opendir");
+		if (dir != NULL) {
+			closedir(dir);
+		}
+		walk->path[parent_len] = 0;
+		return false;
+	}
+	closedir(dir);
+	level->pos = 0;
+	level->next_dir = 0;
+	level->path_len = parent_len + len;
+	walk->depth++;
+	return true;
+}
+
+// Return to the parent of the deepest level
+static void dirwalk_ascend(DirWalk *walk) {
+	walk->depth--;
+	walk->path[walk->levels[walk->depth > 0 ? walk->depth - 1 : 0].path_len] = 0;
+}
+
+// End the walk, done or not. Only the top level is kept.
+static void dirwalk_finish(DirWalk *walk) {
+	walk->depth = 0;
+	walk->path[walk->levels[0].path_len] = 0;
+	for (size_t i = 1; i < WALK_MAX_DEPTH; i++) {
+		dirlist_free(&walk->levels[i].list);
+	}
+}
+
+static void dirwalk_free(DirWalk *walk) {
+	for (size_t i = 0; i < WALK_MAX_DEPTH; i++) {
+		dirlist_free(&walk->levels[i].list);
+	}
+}
+
+// Index of path in the last listed directory of client, -1 if it is not in there.
+// Paths are compared as resolved, the file system is not asked.
+static ssize_t list_index(const Client *client, const char *path) {
+	const DirList *list = &client->walk.levels[0].list;
+	const size_t len = client->walk.levels[0].path_len;
+	if (list->count == 0 || len == 0 || strncmp(path, client->walk.path, len) != 0) {
+		return -1;
+	}
+	// Only the root directory ends with '/'
+	const char *name = path + len;
+	if (client->walk.path[len - 1] != '/' && *name++ != '/') {
+		return -1;
+	}
+	return dirlist_find(list, name);
+}
+
+static void prefetch_drop(Client *client) {
+	if (client->prefetch_file != NULL) {
+		fclose(client->prefetch_file);
+		client->prefetch_file = NULL;
+	}
+	databuf_put(client->prefetch_buf);
+	client->prefetch_buf = NULL;
+}
+
+// Drop the read ahead files of all clients, before files change or to free file handles
+static void prefetch_drop_all(void) {
 	Client *c;
-	SLIST_FOREACH(c, &client_list, entries) {
-		if (c->socket == socket || c->data_socket == socket) {
-			return c;
+	SLIST_FOREACH(c, &client_list, entries) { prefetch_drop(c); }
+}
+
+// Forget what is cached about the file at path before it changes,
+// or about all files if path is NULL as renaming a directory moves everything in it
+static void file_changing(const char *path) {
+	if (path != NULL) {
+		digest_cache_invalidate(path);
+		file_cache_invalidate(path);
+		content_cache_invalidate(path);
+	} else {
+		file_cache_clear();
+		content_cache_clear();
+	}
+	prefetch_drop_all();
+}
+
+// Open the next file of the listed directory starting at entry from and read its
+// first block, so a RETR of it can start sending without waiting for the card.
+static void prefetch_next(Client *client, size_t from) {
+	static char prefetch_path[PATH_MAX];
+
+	const DirList *list = &client->walk.levels[0].list;
+	prefetch_drop(client);
+	size_t i = from;
+	while (i < list->count && dirlist_is_dir(list, i)) {
+		i++;
+	}
+	if (i >= list->count || path_extend(prefetch_path, sizeof(prefetch_path), client->walk.path,
+	                                    dirlist_name(list, i)) != 0) {
+		return;
+	}
+
+	FILE *f = fopen(prefetch_path, "r");
+	if (f == NULL) {
+		return;
+	}
+	char *buf = databuf_get();
+	size_t len = 0;
+	if (buf == NULL || ((len = fread(buf, 1, DATABUF_SIZE, f)) == 0 && ferror(f))) {
+		databuf_put(buf);
+		fclose(f);
+		return;
+	}
+	client->prefetch_file = f;
+	client->prefetch_buf = buf;
+	client->prefetch_len = len;
+	client->prefetch_index = i;
+}
+
+// fopen that makes room by dropping read ahead and cached files if too many
+// files are open. FAT only allows a few open files at a time.
+static FILE *open_file(const char *path, const char *mode) {
+	FILE *f = fopen(path, mode);
+	if (f == NULL && (errno == EMFILE || errno == ENFILE)) {
+		prefetch_drop_all();
+		file_cache_clear();
+		f = fopen(path, mode);
+	}
+	return f;
+}
+
+// Release the file, directory and buffer of the running transfer.
+// Returns -1 if the file could not be closed properly.
+static int transfer_release(Client *client) {
+	int res = 0;
+	if (client->transfer == Hashing) {
+		digest_free(&client->digest);
+	} else if (client->transfer == Listing) {
+		dirwalk_finish(&client->walk);
+	} else if (client->transfer == Store) {
+		// Retrievals during the upload may have cached what was there before
+		file_cache_invalidate(client->transfer_path);
+		content_cache_invalidate(client->transfer_path);
+	}
+	if (client->store_hashing) {
+		for (int i = 0; i < NUM_STORE_DIGESTS; i++) {
+			digest_free(&client->store_digests[i]);
+		}
+		client->store_hashing = false;
+	}
+	if (client->readahead != NULL) {
+		readahead_stop(client->readahead);
+		client->readahead = NULL;
+	}
+	if (client->file != NULL) {
+		if (client->file_cached) {
+			file_cache_give(client->transfer_path, client->file);
+		} else if (fclose(client->file) == EOF) {
+			perror("fclose");
+			res = -1;
+		}
+		client->file = NULL;
+	}
+	client->file_cached = false;
+	client->cache_head = false;
+	if (client->content != NULL) {
+		content_cache_release(client->content);
+		client->content = NULL;
+	}
+	databuf_put(client->data_buf);
+	client->data_buf = NULL;
+	client->data_len = 0;
+	client->data_pos = 0;
+	zstream_free(client->zstream);
+	client->zstream = NULL;
+	databuf_put(client->z_buf);
+	client->z_buf = NULL;
+	if (client->transfer != NoTransfer) {
+		client->transfer = NoTransfer;
+		client_touch(client);
+	}
+	return res;
+}
+
+// Release everything the running transfer of client holds.
+// Returns -1 if the file could not be closed properly.
+static int transfer_close(Client *client) {
+	data_close(client);
+	return transfer_release(client);
+}
+
+// Abort the running transfer. Interrupted file transfers report the offset
+// they reached, so the client can resume using REST. The offset of a compressed
+// download is not known, only the compressed bytes sent are.
+static int transfer_abort(Client *client, const char *reason) {
+	const bool resumable = (client->transfer == Retrieve && client->zstream == NULL) ||
+	                       client->transfer == Store;
+	const off_t offset = client->offset;
+	transfer_close(client);
+
+	if (resumable) {
+		rreplyf(client->socket, "426 %s; transfer aborted at offset %ld, resume using REST.\r\n",
+		        reason, (long)offset);
+	} else {
+		rreplyf(client->socket, "426 %s; transfer aborted.\r\n", reason);
+	}
+	return 0;
+}
+
+// Abort the running transfer because of a local error.
+static int transfer_fail(Client *client, int err) {
+	transfer_close(client);
+	rreplyf(client->socket, "451 Filesystem error: %s\r\n", strerror(err));
+	return 0;
+}
+
+// Close the data connection and send the final reply of a successful transfer.
+// Only a single reply is sent, so clients don't get out of step with their commands.
+// The file likely to be retrieved next is read while the client handles the reply.
+static int transfer_finish(Client *client) {
+	const enum TransferKind kind = client->transfer;
+	if (transfer_close(client) == -1) {
+		rreplyf(client->socket, "451 Filesystem error: %s\r\n", strerror(errno));
+		return 0;
+	}
+
+	rreply_client("226 Closing data connection.\r\n");
+	if (kind == Listing) {
+		prefetch_next(client, 0);
+	} else if (kind == Retrieve && client->transfer_index != -1) {
+		prefetch_next(client, client->transfer_index + 1);
+	}
+	return 0;
+}
+
+// Finish receiving a file. The digests computed on the way are cached,
+// so a client verifying the upload doesn't make us read it again.
+static int transfer_store_finish(Client *client) {
+	uint8_t digests[NUM_STORE_DIGESTS][DIGEST_MAX_SIZE];
+	const bool hashed = client->store_hashing;
+	for (int i = 0; hashed && i < NUM_STORE_DIGESTS; i++) {
+		digest_final(&client->store_digests[i], digests[i]);
+	}
+
+	if (transfer_close(client) == -1) {
+		rreplyf(client->socket, "451 Filesystem error: %s\r\n", strerror(errno));
+		return 0;
+	}
+
+	// The modification time is only final once the file is closed
+	struct stat st;
+	if (hashed && stat(client->transfer_path, &st) == 0) {
+		for (int i = 0; i < NUM_STORE_DIGESTS; i++) {
+			digest_cache_put(client->transfer_path, &st, store_digest_algos[i], digests[i]);
+		}
+	}
+
+	rreply_client("226 Closing data connection.\r\n");
+	return 0;
+}
+
+static bool is_compressed(const char *path) {
+	const char *ext = strrchr(path, '.');
+	if (ext == NULL) {
+		return false;
+	}
+	for (size_t i = 0; i < sizeof(compressed_extensions) / sizeof(compressed_extensions[0]); i++) {
+		if (strcasecmp(ext, compressed_extensions[i]) == 0) {
+			return true;
 		}
 	}
+	return false;
+}
+
+// Start driving a transfer from the event loop once the data connection is established.
+// A transfer buffer that was filled already is sent first.
+static int transfer_begin(Client *client, enum TransferKind kind) {
+	client->transfer = kind;
+	client->transfer_bytes = 0;
+
+	// Cached content is sent right out of the cache
+	if (client->data_buf == NULL && client->content == NULL) {
+		client->data_len = 0;
+		client->data_pos = 0;
+		if ((client->data_buf = databuf_get()) == NULL) {
+			fprintf(stderr, "error allocating transfer buffer!\n");
+			return transfer_fail(client, ENOMEM);
+		}
+	}
+
+	if (kind == Hashing) {
+		return 0;
+	}
+
+	if (client->mode_z) {
+		// Already compressed files are only wrapped into a deflate stream
+		int level = client->mode_z_level;
+		if (kind == Retrieve && is_compressed(client->transfer_path)) {
+			level = 0;
+		}
+		client->zstream = zstream_new(kind != Store, level);
+		client->z_buf = databuf_get();
+		client->z_len = 0;
+		client->z_pos = 0;
+		client->z_eof = false;
+		if (client->zstream == NULL || client->z_buf == NULL) {
+			fprintf(stderr, "error allocating compression buffers!\n");
+			return transfer_fail(client, ENOMEM);
+		}
+	}
+
+	if (client->data_socket == -1 || client->data_connecting) {
+		data_touch(client, ACCEPT_TIMEOUT_MS);
+	} else {
+		data_touch(client, STALL_TIMEOUT_MS);
+	}
+	return 0;
+}
+
+// Count bytes moved over the data connection for the transfer statistics
+static void client_count_bytes(Client *client, size_t len) {
+	client->transfer_bytes += len;
+	client->total_bytes += len;
+	client->interval_bytes += len;
+}
+
+// Send the pending part of buf, which is between data_pos and data_len.
+static int transfer_send_buf(Client *client, const char *buf) {
+	ssize_t sent_bytes =
+	    send(client->data_socket, buf + client->data_pos, client->data_len - client->data_pos, 0);
+	if (sent_bytes == -1) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			return 0;
+		}
+		perror("send");
+		return transfer_abort(client, "Connection error");
+	}
+	dprintf("sent %ld bytes\n", sent_bytes);
+	client->data_pos += sent_bytes;
+	client->offset += sent_bytes;
+	client_count_bytes(client, sent_bytes);
+	data_touch(client, STALL_TIMEOUT_MS);
+	return 0;
+}
+
+// Reads the next part of the data to send into buf.
+// Returns the number of bytes, 0 at the end or -1 on error with errno set.
+typedef ssize_t (*transfer_reader)(Client *client, char *buf, size_t size);
+
+static ssize_t read_file(Client *client, char *buf, size_t size) {
+	size_t read_bytes;
+	if (client->readahead != NULL) {
+		const ssize_t len = readahead_read(client->readahead, buf);
+		if (len == -1) {
+			perror("readahead_read");
+			return -1;
+		}
+		read_bytes = len;
+	} else {
+		read_bytes = fread(buf, 1, size, client->file);
+		if (read_bytes == 0 && ferror(client->file)) {
+			perror("fread");
+			return -1;
+		}
+	}
+	dprintf("read %ld bytes\n", read_bytes);
+	if (client->cache_head) {
+		client->cache_head = false;
+		client->file_cached =
+		    file_cache_add(client->transfer_path, client->file, buf, read_bytes);
+	}
+	return read_bytes;
+}
+
+// Format entry i of list in the directory dir_path as a line of ls -l into buf.
+// Returns the length of the line, 0 if the entry is left out.
+static size_t format_entry(char *buf, size_t size, const char *dir_path, const DirList *list,
+                           size_t i) {
+	static char entry_path[PATH_MAX];
+
+	const char *name = dirlist_name(list, i);
+	struct stat entry_stat;
+	if (path_extend(entry_path, sizeof(entry_path), dir_path, name) != 0) {
+		return 0;
+	}
+	if (stat(entry_path, &entry_stat) == -1) {
+		perror("stat");
+		return 0;
+	}
+
+	// filetype: no link support(yet?)
+	const char filetype = dirlist_is_dir(list, i) ? 'd' : '-';
+
+	// Date format conforming to POSIX ls:
+	// https://pubs.opengroup.org/onlinepubs/9699919799/utilities/ls.html
+	char date_str[24];
+	const char *date_fmt = "%b %d %H:%M";
+	time_t mtime = entry_stat.st_mtime;
+	// Display year if file is older than 6 months
+	if (time(NULL) > entry_stat.st_mtime + 6 * 30 * 24 * 60 * 60)
+		date_fmt = "%b %d  %Y";
+	strftime(date_str, 24, date_fmt, localtime(&mtime));
+
+	const char *fmtstring = "%crw-rw-rw- 1 user group %lu %s %s\r\n";
+	dprintf(fmtstring, filetype, entry_stat.st_size, date_str, name);
+	int line_len = snprintf(buf, size, fmtstring, filetype, (unsigned long)entry_stat.st_size,
+	                        date_str, name);
+	if (line_len > 0 && line_len < LISTLINE_SIZE) {
+		return line_len;
+	}
+	return 0;
+}
+
+// Format the next entries of the listed directory tree into buf.
+// Like ls -R every directory is listed before its subdirectories,
+// each of them starting with its path.
+static ssize_t read_listing(Client *client, char *buf, size_t size) {
+	DirWalk *walk = &client->walk;
+	size_t len = 0;
+	while (size - len > LISTLINE_SIZE && walk->depth > 0) {
+		WalkLevel *level = &walk->levels[walk->depth - 1];
+		const DirList *list = &level->list;
+		if (level->pos < list->count) {
+			len += format_entry(buf + len, size - len, walk->path, list, level->pos++);
+			continue;
+		}
+
+		if (walk->recursive) {
+			while (level->next_dir < list->count && !dirlist_is_dir(list, level->next_dir)) {
+				level->next_dir++;
+			}
+			if (level->next_dir < list->count) {
+				const char *name = dirlist_name(list, level->next_dir++);
+				if (dirwalk_descend(walk, name)) {
+					int line_len = snprintf(buf + len, size - len, "\r\n%s:\r\n",
+					                        client_path(client, walk->path));
+					if (line_len > 0 && line_len < LISTLINE_SIZE) {
+						len += line_len;
+					}
+				}
+				continue;
+			}
+		}
+		dirwalk_ascend(walk);
+	}
+	return len;
+}
+
+// Split ls options like -R or -la off the argument of LIST and STAT.
+// Only -R changes anything, the others are accepted as some clients always send them.
+static const char *parse_list_options(const char *arg, bool *recursive) {
+	*recursive = false;
+	while (arg[0] == '-') {
+		for (arg++; *arg != '\0' && *arg != ' '; arg++) {
+			if (*arg == 'R') {
+				*recursive = true;
+			}
+		}
+		while (*arg == ' ') {
+			arg++;
+		}
+	}
+	return arg;
+}
+
+// Compress data from read into data_buf until some output is ready.
+// Returns the number of compressed bytes, 0 at the end or -1 on error with errno set.
+static ssize_t transfer_deflate(Client *client, transfer_reader read) {
+	size_t len = 0;
+	while (len == 0) {
+		if (client->z_pos == client->z_len && !client->z_eof) {
+			ssize_t read_bytes = read(client, client->z_buf, DATABUF_SIZE);
+			if (read_bytes == -1) {
+				return -1;
+			}
+			client->z_len = read_bytes;
+			client->z_pos = 0;
+			client->z_eof = read_bytes == 0;
+		}
+
+		size_t in_len = client->z_len - client->z_pos;
+		size_t out_len = DATABUF_SIZE;
+		int res = zstream_run(client->zstream, client->z_buf + client->z_pos, &in_len,
+		                      client->data_buf, &out_len, client->z_eof);
+		if (res == -1) {
+			errno = EIO;
+			return -1;
+		}
+		client->z_pos += in_len;
+		len = out_len;
+		if (res == 1) {
+			break;
+		}
+	}
+	return len;
+}
+
+// Send the data produced by read, compressed in MODE Z
+static int transfer_send(Client *client, transfer_reader read) {
+	if (client->data_pos == client->data_len) {
+		ssize_t len;
+		if (client->zstream != NULL) {
+			len = transfer_deflate(client, read);
+		} else {
+			len = read(client, client->data_buf, DATABUF_SIZE);
+		}
+		if (len == -1) {
+			return transfer_fail(client, errno);
+		}
+		if (len == 0) {
+			return transfer_finish(client);
+		}
+		client->data_len = len;
+		client->data_pos = 0;
+	}
+	return transfer_send_buf(client, client->data_buf);
+}
+
+// Send a file from the content cache
+static int transfer_send_content(Client *client) {
+	if (client->data_pos == client->data_len) {
+		return transfer_finish(client);
+	}
+	return transfer_send_buf(client, client->content->data);
+}
+
+// Write received data to the file
+static int transfer_write(Client *client, const char *buf, size_t len) {
+	if (fwrite(buf, 1, len, client->file) != len) {
+		perror("fwrite");
+		return transfer_fail(client, errno);
+	}
+	for (int i = 0; client->store_hashing && i < NUM_STORE_DIGESTS; i++) {
+		digest_update(&client->store_digests[i], buf, len);
+	}
+	client->offset += len;
+	return 0;
+}
+
+// Decompress the received data in data_buf and write it to the file
+static int transfer_inflate(Client *client, size_t len) {
+	const char *in = client->data_buf;
+	for (;;) {
+		size_t in_len = len;
+		size_t out_len = DATABUF_SIZE;
+		int res = zstream_run(client->zstream, in, &in_len, client->z_buf, &out_len, false);
+		if (res == -1) {
+			return transfer_abort(client, "Invalid compressed data");
+		}
+		in += in_len;
+		len -= in_len;
+		if (out_len > 0) {
+			if (transfer_write(client, client->z_buf, out_len) == -1) {
+				return -1;
+			}
+			if (client->transfer == NoTransfer) {
+				return 0; // Writing failed and ended the transfer
+			}
+		}
+		// Data after the end of the stream is ignored
+		if (res == 1 || (len == 0 && out_len < DATABUF_SIZE)) {
+			return 0;
+		}
+	}
+}
+
+static int transfer_recv_file(Client *client) {
+	ssize_t received_bytes = recv(client->data_socket, client->data_buf, DATABUF_SIZE, 0);
+	if (received_bytes == -1) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			return 0;
+		}
+		perror("recv");
+		return transfer_abort(client, "Connection error");
+	}
+	dprintf("received %ld bytes\n", received_bytes);
+	data_touch(client, STALL_TIMEOUT_MS);
+	client_count_bytes(client, received_bytes);
+	if (received_bytes == 0) {
+		if (client->zstream != NULL && !zstream_finished(client->zstream)) {
+			return transfer_abort(client, "Compressed data is incomplete");
+		}
+		return transfer_store_finish(client);
+	}
+
+	if (client->zstream != NULL) {
+		return transfer_inflate(client, received_bytes);
+	}
+	return transfer_write(client, client->data_buf, received_bytes);
+}
+
+// Reply to HASH or one of the XCRC/XMD5/XSHA commands with the digest of a file
+static int reply_digest(Client *client, enum FtpKeyword keyword, enum DigestAlgo algo,
+                        const uint8_t *digest, const char *path, off_t size) {
+	char hex[2 * DIGEST_MAX_SIZE + 1];
+	digest_hex(hex, digest, digest_sizes[algo], keyword == XCRC);
+	if (keyword == HASH) {
+		rreplyf(client->socket, "213 %s 0-%ld %s %s\r\n", digest_names[algo], (long)size, hex, path);
+	} else {
+		rreplyf(client->socket, "250 %s\r\n", hex);
+	}
+	return 0;
+}
+
+// Feed the next part of the file into the digest. A data connection
+// that was opened before is kept for the following transfer.
+static int transfer_hash_file(Client *client) {
+	size_t read_bytes = fread(client->data_buf, 1, DATABUF_SIZE, client->file);
+	if (read_bytes > 0) {
+		digest_update(&client->digest, client->data_buf, read_bytes);
+		client->offset += read_bytes;
+		return 0;
+	}
+	if (ferror(client->file)) {
+		perror("fread");
+		return transfer_fail(client, errno);
+	}
+
+	uint8_t digest[DIGEST_MAX_SIZE];
+	digest_final(&client->digest, digest);
+	digest_cache_put(client->transfer_path, &client->digest_stat, client->digest.algo, digest);
+	transfer_release(client);
+	return reply_digest(client, client->digest_cmd, client->digest.algo, digest,
+	                    client_path(client, client->transfer_path), client->digest_stat.st_size);
+}
+
+// Move the running transfer of client forward once its data socket is ready.
+static int transfer_step(Client *client) {
+	switch (client->transfer) {
+	case Retrieve:
+		if (client->content != NULL) {
+			return transfer_send_content(client);
+		}
+		return transfer_send(client, read_file);
+	case Store:
+		return transfer_recv_file(client);
+	case Listing:
+		return transfer_send(client, read_listing);
+	case Hashing:
+		return transfer_hash_file(client);
+	default:
+		return 0;
+	}
+}
+
+// Disconnects a client by closing its connections and freeing its memory
+static void client_free(Client *client, uftpd_ctx *ctx) {
+	pasv_close(client);
+	transfer_close(client);
+	prefetch_drop(client);
+	dirwalk_free(&client->walk);
+	timer_cancel(&client->idle_timer);
+	if (close(client->socket) == -1) {
+		perror("close");
+	}
+	FD_CLR(client->socket, &ctx->master);
+	SLIST_REMOVE(&client_list, client, Client, entries);
+	free(client);
+}
+
+// Handle a disconnect by removing the client from
+// the connected client list and freeing its memory.
+static void handle_disconnect(Client *client, uftpd_ctx *ctx) {
+	char client_ipstr[INET6_ADDRSTRLEN];
+	inet_ntop(AF_INET, &client->peer.sin_addr, client_ipstr, sizeof(client_ipstr));
+	notify_user_ctx(ClientDisconnected, client_ipstr);
 
-	return NULL;
+	client_free(client, ctx);
+}
+
+// Disconnect clients that neither sent commands nor transferred anything for too long
+static void idle_timeout(Timer *timer, void *arg) {
+	UNUSED(timer);
+	Client *client = arg;
+	if (client->transfer != NoTransfer) {
+		client_touch(client);
+		return;
+	}
+	send(client->socket, "421 Timeout, closing control connection.\r\n", 42, 0);
+	handle_disconnect(client, client->ctx);
 }
 
-// Disconnects all clients and frees their memory
-static int disconnect_all_clients() {
+// Give up on data connections that don't get established or stopped moving
+static void data_timeout(Timer *timer, void *arg) {
+	UNUSED(timer);
+	Client *client = arg;
+	if (client->transfer == NoTransfer || client->transfer == Hashing) {
+		// The data connection of PASV was never used or the passive port is not needed anymore
+		pasv_close(client);
+		data_close(client);
+	} else if (client->data_socket == -1 || client->data_connecting) {
+		transfer_close(client);
+		replyf(client->socket, "425 Can't open data connection: Timeout\r\n");
+	} else {
+		transfer_abort(client, "Data connection stalled");
+	}
+}
+
+// Disconnects all clients and frees their memory.
+// Running transfers are aborted, telling their clients where to resume.
+static int disconnect_all_clients(uftpd_ctx *ctx) {
 	while (!SLIST_EMPTY(&client_list)) {
 		Client *c = SLIST_FIRST(&client_list);
-		SLIST_REMOVE_HEAD(&client_list, entries);
-		if (close(c->socket) == -1) {
-			perror("close");
+		if (c->transfer != NoTransfer) {
+			transfer_abort(c, "Server is shutting down");
 		}
-		free(c);
+		send(c->socket, "421 Service closing control connection.\r\n", 42, 0);
+		handle_disconnect(c, ctx);
 	}
 	return 0;
 }
 
+// Disconnects all clients that are not transferring anything,
+// so that a draining server only waits for running transfers.
+static void disconnect_idle_clients(uftpd_ctx *ctx) {
+	Client *c, *tmp;
+	SLIST_FOREACH_SAFE(c, &client_list, entries, tmp) {
+		if (c->transfer == NoTransfer) {
+			send(c->socket, "421 Service closing control connection.\r\n", 42, 0);
+			handle_disconnect(c, ctx);
+		}
+	}
+}
+
 // Create a new client and initalize it
 static Client *client_new(int socket, struct sockaddr_storage *client_addr, const char *start_dir) {
 	Client *new_client = malloc(sizeof(Client));
@@ -213,15 +1290,51 @@ static Client *client_new(int socket, struct sockaddr_storage *client_addr, cons
 
 	new_client->socket = socket;
 	new_client->state = Identifying;
+	new_client->username[0] = '\0';
 	new_client->data_socket = -1;
 	new_client->ttype = Image;
 	new_client->passive_mode = false;
+	new_client->pasv_socket = -1;
+	new_client->pasv_armed = false;
+	new_client->data_connecting = false;
 	new_client->from_path[0] = 0;
-	strncpy(new_client->cwd, start_dir, PATH_MAX);
+	new_client->cmd_len = 0;
+	new_client->rest_offset = 0;
+	new_client->transfer = NoTransfer;
+	new_client->file = NULL;
+	new_client->file_cached = false;
+	new_client->cache_head = false;
+	new_client->content = NULL;
+	new_client->readahead = NULL;
+	new_client->transfer_index = -1;
+	new_client->offset = 0;
+	new_client->transfer_bytes = 0;
+	new_client->total_bytes = 0;
+	new_client->interval_bytes = 0;
+	new_client->data_buf = NULL;
+	new_client->data_len = 0;
+	new_client->data_pos = 0;
+	new_client->mode_z = false;
+	new_client->zstream = NULL;
+	new_client->z_buf = NULL;
+	new_client->hash_algo = DigestSHA256;
+	new_client->store_hashing = false;
+	memset(&new_client->walk, 0, sizeof(new_client->walk));
+	new_client->prefetch_file = NULL;
+	new_client->prefetch_buf = NULL;
+	timer_init(&new_client->idle_timer, idle_timeout, new_client);
+	timer_init(&new_client->data_timer, data_timeout, new_client);
+	strcpy(new_client->cwd, "/");
+	new_client->root = start_dir;
+	new_client->root_len = strlen(start_dir);
+	while (new_client->root_len > 0 && start_dir[new_client->root_len - 1] == '/') {
+		new_client->root_len--;
+	}
 
 	// Use client address and default port 20 for active mode
 	new_client->addr.sin_port = htons(20);
 	memcpy(&(new_client->addr), client_addr, sizeof(new_client->addr));
+	memcpy(&(new_client->peer), client_addr, sizeof(new_client->peer));
 
 	return new_client;
 }
@@ -238,6 +1351,13 @@ static int handle_connect(int listen_sock, uftpd_ctx *ctx) {
 		return newfd;
 	}
 
+	// A draining server turns away new clients
+	if (ctx->draining) {
+		send(newfd, "421 Service not available, closing control connection.\r\n", 57, 0);
+		close(newfd);
+		return 0;
+	}
+
 	if (!list_initialized) {
 		SLIST_INIT(&client_list);
 		list_initialized = true;
@@ -246,9 +1366,27 @@ static int handle_connect(int listen_sock, uftpd_ctx *ctx) {
 	// Insert client into list of connected clients
 	Client *client = client_new(newfd, &client_addr, ctx->start_dir);
 	if (client == NULL) {
+		close(newfd);
 		return -1;
 	}
+
+	// The Telnet Synch in front of ABOR is sent as urgent data, keep it in the command stream
+	int oobinline = 1;
+	setsockopt(newfd, SOL_SOCKET, SO_OOBINLINE, &oobinline, sizeof(oobinline));
+	// Replies are complete lines. Without this the final reply of a transfer waits for
+	// the delayed ACK of its preliminary reply, which dominates transfers of small files.
+	int nodelay = 1;
+	setsockopt(newfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
 	SLIST_INSERT_HEAD(&client_list, client, entries);
+	client->ctx = ctx;
+	client->mode_z_level = ctx->compression_level;
+	client_touch(client);
+
+	// Add new socket to master list
+	FD_SET(newfd, &ctx->master);
+	if (newfd > ctx->fd_max) {
+		ctx->fd_max = newfd;
+	}
 
 	rreply_client("220 uftpd server\r\n");
 
@@ -260,74 +1398,9 @@ static int handle_connect(int listen_sock, uftpd_ctx *ctx) {
 	return newfd;
 }
 
-// Handle a disconnect by removing the client from
-// the connected client list and freeing its memory.
-static void handle_disconnect(int client_sock, uftpd_callback ev_callback) {
-	UNUSED(ev_callback);
-	Client *client = get_client(client_sock);
-	assert(client != NULL);
-
-	char client_ipstr[INET6_ADDRSTRLEN];
-	inet_ntop(AF_INET, &((struct sockaddr_in *)&client->addr)->sin_addr, client_ipstr,
-	          sizeof(client_ipstr));
-	notify_user(ClientDisconnected, client_ipstr);
-
-	SLIST_REMOVE(&client_list, client, Client, entries);
-	free(client);
-}
-
-// Process data from data connection
-static int handle_data(char *buf, Client *client) {
-	UNUSED(buf);
-	UNUSED(client);
-	// TODO: PASSV: Implement
-	return 0;
-}
-
 static int handle_cwd(Client *client, const char *path) {
-	static char pathbuf[PATH_MAX];
-	char *newpath;
-	const char *pwd = client->cwd;
-
-	// Handle .. and .
-	if (path[0] == '.' && path[1] == '.') {
-		// Go up
-		if (strlen(pwd) <= 1 && pwd[0] == '/') {
-			// Cant go up anymore
-			rreply_client("431 Error changing directory: Already at topmost directory\r\n");
-			return -1;
-		}
-
-		// Remove upmost directory
-		bool copy = false;
-		int len = 0;
-		for (ssize_t i = strlen(pwd); i >= 0; i--) {
-			if (pwd[i] == '/')
-				copy = true;
-			if (copy) {
-				pathbuf[i] = pwd[i];
-				len++;
-			}
-		}
-		assert(copy);
-		// remove trailing slash
-		if (len > 1 && pathbuf[len - 1] == '/')
-			len--;
-		pathbuf[len] = '\0';
-		newpath = pathbuf;
-	} else if (path[0] == '/') {
-		// Go to specified absoule path
-		strncpy(pathbuf, path, PATH_MAX);
-
-		// remove trailing slash if any
-		const int len = strlen(pathbuf);
-		if (len > 1 && pathbuf[len - 1] == '/')
-			pathbuf[len - 1] = '\0';
-		newpath = pathbuf;
-	} else {
-		// Go to specified relative path
-		rpath_resolve(&newpath, client->cwd, path);
-	}
+	char *newpath;
+	rpath_resolve(&newpath, client->cwd, path);
 	dprintf("newpath: \"%s\"\n", newpath);
 
 	// Make sure the folder exists
@@ -341,45 +1414,346 @@ static int handle_cwd(Client *client, const char *path) {
 		return -1;
 	}
 
-	strncpy(client->cwd, newpath, PATH_MAX);
+	strncpy(client->cwd, client_path(client, newpath), PATH_MAX);
 	rreply_client("200 Working directory changed.\r\n");
 	return 0;
 }
 
-// Open a active ftp connection by connecting to the clients address
+// Open a active ftp connection by connecting to the clients address.
+// The event loop notices once the connection is established.
 static int open_active(Client *client) {
 	int data_socket = socket(AF_INET, SOCK_STREAM, 0);
 	// TODO: Consider using getaddrinfo
 	if (data_socket == -1) {
-		replyf(client->socket, "500 Connection error: %s\r\n", strerror(errno));
+		replyf(client->socket, "425 Can't open data connection: %s\r\n", strerror(errno));
 		perror("socket");
-		return -1;
+		return -2;
+	}
+	if (set_nonblocking(data_socket) == -1) {
+		replyf(client->socket, "425 Can't open data connection: %s\r\n", strerror(errno));
+		close(data_socket);
+		return -2;
 	}
+	client->data_socket = data_socket;
 
 	rreply_client("150 File status okay; about to open data connection.\r\n");
 	int res = connect(data_socket, (struct sockaddr *)&(client->addr), sizeof(client->addr));
 	if (res == -1) {
-		replyf(client->socket, "500 Connection error: %s\r\n", strerror(errno));
+		if (errno == EINPROGRESS) {
+			client->data_connecting = true;
+			return 0;
+		}
+		replyf(client->socket, "425 Can't open data connection: %s\r\n", strerror(errno));
 		perror("connect");
-		close(data_socket);
+		transfer_close(client);
+		return -2;
+	}
+
+	return 0;
+}
+
+// Listen on a new data port at the address the client reached us at
+static int pasv_listen(Client *client) {
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	if (getsockname(client->socket, (struct sockaddr *)&addr, &addrlen) == -1) {
+		perror("getsockname");
 		return -1;
 	}
+	addr.sin_port = 0;
 
-	return data_socket;
+	int pasv_socket = socket(AF_INET, SOCK_STREAM, 0);
+	if (pasv_socket == -1) {
+		perror("socket");
+		return -1;
+	}
+	// Non-blocking, so connections of other hosts can be drained without waiting
+	if (bind(pasv_socket, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+	    listen(pasv_socket, 1) == -1 ||
+	    getsockname(pasv_socket, (struct sockaddr *)&addr, &addrlen) == -1 ||
+	    set_nonblocking(pasv_socket) == -1) {
+		perror("pasv");
+		const int err = errno;
+		close(pasv_socket);
+		errno = err;
+		return -1;
+	}
+	client->pasv_socket = pasv_socket;
+	client->pasv_addr = addr;
+	return 0;
 }
 
-// Open active or passive connection depending on setting
-static int open_data(Client *client) {
+// Close connections that reached the lingering data port while no PASV waited for one.
+// The client only learns about the port again from the reply to this PASV.
+static void pasv_drain(Client *client) {
 	int data_socket;
-	if (client->passive_mode) {
-		// TODO: PASSV: Use listen socket? Enque listen command?
+	while ((data_socket = accept(client->pasv_socket, NULL, NULL)) != -1) {
+		close(data_socket);
+	}
+}
+
+// Wait for a data connection and tell the client where to connect to.
+// The data port of the previous PASV is used again while it is open.
+static int open_passive(Client *client) {
+	// Close data connections of earlier PASV or PORT commands
+	transfer_close(client);
+
+	if (client->pasv_socket == -1) {
+		if (pasv_listen(client) == -1) {
+			rreplyf(client->socket, "425 Can't open data connection: %s\r\n", strerror(errno));
+			return -2;
+		}
 	} else {
-		if ((data_socket = open_active(client)) == -1) {
-			return -1;
+		pasv_drain(client);
+	}
+	client->passive_mode = true;
+	client->pasv_armed = true;
+	data_touch(client, ACCEPT_TIMEOUT_MS);
+
+	const uint32_t ip = ntohl(client->pasv_addr.sin_addr.s_addr);
+	const uint16_t port = ntohs(client->pasv_addr.sin_port);
+	rreplyf(client->socket, "227 Entering Passive Mode (%u,%u,%u,%u,%u,%u).\r\n", ip >> 24,
+	        (ip >> 16) & 0xff, (ip >> 8) & 0xff, ip & 0xff, port >> 8, port & 0xff);
+	return 0;
+}
+
+// Prepare the active or passive connection depending on setting.
+// The transfer starts once the event loop established it.
+static int open_data(Client *client) {
+	if (client->passive_mode) {
+		if (!client->pasv_armed && client->data_socket == -1) {
+			rreply_client("425 Use PASV or PORT first.\r\n");
+			return -2;
 		}
-		return data_socket;
+		rreply_client("150 File status okay; about to open data connection.\r\n");
+		return 0;
 	}
-	return -1;
+	return open_active(client);
+}
+
+// Accept the data connection of a client in passive mode.
+// Connections from other hosts than the one of the control connection are closed.
+static int handle_data_accept(Client *client) {
+	struct sockaddr_in addr, peer;
+	socklen_t addrlen = sizeof(addr), peerlen = sizeof(peer);
+	int data_socket = accept(client->pasv_socket, (struct sockaddr *)&addr, &addrlen);
+	if (data_socket == -1) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			perror("accept");
+		}
+		return 0;
+	}
+	if (getpeername(client->socket, (struct sockaddr *)&peer, &peerlen) == -1 ||
+	    addr.sin_family != AF_INET || addr.sin_addr.s_addr != peer.sin_addr.s_addr) {
+		close(data_socket);
+		return 0;
+	}
+
+	// Only a single connection is accepted per PASV
+	client->pasv_armed = false;
+
+	if (set_nonblocking(data_socket) == -1) {
+		close(data_socket);
+		if (client->transfer != NoTransfer) {
+			return transfer_fail(client, errno);
+		}
+		return 0;
+	}
+	client->data_socket = data_socket;
+	if (client->transfer != NoTransfer) {
+		data_touch(client, STALL_TIMEOUT_MS);
+	}
+	return 0;
+}
+
+// Check the result of connecting the active data connection
+static int handle_data_connected(Client *client) {
+	int err = 0;
+	socklen_t len = sizeof(err);
+	if (getsockopt(client->data_socket, SOL_SOCKET, SO_ERROR, &err, &len) == -1) {
+		err = errno;
+	}
+	if (err != 0) {
+		fprintf(stderr, "connect: %s\n", strerror(err));
+		transfer_close(client);
+		rreplyf(client->socket, "425 Can't open data connection: %s\r\n", strerror(err));
+		return 0;
+	}
+	client->data_connecting = false;
+	data_touch(client, STALL_TIMEOUT_MS);
+	return 0;
+}
+
+// Reply with the digest of a file. Cached digests are sent right away,
+// otherwise the event loop reads the file and replies once it is done.
+static int handle_hash(Client *client, enum FtpKeyword keyword, const char *pathname,
+                       enum DigestAlgo algo) {
+	char *path;
+	rpath_resolve(&path, client->cwd, pathname);
+
+	struct stat st;
+	if (stat(path, &st) == -1) {
+		perror("stat");
+		rreplyf(client->socket, "550 Filesystem error: %s\r\n", strerror(errno));
+		return -2;
+	}
+	if (!S_ISREG(st.st_mode)) {
+		rreply_client("550 Not a regular file.\r\n");
+		return -2;
+	}
+
+	uint8_t digest[DIGEST_MAX_SIZE];
+	if (digest_cache_get(path, &st, algo, digest)) {
+		return reply_digest(client, keyword, algo, digest, client_path(client, path), st.st_size);
+	}
+
+	FILE *f = open_file(path, "r");
+	if (f == NULL) {
+		perror("fopen");
+		rreplyf(client->socket, "550 Filesystem error: %s\r\n", strerror(errno));
+		return -2;
+	}
+
+	// The event loop hashes the file from now on
+	client->file = f;
+	client->offset = 0;
+	strncpy(client->transfer_path, path, PATH_MAX);
+	client->digest_cmd = keyword;
+	client->digest_stat = st;
+	digest_init(&client->digest, algo);
+	return transfer_begin(client, Hashing);
+}
+
+// Select or query the compression level of MODE Z using OPTS MODE Z LEVEL <level>
+static int handle_opts_mode_z(Client *client, const char *options) {
+	while (*options == ' ') {
+		options++;
+	}
+	if (*options != '\0') {
+		char *end;
+		long level = -1;
+		if (strncasecmp(options, "LEVEL ", 6) == 0) {
+			level = strtol(options + 6, &end, 10);
+		}
+		if (level < 0 || level > ZSTREAM_MAX_LEVEL || *end != '\0') {
+			rreply_client("501 Invalid MODE Z options.\r\n");
+			return -2;
+		}
+		client->mode_z_level = level;
+	}
+	rreplyf(client->socket, "200 MODE Z LEVEL %d\r\n", client->mode_z_level);
+	return 0;
+}
+
+// Handle OPTS of HASH: select or query the algorithm used by HASH, and of MODE Z
+static int handle_opts(Client *client, const char *options) {
+	if (strncasecmp(options, "MODE Z", 6) == 0 && (options[6] == '\0' || options[6] == ' ')) {
+		return handle_opts_mode_z(client, options + 6);
+	}
+	if (strncasecmp(options, "HASH", 4) != 0 || (options[4] != '\0' && options[4] != ' ')) {
+		rreply_client("501 Option not understood.\r\n");
+		return -2;
+	}
+
+	const char *name = options + 4;
+	while (*name == ' ') {
+		name++;
+	}
+	if (*name != '\0') {
+		const enum DigestAlgo algo = digest_algo_from_name(name);
+		if (algo == NUM_DIGESTS) {
+			rreply_client("501 Unknown algorithm, see FEAT.\r\n");
+			return -2;
+		}
+		client->hash_algo = algo;
+	}
+	rreplyf(client->socket, "200 %s\r\n", digest_names[client->hash_algo]);
+	return 0;
+}
+
+// List the supported extensions, the algorithm HASH uses is marked with a *
+static int handle_feat(Client *client) {
+	char algos[64] = "";
+	for (int algo = NUM_DIGESTS - 1; algo >= 0; algo--) {
+		strcat(algos, digest_names[algo]);
+		if ((enum DigestAlgo)algo == client->hash_algo) {
+			strcat(algos, "*");
+		}
+		if (algo > 0) {
+			strcat(algos, ";");
+		}
+	}
+	rreplyf(client->socket,
+	        "211-Extensions supported:\r\n"
+	        " HASH %s\r\n"
+	        " MODE Z\r\n"
+	        " REST STREAM\r\n"
+	        " XCRC\r\n"
+	        " XMD5\r\n"
+	        " XSHA1\r\n"
+	        " XSHA256\r\n"
+	        "211 End.\r\n",
+	        algos);
+	return 0;
+}
+
+// Reply to STAT without argument with the state of the session and its transfer,
+// with a path like LIST -R or LIST but over the control connection.
+// The listing is sent right away, large trees are better listed using LIST -R.
+static int handle_stat(Client *client, const char *arg) {
+	if (arg[0] == 0) {
+		rreplyf(client->socket,
+		        "211-Status of uftpd:\r\n"
+		        " Logged in as %s\r\n"
+		        " MODE %c, %s\r\n",
+		        client->username, client->mode_z ? 'Z' : 'S',
+		        client->passive_mode ? "passive" : "active");
+		if (client->transfer != NoTransfer) {
+			rreplyf(client->socket, " Transferring %s, %ld bytes so far\r\n",
+			        client_path(client, client->transfer == Listing ? client->walk.path
+			                                                        : client->transfer_path),
+			        (long)client->offset);
+		}
+		rreply_client("211 End of status.\r\n");
+		return 0;
+	}
+
+	bool recursive;
+	char *path;
+	arg = parse_list_options(arg, &recursive);
+	rpath_resolve(&path, client->cwd, arg);
+	prefetch_drop(client);
+	if (dirwalk_start(&client->walk, path, recursive) == -1) {
+		perror("opendir");
+		rreplyf(client->socket, "450 Filesystem error: %s\r\n", strerror(errno));
+		return -2;
+	}
+	char *buf = databuf_get();
+	if (buf == NULL) {
+		dirwalk_finish(&client->walk);
+		rreplyf(client->socket, "451 Filesystem error: %s\r\n", strerror(ENOMEM));
+		return -2;
+	}
+
+	// Whatever doesn't fit is left to LIST, which doesn't hold up other clients
+	int res = replyf(client->socket, "213-Status of %s:\r\n", client_path(client, path));
+	const ssize_t len = read_listing(client, buf, STAT_LISTING_SIZE);
+	if (res == 0 && len > 0 && send(client->socket, buf, len, 0) == -1) {
+		res = -1;
+	}
+	const bool truncated = client->walk.depth > 0;
+	databuf_put(buf);
+	dirwalk_finish(&client->walk);
+	if (res == -1) {
+		return -1;
+	}
+	if (truncated) {
+		rreplyf(client->socket, "213 End of status, truncated. Use LIST%s for the rest.\r\n",
+		        recursive ? " -R" : "");
+		return 0;
+	}
+	rreply_client("213 End of status.\r\n");
+	return 0;
 }
 
 // Handle commands from user once logged in.
@@ -387,9 +1761,22 @@ static int open_data(Client *client) {
 // Return -1 on network/critical error.
 static int handle_ftpcmd_logged_in(const FtpCmd *cmd, Client *client) {
 	const int client_sock = client->socket;
-	int data_socket;
+	int res;
 	char type;
 	char *path;
+
+	// Only one transfer can run per client at a time, STAT tells about it
+	const bool transfer_status = cmd->keyword == STAT && cmd->parameter.string[0] == 0;
+	if (client->transfer != NoTransfer && cmd->keyword != NOOP && cmd->keyword != ABOR &&
+	    !transfer_status) {
+		rreply_client("425 A transfer is already in progress.\r\n");
+		return -2;
+	}
+
+	// REST only applies to the command directly following it
+	const off_t rest_offset = client->rest_offset;
+	client->rest_offset = 0;
+
 	switch (cmd->keyword) {
 	case PWD: // Print working directory
 		rreplyf(client_sock, "257 \"%s\"\r\n", client->cwd);
@@ -416,110 +1803,159 @@ static int handle_ftpcmd_logged_in(const FtpCmd *cmd, Client *client) {
 		// TODO: Probably don't do this and use inet_pton
 		client->addr.sin_addr.s_addr = ip3 << 24 | ip2 << 16 | ip1 << 8 | ip0;
 		client->addr.sin_port = port1 << 8 | port0;
+		client->passive_mode = false;
+		pasv_close(client);
+		transfer_close(client);
 		rreply_client("200 PORT was set.\r\n");
 	} break;
-	// case PASV:
-	// TODO: PASSV: Listen on new dataport and reply with addr of it
-	// break;
+	case PASV:
+		return open_passive(client);
+	case REST: {
+		char *end;
+		const long offset = strtol(cmd->parameter.string, &end, 10);
+		if (*end != '\0' || offset < 0) {
+			rreply_client("501 Invalid restart marker.\r\n");
+			return -2;
+		}
+		client->rest_offset = offset;
+		rreplyf(client_sock, "350 Restarting at %ld. Send RETR or STOR to continue.\r\n", offset);
+	} break;
 	case RETR: {
 		rpath_resolve(&path, client->cwd, cmd->parameter.string);
 		dprintf("opening file %s\n", path);
 
-		FILE *f = fopen(path, "r");
+		// Small files retrieved again and again are sent from memory
+		const ssize_t index = list_index(client, path);
+		ContentEntry *content = client->mode_z ? NULL : content_cache_get(path);
+		if (content != NULL) {
+			prefetch_drop(client);
+			if ((res = open_data(client)) != 0) {
+				content_cache_release(content);
+				return res;
+			}
+			client->content = content;
+			client->offset = rest_offset;
+			client->transfer_index = index;
+			client->data_len = content->size;
+			client->data_pos = rest_offset < (off_t)content->size ? (size_t)rest_offset : content->size;
+			strncpy(client->transfer_path, path, PATH_MAX);
+			return transfer_begin(client, Retrieve);
+		}
+
+		// The file following the previous one of the listed directory was read ahead,
+		// files retrieved again and again are kept open
+		FILE *f;
+		char *buf = NULL;
+		size_t buf_len = 0;
+		bool cached = false;
+		if (index != -1 && client->prefetch_file != NULL &&
+		    client->prefetch_index == (size_t)index) {
+			f = client->prefetch_file;
+			buf = client->prefetch_buf;
+			buf_len = client->prefetch_len;
+			client->prefetch_file = NULL;
+			client->prefetch_buf = NULL;
+		} else {
+			prefetch_drop(client);
+			buf = databuf_get();
+			f = buf != NULL ? file_cache_take(path, buf, &buf_len) : NULL;
+			cached = f != NULL;
+			if (!cached) {
+				f = open_file(path, "r");
+			}
+		}
 		if (f == NULL) {
 			replyf(client->socket, "550 Filesystem error: %s\r\n", strerror(errno));
 			perror("fopen");
+			databuf_put(buf);
 			return -2;
 		}
-
-		if ((data_socket = open_data(client)) == -1) {
-			return -1;
+		// The first block can only be sent as it is when sending from the start uncompressed
+		if (buf_len > 0 && (rest_offset > 0 || client->mode_z)) {
+			buf_len = 0;
+			rewind(f);
 		}
-
-		char data_buf[DATABUF_SIZE];
-		size_t read_bytes = 0;
-		ssize_t sent_bytes = 0;
-		size_t reamining_bytes = 0;
-		do {
-			read_bytes = fread(data_buf, 1, 2048, f);
-			dprintf("read %ld bytes\n", read_bytes);
-			if (ferror(f)) {
-				perror("fread");
-			}
-			reamining_bytes = read_bytes;
-			dprintf("remaining %ld bytes\n", reamining_bytes);
-			while (reamining_bytes > 0) {
-				sent_bytes = send(data_socket, data_buf, read_bytes, 0);
-				dprintf("sent %ld bytes\n", sent_bytes);
-				if (sent_bytes == -1) {
-					perror("send");
-					close(data_socket);
-					return -1;
-				}
-				reamining_bytes -= sent_bytes;
-				dprintf("remaining %ld bytes\n", reamining_bytes);
+		if (rest_offset > 0 && fseek(f, rest_offset, SEEK_SET) == -1) {
+			replyf(client->socket, "550 Filesystem error: %s\r\n", strerror(errno));
+			perror("fseek");
+			res = -2;
+		} else {
+			res = open_data(client);
+		}
+		if (res != 0) {
+			if (cached) {
+				file_cache_give(path, f);
+			} else {
+				fclose(f);
 			}
-		} while (read_bytes > 0);
-
-		fclose(f);
+			databuf_put(buf);
+			return res;
+		}
 
-		rreply_client("226 Closing data connection.\r\n");
-		close(data_socket);
-		rreply_client("250 Requested file action okay, completed.\r\n");
+		// The event loop sends the file from now on
+		client->file = f;
+		client->offset = rest_offset;
+		client->transfer_index = index;
+		client->data_buf = buf;
+		client->data_len = buf_len;
+		client->data_pos = 0;
+		strncpy(client->transfer_path, path, PATH_MAX);
+		// Files read from the start are offered to the file cache
+		client->file_cached = cached;
+		if (!cached && rest_offset == 0) {
+			if (buf_len > 0) {
+				client->file_cached = file_cache_add(path, f, buf, buf_len);
+			} else {
+				client->cache_head = true;
+			}
+		}
+		// Large files are read from the card while the network is busy sending
+		struct stat st;
+		if (fstat(fileno(f), &st) == 0 && st.st_size - ftell(f) > READAHEAD_MIN_SIZE) {
+			client->readahead = readahead_start(f, DATABUF_SIZE);
+		}
+		return transfer_begin(client, Retrieve);
 	} break;
 	case STOR: {
 		rpath_resolve(&path, client->cwd, cmd->parameter.string);
 		dprintf("opening file %s\n", path);
 
-		// Try to create file by opening it for writing
-		FILE *f = fopen(path, "w");
+		file_changing(path);
+
+		// Try to create file by opening it for writing.
+		// Resumed uploads keep what was already stored before the offset.
+		FILE *f = open_file(path, rest_offset > 0 ? "r+" : "w");
 		if (f == NULL) {
 			replyf(client->socket, "550 Filesystem error: %s\r\n", strerror(errno));
 			perror("fopen");
 			return -2;
 		}
-
-		if ((data_socket = open_data(client)) == -1) {
-			return -1;
+		if (rest_offset > 0 && fseek(f, rest_offset, SEEK_SET) == -1) {
+			replyf(client->socket, "550 Filesystem error: %s\r\n", strerror(errno));
+			perror("fseek");
+			fclose(f);
+			return -2;
 		}
 
-		// Read data from data_socket and write it to created file
-		char data_buf[DATABUF_SIZE];
-		size_t written_bytes = 0;
-		ssize_t received_bytes = 0;
-		ssize_t reamining_bytes = 0;
-		do {
-			received_bytes = recv(data_socket, data_buf, sizeof(data_buf), 0);
-			if (received_bytes == -1) {
-				perror("recv");
-				return -1;
-			}
-			dprintf("received %ld bytes\n", received_bytes);
-			reamining_bytes = received_bytes;
-			dprintf("remaining %ld bytes\n", reamining_bytes);
-			// Write the received bytes down
-			while (reamining_bytes > 0) {
-				written_bytes = fwrite(data_buf, 1, received_bytes, f);
-				dprintf("written %ld bytes\n", written_bytes);
-				if (ferror(f)) {
-					replyf(client->socket, "550 Filesystem error: %s\r\n", strerror(errno));
-					perror("fwrite");
-					fclose(f);
-					return -1;
-				}
-				reamining_bytes -= written_bytes;
-				dprintf("remainingloop %ld bytes\n", reamining_bytes);
-			}
-		} while (received_bytes > 0);
-
-		rreply_client("226 Closing data connection.\r\n");
-		close(data_socket);
-		rreply_client("250 Requested file action okay, completed.\r\n");
+		if ((res = open_data(client)) != 0) {
+			fclose(f);
+			return res;
+		}
 
-		fclose(f);
+		// The event loop receives the file from now on.
+		// Digests can only be computed if the whole file passes by.
+		client->file = f;
+		client->offset = rest_offset;
+		strncpy(client->transfer_path, path, PATH_MAX);
+		client->store_hashing = rest_offset == 0;
+		for (int i = 0; client->store_hashing && i < NUM_STORE_DIGESTS; i++) {
+			digest_init(&client->store_digests[i], store_digest_algos[i]);
+		}
+		return transfer_begin(client, Store);
 	} break;
 	case DELE: {
 		rpath_resolve(&path, client->cwd, cmd->parameter.string);
+		file_changing(path);
 		if (unlink(path) == -1) {
 			perror("unlink");
 			rreplyf(client->socket, "550 Filesystem error: %s\r\n", strerror(errno));
@@ -556,6 +1992,10 @@ static int handle_ftpcmd_logged_in(const FtpCmd *cmd, Client *client) {
 			rreply_client("503 Bad sequence of commands. Use RNFR first.\r\n");
 			return -2;
 		}
+		// Digests are keyed by more than the path, so only the renamed file needs to go
+		digest_cache_invalidate(client->from_path);
+		digest_cache_invalidate(path);
+		file_changing(NULL);
 		if (rename(client->from_path, path) == -1) {
 			perror("rename");
 			rreplyf(client->socket, "550 Filesystem error: %s\r\n", strerror(errno));
@@ -566,60 +2006,27 @@ static int handle_ftpcmd_logged_in(const FtpCmd *cmd, Client *client) {
 		rreply_client("250 Requested file action okay, completed.\r\n");
 	} break;
 	case LIST: {
-		const char *pathname = client->cwd;
-		if (cmd->parameter.string[0] != 0) {
-			pathname = cmd->parameter.string;
-		}
-
-		// List files
-		// TODO: Buffer first and the send once we know we got no error
-		DIR *dir = opendir(pathname);
-		if (dir == NULL) {
+		bool recursive;
+		const char *arg = parse_list_options(cmd->parameter.string, &recursive);
+		rpath_resolve(&path, client->cwd, arg);
+		const char *pathname = path;
+
+		// List files sorted by name, the list is kept to guess which file is retrieved next
+		prefetch_drop(client);
+		if (dirwalk_start(&client->walk, pathname, recursive) == -1) {
 			perror("opendir");
 			rreplyf(client->socket, "450 Filesystem error: %s\r\n", strerror(errno));
 			return -2;
 		}
 
-		if ((data_socket = open_data(client)) == -1) {
-			return -1;
+		if ((res = open_data(client)) != 0) {
+			dirwalk_finish(&client->walk);
+			return res;
 		}
 
-		struct dirent *entry;
-		while ((entry = readdir(dir)) != NULL) {
-			if (entry->d_name[0] == '.') { // skip . file for now
-				continue;
-			}
-			struct stat entry_stat;
-			rpath_extend(fullpath_resolve, sizeof(fullpath_resolve), client->cwd, entry->d_name);
-			if (stat(fullpath_resolve, &entry_stat) == -1) {
-				perror("stat");
-				continue;
-			}
-
-			// filetype: no link support(yet?)
-			char filetype;
-			if (entry->d_type == DT_DIR)
-				filetype = 'd';
-			else
-				filetype = '-';
-
-			// Date format conforming to POSIX ls:
-			// https://pubs.opengroup.org/onlinepubs/9699919799/utilities/ls.html
-			char date_str[24];
-			const char *date_fmt = "%b %d %H:%M";
-			time_t mtime = entry_stat.st_mtime;
-			// Display year if file is older than 6 months
-			if (time(NULL) > entry_stat.st_mtime + 6 * 30 * 24 * 60 * 60)
-				date_fmt = "%b %d  %Y";
-			strftime(date_str, 24, date_fmt, localtime(&mtime));
-
-			const char *fmtstring = "%crw-rw-rw- 1 user group %lu %s %s\r\n";
-			dprintf(fmtstring, filetype, entry_stat.st_size, date_str, entry->d_name);
-			rreplyf(data_socket, fmtstring, filetype, entry_stat.st_size, date_str, entry->d_name);
-		}
-		closedir(dir);
-		rreply_client("226 Closing data connection.\r\n");
-		close(data_socket);
+		// The event loop sends the listing from now on
+		client->offset = 0;
+		return transfer_begin(client, Listing);
 	} break;
 	case TYPE: // Set the data representation type
 		type = cmd->parameter.code;
@@ -632,6 +2039,15 @@ static int handle_ftpcmd_logged_in(const FtpCmd *cmd, Client *client) {
 			rreplyf(client_sock, "500 Type %c not supported.\r\n", type);
 		}
 		break;
+	case MODE: // Set the transfer mode
+		type = cmd->parameter.code;
+		if (type == 'S' || type == 'Z') {
+			client->mode_z = type == 'Z';
+			rreplyf(client_sock, "200 Mode set to %c.\r\n", type);
+		} else {
+			rreplyf(client_sock, "504 Mode %c not supported.\r\n", type);
+		}
+		break;
 	case STRU: // Set the data structure
 		type = cmd->parameter.code;
 		if (type == 'F') {
@@ -641,9 +2057,36 @@ static int handle_ftpcmd_logged_in(const FtpCmd *cmd, Client *client) {
 			rreplyf(client_sock, "500 Type %c not supported.\r\n", type);
 		}
 		break;
+	case ABOR:
+		if (client->transfer != NoTransfer) {
+			// Reply to the aborted command first, then to ABOR itself
+			if (transfer_abort(client, "Connection closed") == -1) {
+				return -1;
+			}
+			rreply_client("226 Abort successful.\r\n");
+		} else {
+			// Drop a data connection that was opened for nothing
+			transfer_close(client);
+			rreply_client("225 No transfer to abort.\r\n");
+		}
+		break;
 	case NOOP:
 		rreply(client_sock, "200 Successfully did nothing.\r\n");
 		break;
+	case STAT:
+		return handle_stat(client, cmd->parameter.string);
+	case OPTS:
+		return handle_opts(client, cmd->parameter.string);
+	case HASH:
+		return handle_hash(client, HASH, cmd->parameter.string, client->hash_algo);
+	case XCRC:
+		return handle_hash(client, XCRC, cmd->parameter.string, DigestCRC32);
+	case XMD5:
+		return handle_hash(client, XMD5, cmd->parameter.string, DigestMD5);
+	case XSHA1:
+		return handle_hash(client, XSHA1, cmd->parameter.string, DigestSHA1);
+	case XSHA256:
+		return handle_hash(client, XSHA256, cmd->parameter.string, DigestSHA256);
 	case INVALID:
 		rreply(client_sock, "504 Invalid command.\r\n");
 		break;
@@ -654,9 +2097,13 @@ static int handle_ftpcmd_logged_in(const FtpCmd *cmd, Client *client) {
 	}
 	return 0;
 }
-
 // Hande ftp command depending on the clients state.
 static int handle_ftpcmd(FtpCmd *cmd, Client *client, uftpd_callback ev_callback) {
+	// Clients may ask for extensions before logging in
+	if (cmd->keyword == FEAT) {
+		return handle_feat(client);
+	}
+
 	switch (client->state) {
 	case Identifying:
 		// Only allow USER command for identification
@@ -698,27 +2145,72 @@ static int handle_ftpcmd(FtpCmd *cmd, Client *client, uftpd_callback ev_callback
 	return 0;
 }
 
-// Handle authentication and socket re
-static int handle_recv(int client_sock, char *buf, uftpd_callback ev_callback) {
-	// Retreive user socket
-	Client *client = get_client(client_sock);
-	assert(client != NULL);
-	const bool is_data_socket = client_sock == client->data_socket ? true : false;
+// Remove Telnet commands from a command line and return its new length.
+// Clients send IAC IP and the IAC DM of a Telnet Synch in front of ABOR.
+static size_t telnet_strip(char *line, size_t len) {
+	size_t out = 0;
+	for (size_t in = 0; in < len; in++) {
+		const unsigned char c = line[in];
+		if (c != TELNET_IAC || in + 1 == len) {
+			line[out++] = c;
+			continue;
+		}
+		const unsigned char cmd = line[++in];
+		if (cmd == TELNET_IAC) {
+			// Escaped data byte 255
+			line[out++] = cmd;
+		} else if (cmd >= TELNET_WILL && cmd <= TELNET_DONT && in + 1 < len) {
+			// Skip the option of WILL, WONT, DO and DONT
+			in++;
+		}
+	}
+	return out;
+}
+
+// Read from the control connection of client and execute every complete command
+static int handle_recv(Client *client, uftpd_callback ev_callback) {
+	ssize_t nbytes = recv(client->socket, client->cmd_buf + client->cmd_len,
+	                      sizeof(client->cmd_buf) - 1 - client->cmd_len, 0);
+	if (nbytes <= 0) {
+		// client error or disconnect
+		if (nbytes == -1) {
+			perror("recv");
+		}
+		return -1;
+	}
+	client->cmd_len += nbytes;
+	client_touch(client);
+
+	char *line = client->cmd_buf;
+	char *end;
+	while ((end = memchr(line, '\n', client->cmd_buf + client->cmd_len - line)) != NULL) {
+		char buf[CMDBUF_SIZE];
+		size_t len = telnet_strip(memcpy(buf, line, end + 1 - line), end + 1 - line);
+		buf[len] = '\0';
+		line = end + 1;
+
+		// Lines that only held Telnet commands
+		if (buf[0] == '\r' || buf[0] == '\n') {
+			continue;
+		}
 
-	// TODO: PASSV: Handle DTP socket?
-	if (is_data_socket) {
-		if (handle_data(buf, client) != 0) {
-			fprintf(stderr, "error handling ftp data socket");
+		// Parse and execute ftp command
+		FtpCmd cmd = parse_ftpcmd(buf);
+		dprintf("command buffer: \"%s\"", buf);
+		dprintf("parsed command: %s\n", keyword_names[cmd.keyword]);
+		if (handle_ftpcmd(&cmd, client, ev_callback) == -1) {
 			return -1;
 		}
-		return 0;
 	}
 
-	// Parse and execute ftp command
-	FtpCmd cmd = parse_ftpcmd(buf);
-	dprintf("command buffer: \"%s\"", buf);
-	dprintf("parsed command: %s\n", keyword_names[cmd.keyword]);
-	return handle_ftpcmd(&cmd, client, ev_callback);
+	// Keep an incomplete command for the next recv
+	client->cmd_len -= line - client->cmd_buf;
+	memmove(client->cmd_buf, line, client->cmd_len);
+	if (client->cmd_len == sizeof(client->cmd_buf) - 1) {
+		client->cmd_len = 0;
+		rreply_client("500 Command line too long.\r\n");
+	}
+	return 0;
 }
 
 // ============================================================================
@@ -768,78 +2260,233 @@ int uftpd_init(uftpd_ctx *ctx, struct addrinfo *addr) {
 	ctx->fd_max = listen_socket;
 	ctx->listen_socket = listen_socket;
 	ctx->running = true;
+	ctx->draining = false;
 	ctx->ev_callback = NULL;
 	ctx->start_dir = "/";
+	ctx->compression_level = 6;
+	ctx->content_cache_budget = 0;
+	ctx->content_cache_max_file_size = 0;
+	ctx->stats_callback = NULL;
+	ctx->stats_interval_ms = 0;
 
 	return 0;
 }
 
+// Describe client in session, taking the bytes it moved during the interval
+static void session_stats(Client *client, uftpd_session_stats *session, uint64_t elapsed_ms) {
+	inet_ntop(AF_INET, &client->peer.sin_addr, session->ip, sizeof(session->ip));
+	snprintf(session->user, sizeof(session->user), "%.*s", USERNAME_SIZE, client->username);
+	session->file[0] = '\0';
+	session->storing = client->transfer == Store;
+	if (client->transfer == Retrieve || client->transfer == Store) {
+		// Keep the end of long paths, it names the file
+		const char *path = client_path(client, client->transfer_path);
+		const size_t len = strlen(path);
+		if (len >= sizeof(session->file)) {
+			path += len - (sizeof(session->file) - 1);
+		}
+		strcpy(session->file, path);
+	}
+	session->bytes = client->transfer_bytes;
+	session->total_bytes = client->total_bytes;
+	session->rate = elapsed_ms > 0 ? client->interval_bytes * 1000 / elapsed_ms : 0;
+}
+
+// Report the transfer statistics of all clients, transferring ones first
+static void report_stats(uftpd_ctx *ctx) {
+	static uftpd_transfer_stats stats;
+	const uint64_t now = now_ms();
+	const uint64_t elapsed_ms = now - stats_last_ms;
+	uint64_t bytes = 0;
+	stats_last_ms = now;
+	stats.session_count = 0;
+
+	for (int pass = 0; pass < 2; pass++) {
+		Client *client;
+		SLIST_FOREACH(client, &client_list, entries) {
+			if ((client->transfer == NoTransfer) != (pass == 1)) {
+				continue;
+			}
+			if (stats.session_count < UFTPD_STATS_MAX_SESSIONS) {
+				session_stats(client, &stats.sessions[stats.session_count], elapsed_ms);
+			}
+			stats.session_count++;
+			bytes += client->interval_bytes;
+			client->interval_bytes = 0;
+		}
+	}
+	stats.rate = elapsed_ms > 0 ? bytes * 1000 / elapsed_ms : 0;
+	stats.interval_ms = elapsed_ms;
+	ctx->stats_callback(&stats);
+}
+
+static void stats_timeout(Timer *timer, void *arg) {
+	uftpd_ctx *ctx = arg;
+	report_stats(ctx);
+	timer_mod(&timers, timer, timer_now() + ctx->stats_interval_ms / TIMER_TICK_MS);
+}
+
 // Event loop of server
 int uftpd_start(uftpd_ctx *ctx) {
-	int nbytes;
-	fd_set ready;
-	char buf[128];
+	fd_set ready, writable;
 
-	FD_ZERO(&ready);
+	// A stop or drain requested before the loop started counts, uftpd_resume clears a drain
+	if (!ctx->running || ctx->draining) {
+		return 0;
+	}
+	timer_wheel_init(&timers, timer_now());
+	content_cache_configure(ctx->content_cache_budget, ctx->content_cache_max_file_size);
+	timer_init(&stats_timer, stats_timeout, ctx);
+	if (ctx->stats_callback != NULL) {
+		stats_last_ms = now_ms();
+		timer_mod(&timers, &stats_timer, timer_now() + ctx->stats_interval_ms / TIMER_TICK_MS);
+	}
 
 	notify_user_ctx(ServerStarted, NULL);
 	while (ctx->running) {
-		ready = ctx->master;
-		if (select(ctx->fd_max + 1, &ready, NULL, NULL, NULL) == -1) {
-			perror("select");
-			break;
+		// Fire timeouts, their callbacks may disconnect clients
+		timer_wheel_advance(&timers, timer_now());
+
+		if (ctx->draining) {
+			disconnect_idle_clients(ctx);
+			if (SLIST_EMPTY(&client_list)) {
+				break;
+			}
 		}
-		int fdmax = ctx->fd_max;
 
-		for (int sock = 0; sock <= fdmax; sock++) {
-			if (!FD_ISSET(sock, &ready)) {
+		// Control connections are always watched, data connections
+		// only while they have to be established or have a transfer to move forward.
+		ready = ctx->master;
+		FD_ZERO(&writable);
+		int fdmax = ctx->fd_max;
+		bool hashing = false;
+		Client *client, *tmp;
+		SLIST_FOREACH(client, &client_list, entries) {
+			// Hashing only reads files, so it just keeps the loop from sleeping
+			if (client->transfer == Hashing) {
+				hashing = true;
 				continue;
 			}
-
-			if (sock == ctx->listen_socket) {
-				int csock;
-				if ((csock = handle_connect(ctx->listen_socket, ctx)) == -1) {
-					fprintf(stderr, "error handling incomming connection");
-					ctx->running = false;
+			if (client->data_socket == -1) {
+				if (client->pasv_armed) {
+					FD_SET(client->pasv_socket, &ready);
+					if (client->pasv_socket > fdmax) {
+						fdmax = client->pasv_socket;
+					}
 				}
+				continue;
+			}
+			if (client->data_connecting) {
+				FD_SET(client->data_socket, &writable);
+			} else if (client->transfer == Store) {
+				FD_SET(client->data_socket, &ready);
+			} else if (client->transfer != NoTransfer) {
+				FD_SET(client->data_socket, &writable);
+			}
+			if (client->data_socket > fdmax) {
+				fdmax = client->data_socket;
+			}
+		}
 
-				// Add new socket to master list
-				FD_SET(csock, &ctx->master);
-				if (csock > fdmax) {
-					fdmax = csock;
-				}
-			} else { // data socket
-				if ((nbytes = recv(sock, buf, sizeof(buf), 0)) <= 0) {
-					// ctx error or disconnect
-					if (nbytes == 0) {
-						handle_disconnect(sock, ctx->ev_callback);
-					} else {
-						perror("recv");
+		// Sleep until the tick of the next timeout at most, but wake up regularly
+		// to notice stop and drain requests
+		uint32_t timeout_ms = (timer_wheel_next(&timers) + 1) * TIMER_TICK_MS;
+		if (timeout_ms > SELECT_TIMEOUT_MS) {
+			timeout_ms = SELECT_TIMEOUT_MS;
+		}
+		if (hashing) {
+			timeout_ms = 0;
+		}
+		struct timeval timeout = {
+		    .tv_sec = timeout_ms / 1000,
+		    .tv_usec = (timeout_ms % 1000) * 1000,
+		};
+		if (select(fdmax + 1, &ready, &writable, NULL, &timeout) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("select");
+			break;
+		}
+
+		SLIST_FOREACH_SAFE(client, &client_list, entries, tmp) {
+			int res = 0;
+			const int data_socket = client->data_socket;
+			if (client->transfer == Hashing) {
+				res = transfer_step(client);
+			} else if (data_socket != -1) {
+				if (FD_ISSET(data_socket, &ready) || FD_ISSET(data_socket, &writable)) {
+					if (client->data_connecting) {
+						res = handle_data_connected(client);
+					} else if (client->transfer != NoTransfer) {
+						res = transfer_step(client);
 					}
-					close(sock);
-					FD_CLR(sock, &ctx->master);
-					continue; // skip to next socket
 				}
+			} else if (client->pasv_armed && FD_ISSET(client->pasv_socket, &ready)) {
+				res = handle_data_accept(client);
+			}
+			if (res != -1 && FD_ISSET(client->socket, &ready)) {
+				res = handle_recv(client, ctx->ev_callback);
+			}
+			if (res == -1) {
+				handle_disconnect(client, ctx);
+			}
+		}
 
-				// nbytes > 0
-				assert(nbytes > 0);
-				buf[nbytes] = '\0';
-				if (handle_recv(sock, buf, ctx->ev_callback) == -1) {
-					fprintf(stderr, "error handling package\n");
-					ctx->running = false;
-				}
-			} // sock == listen_sock
-			ctx->fd_max = fdmax;
-		} // for all sockets
-	}     // while(running)
-
-	// close remaining connections
-	disconnect_all_clients();
-	close(ctx->listen_socket);
+		// Accept last, so new sockets can't be mistaken for ready ones above
+		if (FD_ISSET(ctx->listen_socket, &ready)) {
+			if (handle_connect(ctx->listen_socket, ctx) == -1) {
+				fprintf(stderr, "error handling incomming connection\n");
+			}
+		}
+	} // while(running)
+
+	// close remaining connections, the listening socket stays open for a restart.
+	// No files stay open, the card may get unmounted, and cached content is freed.
+	disconnect_all_clients(ctx);
+	timer_cancel(&stats_timer);
+	if (ctx->stats_callback != NULL) {
+		report_stats(ctx);
+	}
+	readahead_shutdown();
+	file_cache_clear();
+	content_cache_clear();
 	notify_user_ctx(ServerStopped, NULL);
 	return 0;
 }
 
 void uftpd_stop(uftpd_ctx *ctx) { ctx->running = false; }
+void uftpd_drain(uftpd_ctx *ctx) { ctx->draining = true; }
+void uftpd_resume(uftpd_ctx *ctx) { ctx->draining = false; }
+void uftpd_deinit(uftpd_ctx *ctx) {
+	if (close(ctx->listen_socket) == -1) {
+		perror("close");
+	}
+	FD_CLR(ctx->listen_socket, &ctx->master);
+	ctx->listen_socket = -1;
+}
 void uftpd_set_ev_callback(uftpd_ctx *ctx, uftpd_callback callback) { ctx->ev_callback = callback; }
 void uftpd_set_start_dir(uftpd_ctx *ctx, const char *start_dir) { ctx->start_dir = start_dir; }
+void uftpd_set_compression_level(uftpd_ctx *ctx, int level) {
+	ctx->compression_level = level < 0 ? 0 : level > ZSTREAM_MAX_LEVEL ? ZSTREAM_MAX_LEVEL : level;
+}
+void uftpd_set_content_cache(uftpd_ctx *ctx, size_t budget, size_t max_file_size) {
+	ctx->content_cache_budget = budget;
+	ctx->content_cache_max_file_size = max_file_size;
+}
+void uftpd_set_stats_callback(uftpd_ctx *ctx, uftpd_stats_callback callback, uint32_t interval_ms) {
+	ctx->stats_callback = callback;
+	ctx->stats_interval_ms = interval_ms < TIMER_TICK_MS ? TIMER_TICK_MS : interval_ms;
+}
+void uftpd_get_cache_stats(uftpd_ctx *ctx, uftpd_cache_stats *stats) {
+	UNUSED(ctx);
+	ContentCacheStats content;
+	content_cache_stats(&content);
+	stats->hits = content.hits;
+	stats->misses = content.misses;
+	stats->loads = content.loads;
+	stats->evictions = content.evictions;
+	stats->entries = content.entries;
+	stats->bytes = content.bytes;
+	stats->budget = content.budget;
+}
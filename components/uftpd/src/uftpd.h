@@ -2,6 +2,7 @@
 
 #include <netdb.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -20,15 +21,57 @@ typedef enum uftpd_event {
 /// optional context information.
 typedef void (*uftpd_callback)(enum uftpd_event ev, const char *details);
 
+/// Hit rate and memory use of the content cache.
+typedef struct uftpd_cache_stats {
+	uint32_t hits;
+	uint32_t misses;
+	uint32_t loads;     ///< Files read into the cache
+	uint32_t evictions; ///< Files dropped to stay within the budget
+	size_t entries;
+	size_t bytes;  ///< Content held by cached files
+	size_t budget; ///< 0 if the cache is disabled
+} uftpd_cache_stats;
+
+/// Transfer state of a connected client.
+typedef struct uftpd_session_stats {
+	char user[32];
+	char ip[16];
+	char file[64];        ///< File of the running transfer as the client sees it, empty if none
+	bool storing;         ///< The running transfer is an upload
+	uint64_t bytes;       ///< Bytes moved by the running transfer
+	uint64_t total_bytes; ///< Bytes moved over data connections since the client connected
+	uint32_t rate;        ///< Bytes per second over the last interval
+} uftpd_session_stats;
+
+#define UFTPD_STATS_MAX_SESSIONS 4
+
+/// Throughput of the server, reported every stats interval.
+typedef struct uftpd_transfer_stats {
+	uint32_t rate;        ///< Bytes per second of all clients over the last interval
+	uint32_t interval_ms; ///< Length of the last interval
+	size_t session_count; ///< Connected clients, transferring ones come first in sessions
+	uftpd_session_stats sessions[UFTPD_STATS_MAX_SESSIONS];
+} uftpd_transfer_stats;
+
+/// A stats callback is called by the event loop, it should copy what it needs and return quickly.
+typedef void (*uftpd_stats_callback)(const uftpd_transfer_stats *stats);
+
 /// Handle for every server instance.
 typedef struct uftpd_ctx {
 	int listen_socket;
 	fd_set master;
 	int fd_max;
-	bool running;
+	// Set by uftpd_stop, uftpd_drain and uftpd_resume from other tasks
+	volatile bool running;
+	volatile bool draining;
 
 	const char *start_dir;
+	int compression_level;
+	size_t content_cache_budget;
+	size_t content_cache_max_file_size;
 	uftpd_callback ev_callback;
+	uftpd_stats_callback stats_callback;
+	uint32_t stats_interval_ms;
 } uftpd_ctx;
 
 /// Intitialize the given handle by setting up a socket that listents to the given addr.
@@ -37,19 +80,52 @@ int uftpd_init(uftpd_ctx *ctx, struct addrinfo *addr);
 /// Use getaddrinfo and use port to intialize the server/sockets.
 int uftpd_init_localhost(uftpd_ctx *ctx, const char *port);
 
-/// Start the event loop, this functions blocks forever.
+/// Start the event loop, this functions blocks until the server is stopped or drained.
+/// It returns at once if it was stopped or drained before, even before it got to run.
+/// After a drain it can be called again to serve on the same listening socket once
+/// uftpd_resume was called.
 int uftpd_start(uftpd_ctx *ctx);
 
-/// Stop the event loop.
+/// Stop the event loop for good, uftpd_deinit is all that is left to do.
+/// Running transfers are aborted and their clients get told the offset to resume from using REST.
 void uftpd_stop(uftpd_ctx *ctx);
 
+/// Stop accepting new clients and let running transfers finish.
+/// Idle clients get disconnected and the event loop returns once the last client is gone.
+/// The drain stays requested until uftpd_resume is called.
+void uftpd_drain(uftpd_ctx *ctx);
+
+/// Clear a drain, so the event loop keeps running or uftpd_start serves again.
+void uftpd_resume(uftpd_ctx *ctx);
+
+/// Close the listening socket once the event loop is not going to be started again.
+void uftpd_deinit(uftpd_ctx *ctx);
+
 /// Set a callback function that gets called when an event happens.
 void uftpd_set_ev_callback(uftpd_ctx *ctx, uftpd_callback callback);
 
 /// Set the starting directory that is the clients first working directory.
+/// Clients see it as "/" and can't access anything outside of it.
 /// NOTE: start_dir has to valid as long as the server lives.
 /// No copy will be made.
 void uftpd_set_start_dir(uftpd_ctx *ctx, const char *start_dir);
 
+/// Set the default deflate level (0-9) of new clients using MODE Z, 6 if not set.
+/// Clients can change their level using OPTS MODE Z LEVEL.
+void uftpd_set_compression_level(uftpd_ctx *ctx, int level);
+
+/// Keep up to budget bytes of files up to max_file_size bytes each in memory,
+/// PSRAM on the ESP32, once they are retrieved repeatedly. Disabled (0) by default.
+/// Takes effect when the event loop is started, the memory is freed when it returns.
+void uftpd_set_content_cache(uftpd_ctx *ctx, size_t budget, size_t max_file_size);
+
+/// Get the hit rate and memory use of the content cache.
+/// Counters are updated by the event loop without locking, read them as estimates.
+void uftpd_get_cache_stats(uftpd_ctx *ctx, uftpd_cache_stats *stats);
+
+/// Get transfer statistics every interval_ms while the event loop runs, and once
+/// without any sessions when it returns. NULL stops them.
+void uftpd_set_stats_callback(uftpd_ctx *ctx, uftpd_stats_callback callback, uint32_t interval_ms);
+
 #define UFTPD_H
 #endif
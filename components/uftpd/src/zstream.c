@@ -0,0 +1,208 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "zstream.h"
+
+#ifdef ESP_PLATFORM
+
+#include "rom/miniz.h"
+
+struct ZStream {
+	bool compress;
+	bool done;
+	tdefl_compressor *deflator;
+	tinfl_decompressor *inflator;
+
+	// The inflator needs its whole window as output buffer,
+	// decompressed data is copied out of it from there.
+	uint8_t *window;
+	size_t window_pos;  // Where the inflator continues writing
+	size_t pending_pos; // Decompressed data not handed out yet
+	size_t pending_len;
+};
+
+ZStream *zstream_new(bool compress, int level) {
+	// Number of probes per level as used by miniz for zlib levels
+	static const mz_uint probes[ZSTREAM_MAX_LEVEL + 1] = {0,   1,   6,   32,  16,
+	                                                      32,  128, 256, 512, 768};
+
+	ZStream *z = malloc(sizeof(ZStream));
+	if (z == NULL) {
+		return NULL;
+	}
+	z->compress = compress;
+	z->done = false;
+	z->deflator = NULL;
+	z->inflator = NULL;
+	z->window = NULL;
+
+	if (compress) {
+		if ((z->deflator = malloc(sizeof(tdefl_compressor))) == NULL) {
+			free(z);
+			return NULL;
+		}
+		int flags = TDEFL_WRITE_ZLIB_HEADER | probes[level];
+		if (level <= 3) {
+			flags |= TDEFL_GREEDY_PARSING_FLAG;
+		}
+		if (level == 0) {
+			flags |= TDEFL_FORCE_ALL_RAW_BLOCKS;
+		}
+		tdefl_init(z->deflator, NULL, NULL, flags);
+	} else {
+		z->inflator = malloc(sizeof(tinfl_decompressor));
+		z->window = malloc(TINFL_LZ_DICT_SIZE);
+		if (z->inflator == NULL || z->window == NULL) {
+			zstream_free(z);
+			return NULL;
+		}
+		z->window_pos = 0;
+		z->pending_pos = 0;
+		z->pending_len = 0;
+		tinfl_init(z->inflator);
+	}
+	return z;
+}
+
+static int zstream_deflate(ZStream *z, const void *in, size_t *in_len, void *out, size_t *out_len,
+                           bool finish) {
+	tdefl_status status =
+	    tdefl_compress(z->deflator, in, in_len, out, out_len, finish ? TDEFL_FINISH : TDEFL_NO_FLUSH);
+	if (status == TDEFL_STATUS_DONE) {
+		z->done = true;
+		return 1;
+	}
+	return status == TDEFL_STATUS_OKAY ? 0 : -1;
+}
+
+static int zstream_inflate(ZStream *z, const uint8_t *in, size_t *in_len, uint8_t *out,
+                           size_t *out_len, bool finish) {
+	size_t in_total = 0;
+	size_t out_total = 0;
+	for (;;) {
+		// Hand out what was decompressed before
+		size_t n = *out_len - out_total;
+		if (n > z->pending_len) {
+			n = z->pending_len;
+		}
+		memcpy(out + out_total, z->window + z->pending_pos, n);
+		z->pending_pos += n;
+		z->pending_len -= n;
+		out_total += n;
+		if (z->pending_len > 0 || z->done) {
+			break;
+		}
+
+		size_t in_bytes = *in_len - in_total;
+		size_t out_bytes = TINFL_LZ_DICT_SIZE - z->window_pos;
+		tinfl_status status = tinfl_decompress(
+		    z->inflator, in + in_total, &in_bytes, z->window, z->window + z->window_pos, &out_bytes,
+		    TINFL_FLAG_PARSE_ZLIB_HEADER | (finish ? 0 : TINFL_FLAG_HAS_MORE_INPUT));
+		in_total += in_bytes;
+		z->pending_pos = z->window_pos;
+		z->pending_len = out_bytes;
+		z->window_pos = (z->window_pos + out_bytes) & (TINFL_LZ_DICT_SIZE - 1);
+
+		if (status < TINFL_STATUS_DONE) {
+			return -1;
+		} else if (status == TINFL_STATUS_DONE) {
+			z->done = true;
+		} else if (status == TINFL_STATUS_NEEDS_MORE_INPUT && out_bytes == 0) {
+			break;
+		}
+	}
+	*in_len = in_total;
+	*out_len = out_total;
+	return zstream_finished(z) ? 1 : 0;
+}
+
+int zstream_run(ZStream *z, const void *in, size_t *in_len, void *out, size_t *out_len,
+                bool finish) {
+	if (z->compress) {
+		if (z->done) {
+			*in_len = 0;
+			*out_len = 0;
+			return 1;
+		}
+		return zstream_deflate(z, in, in_len, out, out_len, finish);
+	}
+	return zstream_inflate(z, in, in_len, out, out_len, finish);
+}
+
+bool zstream_finished(const ZStream *z) { return z->done && (z->compress || z->pending_len == 0); }
+
+void zstream_free(ZStream *z) {
+	if (z == NULL) {
+		return;
+	}
+	free(z->deflator);
+	free(z->inflator);
+	free(z->window);
+	free(z);
+}
+
+#else
+
+#include <zlib.h>
+
+struct ZStream {
+	bool compress;
+	bool done;
+	z_stream strm;
+};
+
+ZStream *zstream_new(bool compress, int level) {
+	ZStream *z = calloc(1, sizeof(ZStream));
+	if (z == NULL) {
+		return NULL;
+	}
+	z->compress = compress;
+	int res = compress ? deflateInit(&z->strm, level) : inflateInit(&z->strm);
+	if (res != Z_OK) {
+		free(z);
+		return NULL;
+	}
+	return z;
+}
+
+int zstream_run(ZStream *z, const void *in, size_t *in_len, void *out, size_t *out_len,
+                bool finish) {
+	if (z->done) {
+		*in_len = 0;
+		*out_len = 0;
+		return 1;
+	}
+
+	z->strm.next_in = (Bytef *)in;
+	z->strm.avail_in = *in_len;
+	z->strm.next_out = out;
+	z->strm.avail_out = *out_len;
+	int res = z->compress ? deflate(&z->strm, finish ? Z_FINISH : Z_NO_FLUSH)
+	                      : inflate(&z->strm, Z_NO_FLUSH);
+	*in_len -= z->strm.avail_in;
+	*out_len -= z->strm.avail_out;
+
+	if (res == Z_STREAM_END) {
+		z->done = true;
+		return 1;
+	}
+	// No progress possible is fine, more input or output space is coming
+	return res == Z_OK || res == Z_BUF_ERROR ? 0 : -1;
+}
+
+bool zstream_finished(const ZStream *z) { return z->done; }
+
+void zstream_free(ZStream *z) {
+	if (z == NULL) {
+		return;
+	}
+	if (z->compress) {
+		deflateEnd(&z->strm);
+	} else {
+		inflateEnd(&z->strm);
+	}
+	free(z);
+}
+
+#endif
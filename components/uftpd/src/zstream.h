@@ -0,0 +1,33 @@
+#ifndef ZSTREAM_H
+#define ZSTREAM_H
+#include <stdbool.h>
+#include <stddef.h>
+
+// Streaming zlib (RFC 1950) compression and decompression used by MODE Z.
+//
+// On the ESP32 the deflate implementation in ROM (miniz) is used,
+// elsewhere zlib. The compressor needs about 300 KiB on the ESP32,
+// so it ends up in PSRAM.
+
+#define ZSTREAM_MAX_LEVEL 9
+
+typedef struct ZStream ZStream;
+
+// Create a stream compressing with level 0 (store only) to ZSTREAM_MAX_LEVEL,
+// or decompressing if compress is false. Returns NULL if out of memory.
+ZStream *zstream_new(bool compress, int level);
+
+// Process up to *in_len bytes of in and write up to *out_len bytes to out.
+// Both are updated to the number of bytes actually consumed and produced.
+// finish tells that no more input follows in.
+// Returns 1 once the end of the stream was written/read, 0 if more is to come
+// and -1 on invalid compressed data.
+int zstream_run(ZStream *z, const void *in, size_t *in_len, void *out, size_t *out_len,
+                bool finish);
+
+// Whether the end of the stream was reached and all output was handed out
+bool zstream_finished(const ZStream *z);
+
+void zstream_free(ZStream *z);
+
+#endif /* end of include guard */
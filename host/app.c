@@ -0,0 +1,98 @@
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "display.h"
+#include "sim.h"
+#include "spibus.h"
+
+
+// Runs ogo-ftpd as a Linux process, see the README for how to build it.
+//
+// SIM_KEYS names a key script for sim_keys_load, a script pressing MENU ends the
+// app like on the device. SIM_PANEL and SIM_FB name PPM files the panel and fb are
+// written to on SIGUSR2 and when it exits. SIGUSR1 drops the Wi-Fi link, SIGINT and
+// SIGTERM exit.
+
+void app_main(void);
+
+static void dump(void)
+{
+    const char *path = getenv("SIM_PANEL");
+    if (path && sim_dump_panel(path) != 0) {
+        perror(path);
+    }
+    path = getenv("SIM_FB");
+    if (path && fb && sim_dump_ppm(fb, path) != 0) {
+        perror(path);
+    }
+}
+
+static void report(void)
+{
+    sim_spi_stats_t spi;
+    display_stats_t display;
+    spibus_stats_t bus;
+    sim_get_spi_stats(&spi);
+    display_get_stats(&display);
+    spibus_get_stats(&bus);
+    printf("spi: %u transactions, %u commands, %llu bytes, %llu us on the bus, %u queued at most\n",
+           spi.transactions, spi.commands, (unsigned long long)spi.bytes,
+           (unsigned long long)spi.bus_us, spi.max_queued);
+    printf("display: %u updates, %llu pixels, drawing held up %llu us, by a full frame %u us\n",
+           display.updates, (unsigned long long)display.pixels,
+           (unsigned long long)display.update_us, display.frame_us);
+    printf("spibus: display waited %llu us in %u acquires, deferred %u times\n",
+           (unsigned long long)bus.wait_us[SPIBUS_DISPLAY], bus.acquired[SPIBUS_DISPLAY], bus.deferred);
+    dump();
+}
+
+// Signals are taken here rather than in a handler, the simulated radio takes locks
+static void *signal_thread(void *arg)
+{
+    sigset_t *set = arg;
+    for (;;) {
+        int sig;
+        if (sigwait(set, &sig) != 0) {
+            continue;
+        }
+        if (sig == SIGUSR1) {
+            printf("sim: dropping the Wi-Fi link\n");
+            sim_wifi_drop();
+        } else if (sig == SIGUSR2) {
+            dump();
+        } else {
+            exit(0);
+        }
+    }
+    return NULL;
+}
+
+int main(void)
+{
+    // Block the signals before any task starts so only signal_thread sees them
+    static sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIGUSR2);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    pthread_t thread;
+    pthread_create(&thread, NULL, signal_thread, &set);
+    // A peer closing a socket makes send fail with EPIPE like under lwIP
+    signal(SIGPIPE, SIG_IGN);
+
+    const char *keys = getenv("SIM_KEYS");
+    if (keys && sim_keys_load(keys) != 0) {
+        fprintf(stderr, "%s: not a key script\n", keys);
+        return 1;
+    }
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    atexit(report);
+
+    // The tasks app_main starts keep running once it returns, like on the device
+    app_main();
+    pthread_exit(NULL);
+}
@@ -0,0 +1,46 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "esp_ota_ops.h"
+#include "esp_partition.h"
+#include "esp_system.h"
+#include "nvs_flash.h"
+
+
+// The firmware the app returns to on the device
+static const esp_partition_t s_factory = {
+    .type = ESP_PARTITION_TYPE_APP,
+    .subtype = ESP_PARTITION_SUBTYPE_APP_FACTORY,
+    .address = 0x10000,
+    .size = 0x100000,
+    .label = "factory",
+};
+
+void esp_restart(void)
+{
+    printf("esp_restart\n");
+    exit(0);
+}
+
+esp_err_t nvs_flash_init(void)
+{
+    return ESP_OK;
+}
+
+const esp_partition_t *esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype,
+                                                const char *label)
+{
+    if (type != s_factory.type || (subtype != s_factory.subtype && subtype != ESP_PARTITION_SUBTYPE_ANY)) {
+        return NULL;
+    }
+    return &s_factory;
+}
+
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t *partition)
+{
+    if (partition == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    printf("boot partition: %s\n", partition->label);
+    return ESP_OK;
+}
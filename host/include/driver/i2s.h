@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "driver/gpio.h"
+#include "freertos/FreeRTOS.h"
+
+#define ESP_INTR_FLAG_LEVEL1 (1 << 1)
+
+typedef enum { I2S_NUM_0, I2S_NUM_1 } i2s_port_t;
+
+typedef enum {
+    I2S_MODE_MASTER = 1,
+    I2S_MODE_SLAVE = 2,
+    I2S_MODE_TX = 4,
+    I2S_MODE_RX = 8,
+    I2S_MODE_DAC_BUILT_IN = 16,
+} i2s_mode_t;
+
+typedef enum { I2S_CHANNEL_FMT_RIGHT_LEFT = 0x00 } i2s_channel_fmt_t;
+typedef enum { I2S_COMM_FORMAT_I2S = 0x01, I2S_COMM_FORMAT_I2S_MSB = 0x02 } i2s_comm_format_t;
+
+typedef struct {
+    i2s_mode_t mode;
+    int sample_rate;
+    int bits_per_sample;
+    i2s_channel_fmt_t channel_format;
+    i2s_comm_format_t communication_format;
+    int intr_alloc_flags;
+    int dma_buf_count;
+    int dma_buf_len;
+    bool use_apll;
+} i2s_config_t;
+
+typedef struct i2s_pin_config_t i2s_pin_config_t;
+
+esp_err_t i2s_driver_install(i2s_port_t i2s_num, const i2s_config_t *i2s_config, int queue_size, void *i2s_queue);
+esp_err_t i2s_set_pin(i2s_port_t i2s_num, const i2s_pin_config_t *pin);
+esp_err_t i2s_write(i2s_port_t i2s_num, const void *src, size_t size, size_t *bytes_written, TickType_t ticks_to_wait);
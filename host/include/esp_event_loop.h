@@ -0,0 +1,6 @@
+#pragma once
+
+#include "esp_event.h"
+
+// Events are handed to cb one at a time from their own task
+esp_err_t esp_event_loop_init(system_event_cb_t cb, void *ctx);
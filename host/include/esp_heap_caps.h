@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdlib.h>
+
+#define MALLOC_CAP_EXEC (1 << 0)
+#define MALLOC_CAP_32BIT (1 << 1)
+#define MALLOC_CAP_8BIT (1 << 2)
+#define MALLOC_CAP_DMA (1 << 3)
+#define MALLOC_CAP_SPIRAM (1 << 10)
+#define MALLOC_CAP_INTERNAL (1 << 11)
+#define MALLOC_CAP_DEFAULT (1 << 12)
+
+// Every allocation can be read by the simulated DMA, word aligned like on the device
+static inline void *heap_caps_malloc(size_t size, int caps)
+{
+    (void)caps;
+    return aligned_alloc(4, (size + 3) & ~(size_t)3);
+}
+
+static inline void *heap_caps_calloc(size_t n, size_t size, int caps)
+{
+    (void)caps;
+    return calloc(n, size);
+}
+
+// The host doesn't tell internal memory apart, report roughly what an ESP32 has free
+// once the app is loaded and before its drivers allocate anything
+#ifndef SIM_INTERNAL_FREE
+#define SIM_INTERNAL_FREE (280 * 1024)
+#endif
+
+static inline size_t heap_caps_get_free_size(int caps)
+{
+    (void)caps;
+    return SIM_INTERNAL_FREE;
+}
+
+static inline size_t heap_caps_get_largest_free_block(int caps)
+{
+    (void)caps;
+    return SIM_INTERNAL_FREE;
+}
@@ -0,0 +1,6 @@
+#pragma once
+
+#include "esp_err.h"
+
+// Ends the process, there is nothing to restart into on the host
+void esp_restart(void) __attribute__((noreturn));
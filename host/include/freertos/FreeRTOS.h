@@ -0,0 +1,39 @@
+#pragma once
+
+// The subset of FreeRTOS the components use, on POSIX threads. Ticks are
+// milliseconds like CONFIG_FREERTOS_HZ=1000 on the device.
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+
+#define pdFALSE 0
+#define pdTRUE 1
+#define pdFAIL pdFALSE
+#define pdPASS pdTRUE
+
+#define portMAX_DELAY ((TickType_t)0xffffffffUL)
+#define portTICK_PERIOD_MS ((TickType_t)1)
+#define portTICK_RATE_MS portTICK_PERIOD_MS
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+
+// Critical sections guard short updates shared with other tasks
+typedef pthread_mutex_t portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED PTHREAD_MUTEX_INITIALIZER
+#define portENTER_CRITICAL(mux) pthread_mutex_lock(mux)
+#define portEXIT_CRITICAL(mux) pthread_mutex_unlock(mux)
+#define portYIELD_FROM_ISR() ((void)0)
+
+#define configASSERT(x) assert(x)
+
+// Memory placement makes no difference on the host
+#define DRAM_ATTR
+#define IRAM_ATTR
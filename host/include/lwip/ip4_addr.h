@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stdint.h>
+
+// An IPv4 address in network byte order
+typedef struct ip4_addr {
+    uint32_t addr;
+} ip4_addr_t;
+
+#define ip4_addr1(ip) (((const uint8_t *)(&(ip)->addr))[0])
+#define ip4_addr2(ip) (((const uint8_t *)(&(ip)->addr))[1])
+#define ip4_addr3(ip) (((const uint8_t *)(&(ip)->addr))[2])
+#define ip4_addr4(ip) (((const uint8_t *)(&(ip)->addr))[3])
+
+#define IPSTR "%d.%d.%d.%d"
+#define IP2STR(ipaddr) ip4_addr1(ipaddr), ip4_addr2(ipaddr), ip4_addr3(ipaddr), ip4_addr4(ipaddr)
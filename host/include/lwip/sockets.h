@@ -0,0 +1,8 @@
+#pragma once
+
+// lwIP offers the BSD socket API, the host's is used as is
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
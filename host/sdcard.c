@@ -0,0 +1,50 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "sdcard.h"
+
+
+// The card is a directory on the host, SDCARD_MOUNT_POINT names it
+static bool s_present = false;
+static sdcard_speed_t s_speed = { 0 };
+
+esp_err_t sdcard_init(const char *mount_path)
+{
+    sdcard_config_t config = SDCARD_CONFIG_DEFAULT();
+    return sdcard_init_config(mount_path, &config);
+}
+
+esp_err_t sdcard_init_config(const char *mount_path, const sdcard_config_t *config)
+{
+    struct stat st;
+    memset(&s_speed, 0, sizeof(s_speed));
+    if (stat(mount_path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        printf("sdcard: %s is not a directory\n", mount_path);
+        return ESP_FAIL;
+    }
+    s_present = true;
+    s_speed.freq_khz = config->max_freq_khz;
+    // The host's disk says nothing about the card, so there is no self test
+    printf("sdcard: using %s\n", mount_path);
+    return ESP_OK;
+}
+
+esp_err_t sdcard_deinit(void)
+{
+    if (!s_present) {
+        return ESP_FAIL;
+    }
+    s_present = false;
+    return ESP_OK;
+}
+
+bool sdcard_present(void)
+{
+    return s_present;
+}
+
+void sdcard_get_speed(sdcard_speed_t *speed)
+{
+    *speed = s_speed;
+}
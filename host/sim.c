@@ -0,0 +1,611 @@
+#include <ctype.h>
+#include <endian.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "driver/adc.h"
+#include "driver/gpio.h"
+#include "driver/i2s.h"
+#include "driver/ledc.h"
+#include "driver/spi_master.h"
+#include "esp_timer.h"
+
+#include "display.h"
+#include "keypad.h"
+#include "sim.h"
+
+
+// The panel and how the board wires the keypad, see keypad.c
+#define PANEL_WIDTH DISPLAY_WIDTH
+#define PANEL_HEIGHT DISPLAY_HEIGHT
+#define LEDC_DUTY_MAX 0x1fff
+#define JOY_X ADC1_CHANNEL_6
+#define JOY_Y ADC1_CHANNEL_7
+#define JOY_FULL 4095
+#define JOY_HALF 2048
+
+#define SPI_MAX_QUEUE 32
+#define KEYS_MAX_STEPS 256
+
+static const struct {
+    gpio_num_t pin;
+    uint16_t key;
+} s_key_pins[] = {
+    { GPIO_NUM_27, KEYPAD_SELECT },
+    { GPIO_NUM_39, KEYPAD_START },
+    { GPIO_NUM_32, KEYPAD_A },
+    { GPIO_NUM_33, KEYPAD_B },
+    { GPIO_NUM_13, KEYPAD_MENU },
+    { GPIO_NUM_0, KEYPAD_VOLUME },
+};
+
+static const struct {
+    const char *name;
+    uint16_t key;
+} s_key_names[] = {
+    { "UP", KEYPAD_UP },
+    { "RIGHT", KEYPAD_RIGHT },
+    { "DOWN", KEYPAD_DOWN },
+    { "LEFT", KEYPAD_LEFT },
+    { "SELECT", KEYPAD_SELECT },
+    { "START", KEYPAD_START },
+    { "A", KEYPAD_A },
+    { "B", KEYPAD_B },
+    { "MENU", KEYPAD_MENU },
+    { "VOLUME", KEYPAD_VOLUME },
+};
+
+struct spi_device_t {
+    int clock_speed_hz;
+    int queue_size;
+    transaction_cb_t pre_cb;
+    transaction_cb_t post_cb;
+    // Transactions in queue order, the first sent of them are sent
+    spi_transaction_t *queue[SPI_MAX_QUEUE];
+    int head;
+    int count;
+    int sent;
+};
+
+static struct spi_device_t s_display;
+static sim_spi_stats_t s_spi_stats = { 0 };
+static int s_gpio_levels[GPIO_NUM_MAX];
+
+// ILI9341 state: the command being written and the window pixels go to
+static uint16_t s_panel[PANEL_WIDTH * PANEL_HEIGHT];
+static uint8_t s_panel_cmd;
+static uint8_t s_panel_args[4];
+static int s_panel_argc;
+static int s_col_start, s_col_end, s_page_start, s_page_end;
+static int s_col, s_page;
+static int s_panel_byte = -1; // First byte of a pixel split across transactions
+
+static struct {
+    int64_t start_us;
+    int count;
+    uint32_t ms[KEYS_MAX_STEPS];
+    uint16_t keys[KEYS_MAX_STEPS];
+} s_keys;
+
+static int s_backlight_duty = 0;
+static uint64_t s_audio_bytes = 0;
+
+esp_err_t gpio_set_direction(gpio_num_t gpio_num, gpio_mode_t mode)
+{
+    return gpio_num < GPIO_NUM_MAX ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t gpio_set_pull_mode(gpio_num_t gpio_num, gpio_pull_mode_t pull)
+{
+    return gpio_num < GPIO_NUM_MAX ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t gpio_set_level(gpio_num_t gpio_num, uint32_t level)
+{
+    if (gpio_num >= GPIO_NUM_MAX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    s_gpio_levels[gpio_num] = level != 0;
+    return ESP_OK;
+}
+
+int gpio_get_level(gpio_num_t gpio_num)
+{
+    // The buttons pull their pin low
+    for (size_t i = 0; i < sizeof(s_key_pins) / sizeof(s_key_pins[0]); i++) {
+        if (s_key_pins[i].pin == gpio_num) {
+            return !(sim_keys_pressed() & s_key_pins[i].key);
+        }
+    }
+    return gpio_num < GPIO_NUM_MAX ? s_gpio_levels[gpio_num] : 0;
+}
+
+esp_err_t adc1_config_width(adc_bits_width_t width_bit)
+{
+    return ESP_OK;
+}
+
+esp_err_t adc1_config_channel_atten(adc1_channel_t channel, adc_atten_t atten)
+{
+    return ESP_OK;
+}
+
+int adc1_get_raw(adc1_channel_t channel)
+{
+    const uint16_t keys = sim_keys_pressed();
+    if (channel == JOY_X) {
+        return keys & KEYPAD_LEFT ? JOY_FULL : keys & KEYPAD_RIGHT ? JOY_HALF : 0;
+    }
+    if (channel == JOY_Y) {
+        return keys & KEYPAD_UP ? JOY_FULL : keys & KEYPAD_DOWN ? JOY_HALF : 0;
+    }
+    return 0;
+}
+
+esp_err_t ledc_timer_config(const ledc_timer_config_t *timer_conf)
+{
+    return ESP_OK;
+}
+
+esp_err_t ledc_channel_config(const ledc_channel_config_t *ledc_conf)
+{
+    s_backlight_duty = ledc_conf->duty;
+    return ESP_OK;
+}
+
+esp_err_t ledc_fade_func_install(int intr_alloc_flags)
+{
+    return ESP_OK;
+}
+
+esp_err_t ledc_set_fade_with_time(ledc_mode_t speed_mode, ledc_channel_t channel, uint32_t target_duty, int max_fade_time_ms)
+{
+    s_backlight_duty = target_duty;
+    return ESP_OK;
+}
+
+esp_err_t ledc_fade_start(ledc_mode_t speed_mode, ledc_channel_t channel, ledc_fade_mode_t fade_mode)
+{
+    return ESP_OK;
+}
+
+int sim_backlight_percent(void)
+{
+    return (s_backlight_duty * 100 + LEDC_DUTY_MAX / 2) / LEDC_DUTY_MAX;
+}
+
+esp_err_t i2s_driver_install(i2s_port_t i2s_num, const i2s_config_t *i2s_config, int queue_size, void *i2s_queue)
+{
+    return ESP_OK;
+}
+
+esp_err_t i2s_set_pin(i2s_port_t i2s_num, const i2s_pin_config_t *pin)
+{
+    return ESP_OK;
+}
+
+esp_err_t i2s_write(i2s_port_t i2s_num, const void *src, size_t size, size_t *bytes_written, TickType_t ticks_to_wait)
+{
+    s_audio_bytes += size;
+    *bytes_written = size;
+    return ESP_OK;
+}
+
+uint64_t sim_audio_bytes(void)
+{
+    return s_audio_bytes;
+}
+
+static void panel_command(uint8_t cmd)
+{
+    s_panel_cmd = cmd;
+    s_panel_argc = 0;
+    s_panel_byte = -1;
+    if (cmd == 0x2C) {
+        s_col = s_col_start;
+        s_page = s_page_start;
+    }
+}
+
+static void panel_pixel(uint16_t color)
+{
+    if (s_page > s_page_end) {
+        return;
+    }
+    if (s_col < PANEL_WIDTH && s_page < PANEL_HEIGHT) {
+        s_panel[s_page * PANEL_WIDTH + s_col] = color;
+    }
+    if (++s_col > s_col_end) {
+        s_col = s_col_start;
+        s_page++;
+    }
+}
+
+static void panel_data(const uint8_t *data, size_t len)
+{
+    switch (s_panel_cmd) {
+    case 0x2A: // Column address set
+    case 0x2B: // Page address set
+        for (size_t i = 0; i < len && s_panel_argc < 4; i++) {
+            s_panel_args[s_panel_argc++] = data[i];
+        }
+        if (s_panel_argc == 4) {
+            const int start = s_panel_args[0] << 8 | s_panel_args[1];
+            const int end = s_panel_args[2] << 8 | s_panel_args[3];
+            if (s_panel_cmd == 0x2A) {
+                s_col_start = start;
+                s_col_end = end;
+            } else {
+                s_page_start = start;
+                s_page_end = end;
+            }
+        }
+        break;
+    case 0x2C: // Memory write
+    case 0x3C: // Memory write continue
+        for (size_t i = 0; i < len; i++) {
+            if (s_panel_byte < 0) {
+                s_panel_byte = data[i];
+            } else {
+                panel_pixel(s_panel_byte << 8 | data[i]);
+                s_panel_byte = -1;
+            }
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+static void spi_send(struct spi_device_t *dev, spi_transaction_t *t)
+{
+    if (dev->pre_cb) {
+        dev->pre_cb(t);
+    }
+    const uint8_t *data = t->flags & SPI_TRANS_USE_TXDATA ? t->tx_data : t->tx_buffer;
+    const size_t len = t->length / 8;
+    // D/C is the only pin the callbacks set, see display.c
+    if (s_gpio_levels[GPIO_NUM_21]) {
+        panel_data(data, len);
+    } else if (len > 0) {
+        panel_command(data[0]);
+        panel_data(data + 1, len - 1);
+        s_spi_stats.commands++;
+    }
+    s_spi_stats.transactions++;
+    s_spi_stats.bytes += len;
+    s_spi_stats.bus_us += (uint64_t)t->length * 1000000 / dev->clock_speed_hz;
+    if (dev->post_cb) {
+        dev->post_cb(t);
+    }
+}
+
+esp_err_t spi_bus_initialize(spi_host_device_t host, const spi_bus_config_t *bus_config, int dma_chan)
+{
+    return ESP_OK;
+}
+
+esp_err_t spi_bus_add_device(spi_host_device_t host, const spi_device_interface_config_t *dev_config,
+                             spi_device_handle_t *handle)
+{
+    if (dev_config->queue_size > SPI_MAX_QUEUE / 2) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memset(&s_display, 0, sizeof(s_display));
+    s_display.clock_speed_hz = dev_config->clock_speed_hz;
+    s_display.queue_size = dev_config->queue_size;
+    s_display.pre_cb = dev_config->pre_cb;
+    s_display.post_cb = dev_config->post_cb;
+    *handle = &s_display;
+    return ESP_OK;
+}
+
+esp_err_t spi_device_queue_trans(spi_device_handle_t handle, spi_transaction_t *trans_desc, TickType_t ticks_to_wait)
+{
+    // A full queue has sent its oldest transaction by the time there is room
+    if (handle->count - handle->sent == handle->queue_size) {
+        spi_send(handle, handle->queue[(handle->head + handle->sent) % SPI_MAX_QUEUE]);
+        handle->sent++;
+    }
+    if (handle->count == SPI_MAX_QUEUE) {
+        return ESP_ERR_TIMEOUT;
+    }
+    handle->queue[(handle->head + handle->count) % SPI_MAX_QUEUE] = trans_desc;
+    handle->count++;
+    if ((uint32_t)handle->count > s_spi_stats.max_queued) {
+        s_spi_stats.max_queued = handle->count;
+    }
+    return ESP_OK;
+}
+
+esp_err_t spi_device_get_trans_result(spi_device_handle_t handle, spi_transaction_t **trans_desc,
+                                      TickType_t ticks_to_wait)
+{
+    if (handle->count == 0) {
+        return ESP_ERR_TIMEOUT;
+    }
+    if (handle->sent == 0) {
+        spi_send(handle, handle->queue[handle->head]);
+        handle->sent++;
+    }
+    *trans_desc = handle->queue[handle->head];
+    handle->head = (handle->head + 1) % SPI_MAX_QUEUE;
+    handle->count--;
+    handle->sent--;
+    return ESP_OK;
+}
+
+esp_err_t spi_device_transmit(spi_device_handle_t handle, spi_transaction_t *trans_desc)
+{
+    spi_transaction_t *done;
+    esp_err_t err = spi_device_queue_trans(handle, trans_desc, portMAX_DELAY);
+    while (err == ESP_OK) {
+        err = spi_device_get_trans_result(handle, &done, portMAX_DELAY);
+        if (done == trans_desc) {
+            break;
+        }
+    }
+    return err;
+}
+
+void sim_get_spi_stats(sim_spi_stats_t *stats)
+{
+    *stats = s_spi_stats;
+}
+
+void sim_reset_spi_stats(void)
+{
+    memset(&s_spi_stats, 0, sizeof(s_spi_stats));
+}
+
+uint16_t sim_panel_pixel(int x, int y)
+{
+    return s_panel[y * PANEL_WIDTH + x];
+}
+
+static int write_ppm(const char *path, int width, int height, uint16_t (*pixel)(const void *, int, int), const void *arg)
+{
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        return -1;
+    }
+    fprintf(f, "P6\n%d %d\n255\n", width, height);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            const uint16_t c = pixel(arg, x, y);
+            const uint8_t rgb[3] = {
+                (c >> 11) << 3 | (c >> 13),
+                ((c >> 5) & 0x3f) << 2 | ((c >> 9) & 0x03),
+                (c & 0x1f) << 3 | ((c >> 2) & 0x07),
+            };
+            fwrite(rgb, 1, sizeof(rgb), f);
+        }
+    }
+    return fclose(f) == 0 ? 0 : -1;
+}
+
+static uint16_t gbuf_pixel(const void *arg, int x, int y)
+{
+    const gbuf_t *g = arg;
+    const uint16_t c = ((const uint16_t *)g->data)[y * g->width + x];
+    return g->endian == BIG_ENDIAN ? (uint16_t)(c << 8 | c >> 8) : c;
+}
+
+static uint16_t panel_pixel_at(const void *arg, int x, int y)
+{
+    return sim_panel_pixel(x, y);
+}
+
+int sim_dump_ppm(const gbuf_t *g, const char *path)
+{
+    if (g->bytes_per_pixel != 2) {
+        return -1;
+    }
+    return write_ppm(path, g->width, g->height, gbuf_pixel, g);
+}
+
+int sim_dump_panel(const char *path)
+{
+    return write_ppm(path, PANEL_WIDTH, PANEL_HEIGHT, panel_pixel_at, NULL);
+}
+
+static int parse_keys(const char *s, uint16_t *keys)
+{
+    *keys = 0;
+    if (strcmp(s, "-") == 0) {
+        return 0;
+    }
+    while (*s) {
+        const size_t len = strcspn(s, "+");
+        size_t i = 0;
+        while (i < sizeof(s_key_names) / sizeof(s_key_names[0]) &&
+               !(strlen(s_key_names[i].name) == len && strncasecmp(s, s_key_names[i].name, len) == 0)) {
+            i++;
+        }
+        if (i == sizeof(s_key_names) / sizeof(s_key_names[0])) {
+            return -1;
+        }
+        *keys |= s_key_names[i].key;
+        s += len;
+        if (*s == '+') {
+            s++;
+        }
+    }
+    return 0;
+}
+
+int sim_keys_script(const char *script)
+{
+    s_keys.count = 0;
+    s_keys.start_us = esp_timer_get_time();
+    while (*script) {
+        const size_t len = strcspn(script, "\n");
+        char line[128];
+        snprintf(line, sizeof(line), "%.*s", (int)len, script);
+        script += len + (script[len] == '\n');
+
+        unsigned ms;
+        char keys[96];
+        const char *p = line;
+        while (isspace((unsigned char)*p)) {
+            p++;
+        }
+        if (*p == '\0' || *p == '#') {
+            continue;
+        }
+        if (sscanf(p, "%u %95s", &ms, keys) != 2 || s_keys.count == KEYS_MAX_STEPS ||
+            parse_keys(keys, &s_keys.keys[s_keys.count]) == -1) {
+            fprintf(stderr, "sim: bad key script line: %s\n", line);
+            return -1;
+        }
+        s_keys.ms[s_keys.count++] = ms;
+    }
+    return 0;
+}
+
+int sim_keys_load(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return -1;
+    }
+    char script[8192];
+    const size_t len = fread(script, 1, sizeof(script) - 1, f);
+    fclose(f);
+    script[len] = '\0';
+    return sim_keys_script(script);
+}
+
+// The step of the script in effect now, -1 before the first one
+static int keys_step(void)
+{
+    const int64_t ms = (esp_timer_get_time() - s_keys.start_us) / 1000;
+    int step = -1;
+    while (step + 1 < s_keys.count && s_keys.ms[step + 1] <= ms) {
+        step++;
+    }
+    return step;
+}
+
+uint16_t sim_keys_pressed(void)
+{
+    const int step = keys_step();
+    return step >= 0 ? s_keys.keys[step] : 0;
+}
+
+bool sim_keys_done(void)
+{
+    return keys_step() == s_keys.count - 1;
+}
+
+#ifdef TEST_SIM
+/* Draw a screen, check the panel shows it and replay a few keys:
+ * cc -O2 -DTEST_SIM -Ihost -Ihost/include -Icomponents/hardware/src -Icomponents/graphics \
+ *   host/sim.c host/freertos.c components/hardware/src/{display,spibus,keypad,backlight,audio,gbuf}.c \
+ *   components/graphics/{graphics,tf,OpenSans_Regular_11X12}.c -lpthread -o sim_test && ./sim_test
+ */
+
+#include "audio.h"
+#include "backlight.h"
+#include "graphics.h"
+#include "OpenSans_Regular_11X12.h"
+#include "tf.h"
+#include "freertos/task.h"
+
+static int check_panel(void)
+{
+    for (int y = 0; y < PANEL_HEIGHT; y++) {
+        for (int x = 0; x < PANEL_WIDTH; x++) {
+            if (sim_panel_pixel(x, y) != gbuf_pixel(fb, x, y)) {
+                printf("panel differs from fb at %d,%d\n", x, y);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// The last chunks of an update are still queued when it returns, they count for it
+static void print_spi_stats(const char *what)
+{
+    display_drain();
+    sim_spi_stats_t stats;
+    sim_get_spi_stats(&stats);
+    printf("%-14s %5u transactions, %4u commands, %7llu bytes, %6llu us on the bus, %2u queued at most\n",
+           what, stats.transactions, stats.commands, (unsigned long long)stats.bytes,
+           (unsigned long long)stats.bus_us, stats.max_queued);
+    sim_reset_spi_stats();
+}
+
+int main(void)
+{
+    int failures = 0;
+    display_init();
+    backlight_init();
+    backlight_percentage_set(50);
+    keypad_init();
+    print_spi_stats("init");
+
+    tf_t *font = tf_new(&font_OpenSans_Regular_11X12, 0xFFFF, 0, TF_ALIGN_CENTER);
+    tf_layout_t layout;
+    tf_layout(&layout, font, "ogo-ftpd simulator");
+    point_t p = { .x = fb->width / 2 - layout.metrics.width / 2, .y = 100 };
+    tf_draw_layout(fb, &layout, p);
+    display_flush();
+    print_spi_stats("text line");
+
+    rect_t box = { 40, 140, 240, 60 };
+    fill_rectangle(fb, box, 0x001F);
+    draw_rectangle(fb, box, DRAW_STYLE_SOLID, 0xFFFF);
+    display_flush();
+    print_spi_stats("box");
+
+    display_update();
+    print_spi_stats("full frame");
+    failures += check_panel();
+    sim_dump_ppm(fb, "sim_fb.ppm");
+    sim_dump_panel("sim_panel.ppm");
+
+    const TickType_t start = xTaskGetTickCount();
+    sim_keys_script("# press A, then START and B together\n"
+                    "0 -\n"
+                    "50 A\n"
+                    "150 -\n"
+                    "200 START+B\n"
+                    "300 -\n");
+    uint16_t pressed = 0;
+    int presses = 0;
+    while (!sim_keys_done() || pressed != 0) {
+        uint16_t changes;
+        pressed = keypad_debounce(keypad_sample(), &changes);
+        if (changes) {
+            printf("keys %03x at %u ms\n", pressed, xTaskGetTickCount() - start);
+            presses += (changes & pressed) != 0;
+        }
+        vTaskDelay(10);
+    }
+    if (presses != 2) {
+        printf("%d key presses, expected 2\n", presses);
+        failures++;
+    }
+
+    short samples[64] = { 0 };
+    audio_init(32000);
+    audio_submit(samples, 32);
+    printf("backlight %d%%, %llu audio bytes\n", sim_backlight_percent(), (unsigned long long)sim_audio_bytes());
+
+    display_clear(0);
+    for (int i = 0; i < PANEL_WIDTH * PANEL_HEIGHT; i++) {
+        if (s_panel[i] != 0) {
+            printf("panel not cleared\n");
+            failures++;
+            break;
+        }
+    }
+    tf_free(font);
+    printf("%d failures\n", failures);
+    return failures != 0;
+}
+#endif
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "gbuf.h"
+
+// Simulated Odroid-GO hardware for host builds.
+//
+// The components' own drivers (display.c, keypad.c, backlight.c, audio.c,
+// spibus.c) are built against the stand-in headers in host/include and this
+// file implements the ESP-IDF drivers they use: the SPI master feeds an
+// emulated ILI9341 panel, the keypad pins and joystick follow a key script,
+// the backlight and I2S just record what they are given.
+//
+// SPI transactions are sent when the driver would have to have sent them, when
+// their result is collected or the queue is full, so a buffer reused before its
+// transaction finished shows up on the panel.
+//
+// The whole app builds the same way with host/main.c: sim_wifi.c is a radio
+// that finds every network in wifi.json and hands out 127.0.0.1, sdcard.c
+// serves a local directory as the card and freertos.c runs the tasks as threads.
+
+typedef struct sim_spi_stats_t {
+    uint32_t transactions; // Transactions sent to the display
+    uint32_t commands;     // Of them with D/C low
+    uint64_t bytes;        // Bytes sent
+    uint64_t bus_us;       // Time sending them takes at the device clock
+    uint32_t max_queued;   // Most transactions queued or not collected at a time
+} sim_spi_stats_t;
+
+void sim_get_spi_stats(sim_spi_stats_t *stats);
+void sim_reset_spi_stats(void);
+
+// Write a buffer like fb as a binary PPM, -1 on error
+int sim_dump_ppm(const gbuf_t *g, const char *path);
+// Write what the panel shows as a binary PPM, -1 on error
+int sim_dump_panel(const char *path);
+// The pixel the panel shows at x, y in RGB565
+uint16_t sim_panel_pixel(int x, int y);
+
+// Replay key presses from lines of "<ms> <keys>", the keys like A+START or - for
+// none are pressed from ms after the script was loaded until the next line.
+// Lines starting with # are comments. Returns -1 on a line that does not parse.
+int sim_keys_script(const char *script);
+int sim_keys_load(const char *path);
+// Keys pressed now, as KEYPAD_* bits
+uint16_t sim_keys_pressed(void);
+// The last line of the script has been reached
+bool sim_keys_done(void);
+
+// Backlight duty the last fade went to, in percent
+int sim_backlight_percent(void);
+// Bytes written to I2S by audio_submit
+uint64_t sim_audio_bytes(void);
+
+// Lose the Wi-Fi link, the app sees SYSTEM_EVENT_STA_DISCONNECTED and reconnects
+void sim_wifi_drop(void);
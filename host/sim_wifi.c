@@ -0,0 +1,201 @@
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+#include "esp_event_loop.h"
+#include "esp_wifi.h"
+
+#include "sim.h"
+#include "wifi.h"
+
+
+// How long the radio takes for each step, roughly what an ESP32 takes on a quiet network
+#define SCAN_MS 120
+#define ASSOCIATE_MS 60
+#define DHCP_MS 40
+#define EVENT_QUEUE_LENGTH 16
+
+typedef struct sim_event_t {
+    TickType_t at;
+    system_event_t event;
+} sim_event_t;
+
+static system_event_cb_t s_handler = NULL;
+static void *s_handler_ctx = NULL;
+static QueueHandle_t s_events = NULL;
+static bool s_started = false;
+static bool s_connected = false;
+static wifi_config_t s_config = { 0 };
+static wifi_ap_record_t s_scan[8];
+static uint16_t s_scan_count = 0;
+
+// The event loop task, handing each event to the handler once it is due. Events
+// come in as they are posted and wait here sorted by when they are due.
+static void event_task(void *arg)
+{
+    sim_event_t pending[EVENT_QUEUE_LENGTH];
+    int count = 0;
+    for (;;) {
+        TickType_t wait = portMAX_DELAY;
+        if (count > 0) {
+            const int32_t due = pending[0].at - xTaskGetTickCount();
+            wait = due > 0 ? due : 0;
+        }
+        sim_event_t e;
+        if (count < EVENT_QUEUE_LENGTH && xQueueReceive(s_events, &e, wait) == pdTRUE) {
+            int i = count++;
+            for (; i > 0 && (int32_t)(pending[i - 1].at - e.at) > 0; i--) {
+                pending[i] = pending[i - 1];
+            }
+            pending[i] = e;
+            continue;
+        }
+        if (count == 0 || (int32_t)(pending[0].at - xTaskGetTickCount()) > 0) {
+            if (count == EVENT_QUEUE_LENGTH) {
+                vTaskDelay(1);
+            }
+            continue;
+        }
+        e = pending[0];
+        memmove(&pending[0], &pending[1], --count * sizeof(pending[0]));
+        if (s_handler) {
+            s_handler(s_handler_ctx, &e.event);
+        }
+    }
+}
+
+static void post(system_event_id_t id, uint32_t ms)
+{
+    sim_event_t e = { .at = xTaskGetTickCount() + ms / portTICK_PERIOD_MS };
+    e.event.event_id = id;
+    if (id == SYSTEM_EVENT_STA_GOT_IP) {
+        e.event.event_info.got_ip.ip_info.ip.addr = htonl(INADDR_LOOPBACK);
+    }
+    xQueueSend(s_events, &e, portMAX_DELAY);
+}
+
+void sim_wifi_drop(void)
+{
+    if (s_connected) {
+        s_connected = false;
+        post(SYSTEM_EVENT_STA_DISCONNECTED, 0);
+    }
+}
+
+void tcpip_adapter_init(void)
+{
+}
+
+esp_err_t esp_event_loop_init(system_event_cb_t cb, void *ctx)
+{
+    if (s_events != NULL) {
+        return ESP_FAIL;
+    }
+    s_handler = cb;
+    s_handler_ctx = ctx;
+    s_events = xQueueCreate(EVENT_QUEUE_LENGTH, sizeof(sim_event_t));
+    xTaskCreate(event_task, "event_task", 4096, NULL, 20, NULL);
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_init(const wifi_init_config_t *config)
+{
+    return s_events != NULL ? ESP_OK : ESP_ERR_INVALID_STATE;
+}
+
+esp_err_t esp_wifi_set_storage(wifi_storage_t storage)
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_mode(wifi_mode_t mode)
+{
+    return mode == WIFI_MODE_STA ? ESP_OK : ESP_ERR_NOT_SUPPORTED;
+}
+
+esp_err_t esp_wifi_start(void)
+{
+    if (!s_started) {
+        s_started = true;
+        post(SYSTEM_EVENT_STA_START, 0);
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_stop(void)
+{
+    if (s_started) {
+        s_started = false;
+        s_connected = false;
+        post(SYSTEM_EVENT_STA_STOP, 0);
+    }
+    return ESP_OK;
+}
+
+// Every network in wifi.json is in range, an empty SSID never connects
+esp_err_t esp_wifi_connect(void)
+{
+    if (!s_started) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (s_config.sta.ssid[0] == '\0') {
+        post(SYSTEM_EVENT_STA_DISCONNECTED, ASSOCIATE_MS);
+        return ESP_OK;
+    }
+    printf("sim: connecting to %s\n", (const char *)s_config.sta.ssid);
+    s_connected = true;
+    post(SYSTEM_EVENT_STA_CONNECTED, ASSOCIATE_MS);
+    post(SYSTEM_EVENT_STA_GOT_IP, ASSOCIATE_MS + DHCP_MS);
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_disconnect(void)
+{
+    if (!s_started) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    s_connected = false;
+    post(SYSTEM_EVENT_STA_DISCONNECTED, 0);
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_config(wifi_interface_t interface, wifi_config_t *conf)
+{
+    s_config = *conf;
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_scan_start(const wifi_scan_config_t *config, bool block)
+{
+    if (!s_started) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    s_scan_count = 0;
+    for (size_t i = 0; i < wifi_network_count && s_scan_count < sizeof(s_scan) / sizeof(s_scan[0]); i++) {
+        wifi_ap_record_t *ap = &s_scan[s_scan_count++];
+        memset(ap, 0, sizeof(*ap));
+        strncpy((char *)ap->ssid, wifi_networks[i]->ssid, sizeof(ap->ssid) - 1);
+        ap->rssi = -40 - 5 * i;
+        ap->authmode = wifi_networks[i]->authmode;
+    }
+    post(SYSTEM_EVENT_SCAN_DONE, SCAN_MS);
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_scan_get_ap_num(uint16_t *number)
+{
+    *number = s_scan_count;
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_scan_get_ap_records(uint16_t *number, wifi_ap_record_t *ap_records)
+{
+    if (*number > s_scan_count) {
+        *number = s_scan_count;
+    }
+    memcpy(ap_records, s_scan, *number * sizeof(wifi_ap_record_t));
+    return ESP_OK;
+}
@@ -1,6 +1,9 @@
+#include <assert.h>
+#include <string.h>
+
 #include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 #include "freertos/task.h"
-#include "freertos/queue.h"
 
 #include "event.h"
 #include "keypad.h"
@@ -9,8 +12,112 @@
 #define REPEAT_HOLDOFF (250/portTICK_PERIOD_MS)
 #define REPEAT_RATE (80/portTICK_PERIOD_MS)
 
-QueueHandle_t event_queue;
+typedef enum {
+    SLOT_KEYPAD,
+    SLOT_WIFI,
+    SLOT_UI,
+    SLOT_FTP_CLIENT,
+    SLOT_COUNT,
+} event_slot_t;
+
+typedef struct {
+    bool pending;
+    uint32_t order; // When it became pending
+    event_t event;
+} slot_t;
+
+static portMUX_TYPE s_mux = portMUX_INITIALIZER_UNLOCKED;
+static slot_t s_slots[SLOT_COUNT];
+static uint32_t s_order = 0;
+// Given when an event is posted. Task notifications of the main task are taken by the display.
+static SemaphoreHandle_t s_wake = NULL;
+
+
+static event_slot_t slot_of(event_type_t type)
+{
+    switch (type) {
+        case EVENT_TYPE_KEYPAD:
+            return SLOT_KEYPAD;
+        case EVENT_TYPE_WIFI_CONNECTED:
+        case EVENT_TYPE_WIFI_DISCONNECTED:
+        case EVENT_TYPE_WIFI_GOT_IP:
+            return SLOT_WIFI;
+        case EVENT_TYPE_UI_CHANGED:
+            return SLOT_UI;
+        default:
+            return SLOT_FTP_CLIENT;
+    }
+}
+
+// Merge event into the pending one of its kind
+static void merge(event_t *pending, const event_t *event)
+{
+    uint32_t count = pending->head.count;
+    switch (event->type) {
+        case EVENT_TYPE_KEYPAD:
+            pending->keypad.state = event->keypad.state;
+            pending->keypad.pressed |= event->keypad.pressed;
+            pending->keypad.released |= event->keypad.released;
+            break;
+        case EVENT_TYPE_FTP_CLIENT:
+            pending->ftp_client.clients += event->ftp_client.clients;
+            memcpy(pending->ftp_client.ip, event->ftp_client.ip, sizeof(pending->ftp_client.ip));
+            break;
+        default:
+            *pending = *event;
+            break;
+    }
+    pending->head.count = count + 1;
+}
+
+void event_post(const event_t *event)
+{
+    slot_t *slot = &s_slots[slot_of(event->type)];
 
+    portENTER_CRITICAL(&s_mux);
+    if (slot->pending) {
+        merge(&slot->event, event);
+    } else {
+        slot->event = *event;
+        slot->event.head.count = 1;
+        slot->order = s_order++;
+        slot->pending = true;
+    }
+    portEXIT_CRITICAL(&s_mux);
+
+    xSemaphoreGive(s_wake);
+}
+
+// Take the event whose kind became pending first
+static bool take(event_t *event)
+{
+    slot_t *first = NULL;
+    portENTER_CRITICAL(&s_mux);
+    for (int i = 0; i < SLOT_COUNT; i++) {
+        if (s_slots[i].pending && (!first || (int32_t)(s_slots[i].order - first->order) < 0)) {
+            first = &s_slots[i];
+        }
+    }
+    if (first) {
+        *event = first->event;
+        first->pending = false;
+    }
+    portEXIT_CRITICAL(&s_mux);
+    return first != NULL;
+}
+
+bool event_wait(event_t *event, TickType_t timeout)
+{
+    TickType_t start = xTaskGetTickCount();
+    while (!take(event)) {
+        TickType_t waited = xTaskGetTickCount() - start;
+        if (timeout != portMAX_DELAY && waited >= timeout) {
+            return false;
+        }
+        xSemaphoreTake(s_wake, timeout == portMAX_DELAY ? portMAX_DELAY : timeout - waited);
+    }
+    return true;
+}
 
 static void keypad_task(void *arg)
 {
@@ -44,13 +151,14 @@ static void keypad_task(void *arg)
         }
 
         if (event.keypad.pressed || event.keypad.released) {
-            xQueueSend(event_queue, &event, portMAX_DELAY);
+            event_post(&event);
         }
     }
 }
 
 void event_init(void)
 {
-    event_queue = xQueueCreate(4, sizeof(event_t));
+    s_wake = xSemaphoreCreateBinary();
+    assert(s_wake != NULL);
     xTaskCreate(keypad_task, "keypad", 1024, NULL, 5, NULL);
 }
@@ -5,22 +5,31 @@
 #include <stdint.h>
 
 #include <freertos/FreeRTOS.h>
-#include <freertos/queue.h>
-#include <uftpd.h>
+
+// Events for the main task.
+//
+// Posting never blocks: every kind of event has one slot, and an event posted
+// while the previous one of its kind is still pending is merged into it.
+// Status events keep the latest, counted events add up and keypad events collect
+// all keys that changed. Events carry their payload, nothing points into buffers
+// of the producer.
 
 typedef enum {
 	// Event to react to keypad presses
     EVENT_TYPE_KEYPAD,
-	// Event to react to wifi connection
+	// Event to react to wifi connection, only the latest of them is delivered
     EVENT_TYPE_WIFI_CONNECTED,
     EVENT_TYPE_WIFI_DISCONNECTED,
     EVENT_TYPE_WIFI_GOT_IP,
-	// ftp event
-    EVENT_TYPE_FTP_EVENT,
+	// Published UI state changed, see ui_state.h
+    EVENT_TYPE_UI_CHANGED,
+	// FTP clients connected or disconnected
+    EVENT_TYPE_FTP_CLIENT,
 } event_type_t;
 
 typedef struct {
     event_type_t type;
+    uint32_t count; // Events merged into this one
 } event_head_t;
 
 typedef struct {
@@ -32,16 +41,20 @@ typedef struct {
 
 typedef struct {
     event_head_t head;
-	uftpd_event ftp_event;
-	const char *details;
-} event_ftp_t;
+    int clients;  // Change of the number of connected clients
+    char ip[48];  // Address of the client that changed last
+} event_ftp_client_t;
 
 typedef union {
     event_type_t type;
+    event_head_t head;
     event_keypad_t keypad;
-    event_ftp_t ftp;
+    event_ftp_client_t ftp_client;
 } event_t;
 
-extern QueueHandle_t event_queue;
-
 void event_init(void);
+// Post an event from any task without waiting
+void event_post(const event_t *event);
+// Wait up to timeout for the next event, only called by the main task.
+// Events are delivered in the order their kind became pending.
+bool event_wait(event_t *event, TickType_t timeout);
@@ -9,62 +9,101 @@
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/queue.h"
+#include "freertos/semphr.h"
 
 #include "ftp_server.h"
 
 #include "event.h"
+#include "sdcard.h"
+#include "ui_state.h"
 #include <uftpd.h>
 #include <string.h>
 
-TaskHandle_t ftp_task_handle;
+TaskHandle_t volatile ftp_task_handle = NULL;
 uftpd_ctx ctx;
-bool restarting = true;
-char details_buf[128];
+static volatile bool restarting = true;
+// Given by the task once it is done with the card, ftp_stop waits for it
+static SemaphoreHandle_t stopped = NULL;
 
 static void ftp_task(void *arg) {
-	// Wait for notification to start
-	ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
 	while(restarting) {
+		// Wait for notification to (re)start
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+		if (!restarting) {
+			break;
+		}
 		puts("starting server\n");
 		uftpd_start(&ctx);
 	}
 	puts("stopping server\n");
+	uftpd_deinit(&ctx);
+	ftp_task_handle = NULL;
+	xSemaphoreGive(stopped);
 	vTaskDelete(NULL);
 }
 
-void ftp_restart(void) {
-	uftpd_stop(&ctx);
+// Let running transfers finish and wait for ftp_start before serving again
+void ftp_suspend(void) {
+	uftpd_drain(&ctx);
 }
 
+// Returns once the server closed its files and sockets, so the card can be unmounted
 void ftp_stop(void) {
 	restarting = false;
 	uftpd_stop(&ctx);
+	TaskHandle_t task = ftp_task_handle;
+	if (task == NULL) {
+		return;
+	}
+	// Wake the task up in case it is waiting to be started
+	xTaskNotifyGive(task);
+	xSemaphoreTake(stopped, portMAX_DELAY);
 }
 
+// Serve again after ftp_suspend, a drain that is still running is called off
 void ftp_start(void) {
-	xTaskNotifyGive(ftp_task_handle);
+	uftpd_resume(&ctx);
+	TaskHandle_t task = ftp_task_handle;
+	if (task != NULL) {
+		xTaskNotifyGive(task);
+	}
 }
 
+// Events are shown by the UI, which may be busy with the display
 void notify_user(uftpd_event ev, const char *details) {
-	event_t event;
-	event.type = EVENT_TYPE_FTP_EVENT;
-	event.ftp.ftp_event = ev;
+	ui_state_publish_ftp(ev, details);
 
-	if (details != NULL) {
-		strncpy(details_buf, details, sizeof(details_buf));
-		event.ftp.details = (const char*)&details_buf;
-	} else {
-		event.ftp.details = NULL;
+	if (ev == ClientConnected || ev == ClientDisconnected) {
+		event_t event = { .type = EVENT_TYPE_FTP_CLIENT };
+		event.ftp_client.clients = ev == ClientConnected ? 1 : -1;
+		snprintf(event.ftp_client.ip, sizeof(event.ftp_client.ip), "%s", details != NULL ? details : "");
+		event_post(&event);
 	}
-
-    xQueueSend(event_queue, &event, portMAX_DELAY);
 }
 
 void ftp_init(void) {
-	uftpd_init_localhost(&ctx, "21");
-	uftpd_set_start_dir(&ctx, "/sdcard");
+	// The task, its stack and the listening socket live until ftp_stop
+	if (ftp_task_handle != NULL) {
+		return;
+	}
+	if (stopped == NULL) {
+		stopped = xSemaphoreCreateBinary();
+	}
+	restarting = true;
+	uftpd_init_localhost(&ctx, FTP_PORT);
+	uftpd_set_start_dir(&ctx, SDCARD_MOUNT_POINT);
 	uftpd_set_ev_callback(&ctx, notify_user);
-    xTaskCreate(ftp_task, "ftp server", 65536, NULL, 3, &ftp_task_handle);
+	uftpd_set_stats_callback(&ctx, ui_state_publish_transfers, UI_STATS_MS);
+	// Low MODE Z level, so deflating doesn't become slower than the Wi-Fi link
+	uftpd_set_compression_level(&ctx, 1);
+#if CONFIG_SPIRAM_SUPPORT
+	// Small files fetched again and again, like save states and covers, are served from PSRAM
+	uftpd_set_content_cache(&ctx, 1024 * 1024, 64 * 1024);
+#endif
+	// Transfer buffers are on the heap, so the stack only needs to fit a command
+	TaskHandle_t task = NULL;
+	xTaskCreate(ftp_task, "ftp server", 16384, NULL, 3, &task);
+	ftp_task_handle = task;
 }
 
 
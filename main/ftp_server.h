@@ -1,10 +1,17 @@
 #pragma once
 
 #include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 
-extern TaskHandle_t ftp_task_handle;
+// Host builds run unprivileged and listen on another port
+#ifndef FTP_PORT
+#define FTP_PORT "21"
+#endif
+
+extern TaskHandle_t volatile ftp_task_handle;
 
 void ftp_init(void);
+// Stop serving and wait until the server let go of the card
 void ftp_stop(void);
 void ftp_start(void);
-void ftp_restart(void);
+void ftp_suspend(void);
@@ -1,4 +1,5 @@
 #include <stdint.h>
+#include <stdio.h>
 #include <string.h>
 
 #include "freertos/FreeRTOS.h"
@@ -7,6 +8,7 @@
 #include "esp_ota_ops.h"
 #include "esp_partition.h"
 #include "esp_system.h"
+#include "esp_heap_caps.h"
 #include "driver/gpio.h"
 
 #include "backlight.h"
@@ -16,14 +18,16 @@
 #include "wifi.h"
 #include "esp_spiffs.h"
 #include "ftp_server.h"
+#include "ui_state.h"
 
 #include "event.h"
 #include "graphics.h"
 #include "tf.h"
 #include "OpenSans_Regular_11X12.h"
 
-#define WIFI_CONFIG_PATH "/sdcard/wifi.json"
+#define WIFI_CONFIG_PATH SDCARD_MOUNT_POINT "/wifi.json"
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
 
 #ifndef VERSION
 #define VERSION "0.0.0"
@@ -47,9 +51,9 @@ void on_wifi_changed(system_event_id_t id) {
 			event.type = EVENT_TYPE_WIFI_DISCONNECTED;
 			break;
 		default:
-			break;
+			return;
 	}
-    xQueueSend(event_queue, &event, 0);
+	event_post(&event);
 }
 
 
@@ -78,40 +82,59 @@ char* wifi_state_str(wifi_state_t state) {
 static tf_t *ui_font;
 #define FONT_HEIGHT 12
 
+// Transfer dashboard: a throughput graph above the status lines and a row per FTP session below them
+#define GRAPH_X 8
+#define GRAPH_Y 16
+#define GRAPH_WIDTH 304
+#define GRAPH_HEIGHT 72
+#define GRAPH_SAMPLES (GRAPH_WIDTH / 2)
+#define GRAPH_MIN_SCALE (64 * 1024)
+#define GRAPH_COLOR 0x07E0
+#define GRAPH_AXIS_COLOR 0x4208
+#define SESSIONS_Y (100+FONT_HEIGHT*3+4)
+#define SESSION_BYTES_WIDTH 120
+
+static tf_t *ui_font_left;
+static tf_t *ui_font_right;
+
 static void ui_init() {
     ui_font = tf_new(&font_OpenSans_Regular_11X12, 0xFFFF, 0, TF_ALIGN_CENTER);
+    ui_font_left = tf_new(&font_OpenSans_Regular_11X12, 0xFFFF, GRAPH_WIDTH - SESSION_BYTES_WIDTH - 4, TF_ELIDE);
+    ui_font_right = tf_new(&font_OpenSans_Regular_11X12, 0xFFFF, SESSION_BYTES_WIDTH, TF_ALIGN_RIGHT);
 
 	// draw title
-	const char *title = APP_NAME " " VERSION;
-	tf_metrics_t m = tf_get_str_metrics(ui_font, title);
+	tf_layout_t title;
+	tf_layout(&title, ui_font, APP_NAME " " VERSION);
 	point_t text_location = {
-		.x = fb->width/2 - m.width/2,
+		.x = fb->width/2 - title.metrics.width/2,
 		.y = 0,
 	};
-	tf_draw_str(fb, ui_font, title, text_location);
+	tf_draw_layout(fb, &title, text_location);
 	display_update();
 }
 
 static void ui_free() {
 	free(ui_font);
+	free(ui_font_left);
+	free(ui_font_right);
 }
 
 static void ui_display_text_centered(int y, const char *text) {
-	tf_metrics_t m = tf_get_str_metrics(ui_font, text);
+	tf_layout_t layout;
+	tf_layout(&layout, ui_font, text);
 	// determine message location
 	point_t text_location = {
-		.x = fb->width/2 - m.width/2,
+		.x = fb->width/2 - layout.metrics.width/2,
 		.y = y,
 	};
 	rect_t clear_rec = {
 		.x = 0,
 		.y = text_location.y,
 		.width = fb->width,
-		.height = m.height,
+		.height = layout.metrics.height,
 	};
 	fill_rectangle(fb, clear_rec, 0);
-	tf_draw_str(fb, ui_font, text, text_location);
-	display_update();
+	tf_draw_layout(fb, &layout, text_location);
 }
 
 // Update the status display
@@ -120,24 +143,163 @@ static void ui_display_status() {
 	ip4_addr_t ip = wifi_get_ip();
 	snprintf(status, sizeof(status), "WIFI %s, IP:" IPSTR, wifi_state_str(wifi_get_state()), IP2STR(&ip));
 	ui_display_text_centered(100, status);
-	display_update();
 }
 
 const char *event_names[] = {
     "ServerStarted", "ServerStopped", "ClientConnected", "ClientDisconnected", "Error",
 };
 
-static void ui_display_ftp_status(event_ftp_t ev) {
+// Clients connected to the FTP server
+static int ftp_clients = 0;
+
+static void ui_display_ftp_status(const ui_ftp_status_t *status) {
 	char msg[128];
-	if (ev.details == NULL) {
-		snprintf(msg, sizeof(msg), "%s", event_names[ev.ftp_event]);
+	int len;
+	if (status->details[0] == '\0') {
+		len = snprintf(msg, sizeof(msg), "%s", event_names[status->event]);
 	} else {
-		snprintf(msg, sizeof(msg), "%s: %s", event_names[ev.ftp_event], ev.details);
+		len = snprintf(msg, sizeof(msg), "%s: %s", event_names[status->event], status->details);
+	}
+	if (ftp_clients > 0 && len >= 0 && (size_t)len < sizeof(msg)) {
+		snprintf(msg + len, sizeof(msg) - len, " (%d connected)", ftp_clients);
 	}
 	ui_display_text_centered(100+FONT_HEIGHT, msg);
 }
 
-const char *connect_prompt = "You now can connect to the ip address with port 21.";
+// Throughput of the last GRAPH_SAMPLES stats intervals, the oldest at graph_head
+static uint32_t graph_samples[GRAPH_SAMPLES];
+static int graph_head = 0;
+static bool graph_drawn = false;
+// Sessions shown in the rows below the status lines
+static uftpd_session_stats drawn_sessions[UFTPD_STATS_MAX_SESSIONS];
+static size_t drawn_session_count = 0;
+
+// Format a byte count or rate like "1.25 MB" or "312 KB"
+static void format_bytes(char *buf, size_t size, uint64_t bytes, const char *unit)
+{
+	if (bytes >= 1024 * 1024) {
+		uint64_t hundredths = bytes * 100 / (1024 * 1024);
+		snprintf(buf, size, "%u.%02u M%s", (unsigned)(hundredths / 100), (unsigned)(hundredths % 100), unit);
+	} else {
+		snprintf(buf, size, "%u K%s", (unsigned)(bytes / 1024), unit);
+	}
+}
+
+static uint32_t graph_peak(void)
+{
+	uint32_t peak = 0;
+	for (int i = 0; i < GRAPH_SAMPLES; i++) {
+		peak = MAX(peak, graph_samples[i]);
+	}
+	return peak;
+}
+
+// Draw the samples as a line scaled to the peak, with the current and peak rate on top
+static void ui_draw_graph(void)
+{
+	rect_t area = {
+		.x = GRAPH_X,
+		.y = GRAPH_Y,
+		.width = GRAPH_WIDTH,
+		.height = GRAPH_HEIGHT,
+	};
+	fill_rectangle(fb, area, 0);
+
+	const uint32_t peak = graph_peak();
+	const uint32_t scale = MAX(peak, GRAPH_MIN_SCALE);
+	const short baseline = GRAPH_Y + GRAPH_HEIGHT - 1;
+	point_t start = { .x = GRAPH_X, .y = baseline };
+	point_t end = { .x = GRAPH_X + GRAPH_WIDTH - 1, .y = baseline };
+	draw_line(fb, start, end, DRAW_STYLE_DOTTED, GRAPH_AXIS_COLOR);
+
+	// The line leaves the top line free for the labels
+	for (int i = 0; i < GRAPH_SAMPLES; i++) {
+		const uint32_t sample = graph_samples[(graph_head + i) % GRAPH_SAMPLES];
+		end.x = GRAPH_X + i*2;
+		end.y = baseline - (short)((uint64_t)sample * (GRAPH_HEIGHT - FONT_HEIGHT - 1) / scale);
+		if (i > 0 && (start.y != baseline || end.y != baseline)) {
+			draw_line(fb, start, end, DRAW_STYLE_SOLID, GRAPH_COLOR);
+		}
+		start = end;
+	}
+
+	char label[32];
+	char rate[16];
+	point_t text_location = { .x = GRAPH_X, .y = GRAPH_Y };
+	format_bytes(rate, sizeof(rate), graph_samples[(graph_head + GRAPH_SAMPLES - 1) % GRAPH_SAMPLES], "B/s");
+	tf_draw_str(fb, ui_font_left, rate, text_location);
+	format_bytes(rate, sizeof(rate), peak, "B/s");
+	snprintf(label, sizeof(label), "peak %s", rate);
+	text_location.x = GRAPH_X + GRAPH_WIDTH - SESSION_BYTES_WIDTH;
+	tf_draw_str(fb, ui_font_right, label, text_location);
+	graph_drawn = true;
+}
+
+// Draw a session row: who is transferring what on the left, how much and how fast on the right
+static void ui_draw_session(int row, const uftpd_session_stats *session)
+{
+	rect_t clear_rec = {
+		.x = 0,
+		.y = SESSIONS_Y + row*FONT_HEIGHT,
+		.width = fb->width,
+		.height = FONT_HEIGHT,
+	};
+	fill_rectangle(fb, clear_rec, 0);
+	if (session == NULL) {
+		return;
+	}
+
+	char who[128];
+	char what[48];
+	char bytes[16];
+	char rate[16];
+	const char *file = strrchr(session->file, '/');
+	file = file != NULL ? file + 1 : session->file;
+	snprintf(who, sizeof(who), "%s %s %s", session->user[0] != '\0' ? session->user : "-", session->ip, file);
+	if (session->file[0] == '\0') {
+		format_bytes(bytes, sizeof(bytes), session->total_bytes, "B");
+		snprintf(what, sizeof(what), "idle, %s total", bytes);
+	} else {
+		format_bytes(bytes, sizeof(bytes), session->bytes, "B");
+		format_bytes(rate, sizeof(rate), session->rate, "B/s");
+		snprintf(what, sizeof(what), "%s%s  %s", session->storing ? "up " : "", bytes, rate);
+	}
+
+	point_t text_location = { .x = GRAPH_X, .y = clear_rec.y };
+	tf_draw_str(fb, ui_font_left, who, text_location);
+	text_location.x = GRAPH_X + GRAPH_WIDTH - SESSION_BYTES_WIDTH;
+	tf_draw_str(fb, ui_font_right, what, text_location);
+}
+
+// Add the latest stats to the dashboard, only redrawing what changed
+static void ui_display_transfers() {
+	uftpd_transfer_stats stats;
+	ui_state_read_transfers(&stats);
+
+	// An idle server keeps scrolling zeros through an empty graph, which changes nothing
+	const bool graph_empty = graph_peak() == 0;
+	graph_samples[graph_head] = stats.rate;
+	graph_head = (graph_head + 1) % GRAPH_SAMPLES;
+	if (!graph_drawn || !graph_empty || stats.rate != 0) {
+		ui_draw_graph();
+	}
+
+	const size_t count = MIN(stats.session_count, UFTPD_STATS_MAX_SESSIONS);
+	for (size_t i = 0; i < UFTPD_STATS_MAX_SESSIONS; i++) {
+		const bool drawn = i < drawn_session_count;
+		if (i >= count) {
+			if (drawn) {
+				ui_draw_session(i, NULL);
+			}
+		} else if (!drawn || memcmp(&stats.sessions[i], &drawn_sessions[i], sizeof(drawn_sessions[i])) != 0) {
+			ui_draw_session(i, &stats.sessions[i]);
+			drawn_sessions[i] = stats.sessions[i];
+		}
+	}
+	drawn_session_count = count;
+}
+
+const char *connect_prompt = "You now can connect to the ip address with port " FTP_PORT ".";
 const char *help_msg0 = "MENU: Back to firmware | START: Restart app.";
 const char *help_msg1 = "If you can't connect restart might help :/";
 
@@ -146,30 +308,59 @@ static void ui_display_help() {
 	ui_display_text_centered(fb->height-2*FONT_HEIGHT, help_msg0);
 	ui_display_text_centered(fb->height-FONT_HEIGHT, help_msg1);
 
-	display_update();
+	display_flush();
 }
 
 static void ui_display_msg(const char *title, const char *msg) {
-	tf_metrics_t m1 = tf_get_str_metrics(ui_font, title);
-	tf_metrics_t m2 = tf_get_str_metrics(ui_font, msg);
+	tf_layout_t l1, l2;
+	tf_layout(&l1, ui_font, title);
+	tf_layout(&l2, ui_font, msg);
 	// determine message location
 	point_t text_location = {
-		.x = fb->width/2 - (MAX(m1.width,m2.width))/2,
-		.y = fb->height/2 - (m1.height+m2.height)/2,
+		.x = fb->width/2 - (MAX(l1.metrics.width,l2.metrics.width))/2,
+		.y = fb->height/2 - (l1.metrics.height+l2.metrics.height)/2,
 	};
 	rect_t clear_rec = {
 		.x = 0,
 		.y = text_location.y,
 		.width = fb->width,
-		.height = m1.height+m2.height,
+		.height = l1.metrics.height+l2.metrics.height,
 	};
 
 	fill_rectangle(fb, clear_rec, 0);
-	tf_draw_str(fb, ui_font, title, text_location);
-	text_location.y += m1.height;
-	tf_draw_str(fb, ui_font, msg, text_location);
+	tf_draw_layout(fb, &l1, text_location);
+	text_location.y += l1.metrics.height;
+	tf_draw_layout(fb, &l2, text_location);
 
-	display_update();
+	display_flush();
+}
+
+// Redraw the parts of the status UI that changed and send them to the display at once
+static void ui_redraw(uint32_t parts) {
+	if (parts & UI_PART_WIFI) {
+		ui_display_status();
+		ip4_addr_t ip = wifi_get_ip();
+		ui_display_text_centered(100+FONT_HEIGHT*2, ip.addr != 0 ? connect_prompt : "");
+	}
+	if (parts & UI_PART_FTP) {
+		ui_ftp_status_t status;
+		ui_state_read_ftp(&status);
+		ui_display_ftp_status(&status);
+	}
+	if (parts & UI_PART_TRANSFERS) {
+		ui_display_transfers();
+	}
+	display_flush();
+}
+
+// Print what is left of the internal memory once Wi-Fi is up, and what the display costs
+static void print_memory() {
+	display_stats_t display;
+	display_get_stats(&display);
+	printf("memory: %u bytes internal free, %u bytes largest DMA block, display %s, frame held drawing up %u us\n",
+	       (unsigned)heap_caps_get_free_size(MALLOC_CAP_INTERNAL),
+	       (unsigned)heap_caps_get_largest_free_block(MALLOC_CAP_DMA),
+	       display.zero_copy ? "sent from fb" : "copied", display.frame_us);
 }
 
 void restart() {
@@ -186,16 +377,30 @@ void restart() {
 static void main_task(void *arg) {
     event_t event;
 	bool running = true;
-	BaseType_t got_event;
+	bool got_event;
 	ui_display_status();
 	ui_display_help();
 
+	const TickType_t frame_ticks = UI_FRAME_MS / portTICK_PERIOD_MS;
+	TickType_t last_frame = xTaskGetTickCount() - frame_ticks;
+
 	while(running) {
-		// Handle events
-        got_event = xQueueReceive(event_queue, &event, portMAX_DELAY);
-		if (got_event != pdTRUE) {
+		// Sleep until the next event, or until the next frame is due if the UI changed
+		TickType_t wait = portMAX_DELAY;
+		if (ui_state_pending()) {
+			TickType_t since = xTaskGetTickCount() - last_frame;
+			wait = since >= frame_ticks ? 0 : frame_ticks - since;
+		}
+		got_event = event_wait(&event, wait);
+		if (ui_state_pending() && xTaskGetTickCount() - last_frame >= frame_ticks) {
+			last_frame = xTaskGetTickCount();
+			ui_redraw(ui_state_take());
+		}
+		if (!got_event) {
 			continue;
 		}
+
+		// Handle events
 		switch(event.type) {
 			case EVENT_TYPE_KEYPAD:
 				if (event.keypad.pressed & KEYPAD_MENU) {
@@ -205,21 +410,24 @@ static void main_task(void *arg) {
 				}
 				break;
 			case EVENT_TYPE_WIFI_DISCONNECTED:
-				ui_display_text_centered(100+FONT_HEIGHT*2, ""); // clears the line
-				ui_display_status();
-				ftp_stop();
-				ftp_init();
+				ui_state_touch(UI_PART_WIFI);
+				// Keep running transfers alive, GOT_IP starts serving again
+				ftp_suspend();
 				break;
 			case EVENT_TYPE_WIFI_CONNECTED:
-				ui_display_status();
+				ui_state_touch(UI_PART_WIFI);
 				break;
 			case EVENT_TYPE_WIFI_GOT_IP:
-				ui_display_text_centered(100+FONT_HEIGHT*2, connect_prompt);
-				ui_display_status();
+				ui_state_touch(UI_PART_WIFI);
+				print_memory();
 				ftp_start();
 				break;
-			case EVENT_TYPE_FTP_EVENT:
-				ui_display_ftp_status(event.ftp);
+			case EVENT_TYPE_UI_CHANGED:
+				// Redrawn above once the frame is due
+				break;
+			case EVENT_TYPE_FTP_CLIENT:
+				ftp_clients += event.ftp_client.clients;
+				ui_state_touch(UI_PART_FTP);
 				break;
 			default:
 				printf("other event detected: %d\n", event.type);
@@ -256,7 +464,13 @@ void app_main(void)
 	esp_err_t err;
 	ESP_ERROR_CHECK(nvs_flash_init());
 
-	if((err = sdcard_init("/sdcard")) != ESP_OK) {
+	// The FTP server keeps a file open per transfer and prefetch plus a few hot ones.
+	// The self test checks a new card copes with the fast clock and prints its speed.
+	sdcard_config_t sdcard_config = SDCARD_CONFIG_DEFAULT();
+	sdcard_config.max_freq_khz = SDMMC_FREQ_HIGHSPEED;
+	sdcard_config.max_files = 10;
+	sdcard_config.self_test_size = 256 * 1024;
+	if((err = sdcard_init_config(SDCARD_MOUNT_POINT, &sdcard_config)) != ESP_OK) {
 		ui_display_msg("SDCARD ERROR!", "Please insert the sdcard and restart the device.");
 		return;
 	}
@@ -0,0 +1,85 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "event.h"
+#include "ui_state.h"
+
+// Parts changed since the main task last redrew
+static volatile uint32_t s_dirty = 0;
+
+// Sequence locks of what the FTP task publishes: odd while it writes
+static volatile uint32_t s_ftp_seq = 0;
+static ui_ftp_status_t s_ftp = { 0 };
+static volatile uint32_t s_transfers_seq = 0;
+static uftpd_transfer_stats s_transfers = { 0 };
+
+// Copy size bytes of src, written under seq_lock, to dst
+static void seq_read(volatile uint32_t *seq_lock, void *dst, const void *src, size_t size)
+{
+	uint32_t seq;
+	do {
+		// The FTP task runs at a lower priority, let it finish writing
+		while ((seq = *seq_lock) & 1) {
+			vTaskDelay(1);
+		}
+		__sync_synchronize();
+		memcpy(dst, src, size);
+		__sync_synchronize();
+	} while (*seq_lock != seq);
+}
+
+void ui_state_publish_ftp(uftpd_event event, const char *details)
+{
+	s_ftp_seq++;
+	__sync_synchronize();
+	s_ftp.event = event;
+	snprintf(s_ftp.details, sizeof(s_ftp.details), "%s", details != NULL ? details : "");
+	__sync_synchronize();
+	s_ftp_seq++;
+
+	ui_state_touch(UI_PART_FTP);
+}
+
+void ui_state_publish_transfers(const uftpd_transfer_stats *stats)
+{
+	s_transfers_seq++;
+	__sync_synchronize();
+	s_transfers = *stats;
+	__sync_synchronize();
+	s_transfers_seq++;
+
+	ui_state_touch(UI_PART_TRANSFERS);
+}
+
+void ui_state_touch(uint32_t parts)
+{
+	// Only the first change wakes up the main task, it picks up later ones in the same frame
+	if (__sync_fetch_and_or(&s_dirty, parts) == 0) {
+		event_t event = { .type = EVENT_TYPE_UI_CHANGED };
+		event_post(&event);
+	}
+}
+
+bool ui_state_pending(void)
+{
+	return s_dirty != 0;
+}
+
+uint32_t ui_state_take(void)
+{
+	return __sync_fetch_and_and(&s_dirty, 0);
+}
+
+void ui_state_read_ftp(ui_ftp_status_t *status)
+{
+	seq_read(&s_ftp_seq, status, &s_ftp, sizeof(*status));
+}
+
+void ui_state_read_transfers(uftpd_transfer_stats *stats)
+{
+	seq_read(&s_transfers_seq, stats, &s_transfers, sizeof(*stats));
+}
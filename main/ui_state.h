@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <uftpd.h>
+
+// State shown by the status UI.
+//
+// Other tasks publish it without ever waiting for the display. The main task
+// redraws the parts that changed, at most once per UI_FRAME_MS, so a burst of
+// FTP events costs one redraw instead of stalling the FTP task behind the LCD.
+#define UI_FRAME_MS 100
+// Transfer statistics are reported by the FTP server this often
+#define UI_STATS_MS 500
+
+typedef enum {
+	UI_PART_WIFI = 1,
+	UI_PART_FTP = 2,
+	UI_PART_TRANSFERS = 4,
+} ui_part_t;
+
+typedef struct {
+	uftpd_event event;
+	char details[64]; // Empty if none
+} ui_ftp_status_t;
+
+// Publish the last FTP event, only called by the FTP task
+void ui_state_publish_ftp(uftpd_event event, const char *details);
+// Publish transfer statistics, only called by the FTP task
+void ui_state_publish_transfers(const uftpd_transfer_stats *stats);
+// Mark parts of the UI as changed, from any task
+void ui_state_touch(uint32_t parts);
+
+// Whether any part changed since the last ui_state_take
+bool ui_state_pending(void);
+// Get and reset the parts that changed
+uint32_t ui_state_take(void);
+void ui_state_read_ftp(ui_ftp_status_t *status);
+void ui_state_read_transfers(uftpd_transfer_stats *stats);